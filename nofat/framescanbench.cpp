@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#if defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
+// compares how proxyserver parses a receive ring, one header at a time
+// while routing, with indexing all complete frames in one pass first and
+// routing over that index.
+//
+// ./framescanbench [-r rounds] [-b ring size] [capture_file]
+//
+// the frames come from a capture log of proxyserver -C (every frame in the
+// order of the log, payloads zero where they were not captured), or are
+// made up: 8 to 200 bytes to a random uid, like game traffic. the stream
+// goes through a ring of the size of a connection buffer in the largest
+// pieces that fit, like reads would, and each parser consumes what is
+// complete after every piece. routing is a lookup in a flat uid table
+// with every other uid connected.
+//
+// the index costs more than it saves: the next header only depends on
+// the size of the one before, so the cpu loads it while still busy
+// routing anyway, and a second loop over the index comes on top.
+
+struct proxy_msg_header {
+	uint32_t size;
+	uint16_t port;
+	uint16_t destuid;
+} __attribute__ ((packed));
+
+// see proxyserver -C
+#define CAPTURE_MAGIC    "nofatcap"
+#define CAPTURE_BLOCK    (1 << 20)
+
+struct capture_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint64_t start_ns;
+	uint64_t reserved;
+};
+
+struct capture_record {
+	uint32_t reclen;
+	uint32_t size;
+	uint64_t ts_ns;
+	uint16_t srcuid;
+	uint16_t destuid;
+	uint16_t port;
+	uint16_t reserved;
+	uint32_t caplen;
+	uint32_t reserved2;
+};
+
+struct ring {
+	char * buf;
+	int size;
+	int start;
+	int len;
+
+	// as much of the stream from pos as there is room for
+	size_t fill(const std::string & stream, size_t pos) {
+		while (len < size && pos < stream.size()) {
+			int tail = start + len;
+			if (tail >= size) tail -= size;
+			int room = tail >= start ? size - tail : start - tail;
+			room = std::min(room, size - len);
+			const int n = (int) std::min<size_t>(room, stream.size() - pos);
+			memcpy(buf + tail, stream.data() + pos, n);
+			len += n;
+			pos += n;
+		}
+		return pos;
+	}
+	void consume(int n) {
+		len -= n;
+		if (len == 0) {
+			start = 0;
+		} else {
+			start += n;
+			if (start >= size) start -= size;
+		}
+	}
+	void copy_out(int pos, char * dst, int n) const {
+		int l = std::min(n, size - pos);
+		memcpy(dst, buf + pos, l);
+		memcpy(dst + l, buf, n - l);
+	}
+};
+
+// the complete frames at the front of the ring, up to the first one that
+// is incomplete or wraps around. the walk from size to size is serial, it
+// only keeps the raw word behind each size, the port / destuid swaps then
+// run over the whole index, 8 or 4 frames per shuffle with AVX2 / SSSE3
+#define FRAME_SCAN_MAX 128
+
+struct frame_scan {
+	int count;
+	int next;
+	int32_t size[FRAME_SCAN_MAX];
+	// port in the low half, destuid in the high half once swapped
+	uint32_t route[FRAME_SCAN_MAX];
+
+	int port(int i) const { return route[i] & 0xffff; }
+	int destuid(int i) const { return route[i] >> 16; }
+};
+
+// swap the bytes of both halves of n words
+void swap_halves(uint32_t * v, int n) {
+	int i = 0;
+#if defined(__AVX2__)
+	const __m256i m8 = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+										1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	for (; i + 8 <= n; i += 8) {
+		__m256i x = _mm256_loadu_si256((const __m256i *) (v + i));
+		_mm256_storeu_si256((__m256i *) (v + i), _mm256_shuffle_epi8(x, m8));
+	}
+#endif
+#if defined(__SSSE3__)
+	const __m128i m4 = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	for (; i + 4 <= n; i += 4) {
+		__m128i x = _mm_loadu_si128((const __m128i *) (v + i));
+		_mm_storeu_si128((__m128i *) (v + i), _mm_shuffle_epi8(x, m4));
+	}
+#endif
+	for (; i < n; ++i) {
+		v[i] = ((v[i] & 0x00ff00ff) << 8) | ((v[i] >> 8) & 0x00ff00ff);
+	}
+}
+
+void scan_frames(frame_scan * s, const ring & r) {
+	const int end = std::min(r.start + r.len, r.size);
+	int pos = r.start;
+	int n = 0;
+	while (n < FRAME_SCAN_MAX && end - pos >= (int) sizeof(proxy_msg_header)) {
+		uint32_t size;
+		memcpy(&size, r.buf + pos, sizeof(size));
+		memcpy(&s->route[n], r.buf + pos + sizeof(size), sizeof(uint32_t));
+		size = ntohl(size);
+		if ((int) size + 4 > end - pos) break;
+		s->size[n] = size;
+		pos += size + 4;
+		++n;
+	}
+	swap_halves(s->route, n);
+	s->count = n;
+	s->next  = 0;
+}
+
+double now() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// a peer_table of proxyserver, and what routing does with it
+struct conn {
+	uint64_t bytes;
+	char pad[56];
+};
+
+conn * peers[65536];
+
+struct tally {
+	uint64_t frames;
+	uint64_t misses;
+};
+
+inline void route(tally & t, int uid, int port, int in_msg_size) {
+	conn * peer = peers[uid];
+	if (peer) {
+		peer->bytes += in_msg_size + port;
+	} else {
+		++t.misses;
+	}
+	++t.frames;
+}
+
+// the copies into the ring alone
+void fill_only(ring & r, tally &) {
+	r.consume(r.len);
+}
+
+void per_frame(ring & r, tally & t) {
+	while (r.len >= 4) {
+		char hbuf[sizeof(proxy_msg_header)];
+		const proxy_msg_header * h = (const proxy_msg_header *) (r.buf + r.start);
+		if (r.start + (int) sizeof(proxy_msg_header) > r.size) {
+			r.copy_out(r.start, hbuf, sizeof(hbuf));
+			h = (const proxy_msg_header *) hbuf;
+		}
+		const int in_msg_size = ntohl(h->size);
+		if (in_msg_size + 4 > r.len) break;
+		route(t, ntohs(h->destuid), ntohs(h->port), in_msg_size);
+		r.consume(in_msg_size + 4);
+	}
+}
+
+void scanned(ring & r, tally & t) {
+	frame_scan scan;
+	scan.count = scan.next = 0;
+	while (r.len >= 4) {
+		if (scan.next == scan.count) {
+			scan_frames(&scan, r);
+		}
+		int in_msg_size;
+		if (scan.next < scan.count) {
+			in_msg_size = scan.size[scan.next];
+			route(t, scan.destuid(scan.next), scan.port(scan.next), in_msg_size);
+			++scan.next;
+		} else {
+			// wrapped or incomplete, one at a time again
+			char hbuf[sizeof(proxy_msg_header)];
+			const proxy_msg_header * h = (const proxy_msg_header *) (r.buf + r.start);
+			if (r.start + (int) sizeof(proxy_msg_header) > r.size) {
+				r.copy_out(r.start, hbuf, sizeof(hbuf));
+				h = (const proxy_msg_header *) hbuf;
+			}
+			in_msg_size = ntohl(h->size);
+			if (in_msg_size + 4 > r.len) break;
+			route(t, ntohs(h->destuid), ntohs(h->port), in_msg_size);
+		}
+		r.consume(in_msg_size + 4);
+	}
+}
+
+void append_frame(std::string & stream, int destuid, int port, const char * payload, int size, int caplen) {
+	proxy_msg_header h;
+	h.size    = htonl(size + 4);
+	h.port    = htons(port);
+	h.destuid = htons(destuid);
+	stream.append((const char *) &h, sizeof(h));
+	stream.append(payload, caplen);
+	stream.append(size - caplen, '\0');
+}
+
+// false if the file is no capture log. frames that do not fit into the
+// ring are left out, proxyserver would splice them
+bool load_capture(const char * path, int ring_size, std::string & stream, int & frames) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return false;
+	}
+	struct stat st;
+	fstat(fd, &st);
+	const size_t len = st.st_size;
+	if (len < sizeof(capture_header)) {
+		fprintf(stderr, "%s: not a capture log\n", path);
+		close(fd);
+		return false;
+	}
+	const char * base = (const char *) mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED || memcmp(base, CAPTURE_MAGIC, sizeof(((capture_header *) 0)->magic)) != 0) {
+		fprintf(stderr, "%s: not a capture log\n", path);
+		return false;
+	}
+	const uint64_t first = sizeof(capture_header);
+	uint64_t off = first;
+	while (off + sizeof(capture_record) <= len) {
+		const capture_record * r = (const capture_record *) (base + off);
+		if (r->reclen == 0) {
+			if ((off - first) % CAPTURE_BLOCK == 0) break;
+			off = first + ((off - first) / CAPTURE_BLOCK + 1) * CAPTURE_BLOCK;
+			continue;
+		}
+		if (r->reclen < sizeof(*r) || r->caplen > r->size || sizeof(*r) + r->caplen > r->reclen || off + r->reclen > len) {
+			fprintf(stderr, "broken record at %llu\n", (unsigned long long) off);
+			break;
+		}
+		if (r->size + sizeof(proxy_msg_header) <= (size_t) ring_size) {
+			append_frame(stream, r->destuid, r->port, (const char *) (r + 1), r->size, r->caplen);
+			++frames;
+		}
+		off += r->reclen;
+	}
+	munmap((void *) base, len);
+	return true;
+}
+
+void usage(const char * argv0) {
+	fprintf(stderr,
+			"%s [-r rounds] [-b ring size] [capture_file]\n"
+			"default: -r 20 -b 4032, 1M made up frames without a capture file\n", argv0);
+}
+
+int main(int argc, char ** argv) {
+	int rounds = 20;
+	// FDCTX_CLIENT_BUFSIZE of the -mx32 build
+	int ring_size = 4032;
+	int opt;
+	while ((opt = getopt(argc, argv, "r:b:h")) != -1) {
+		switch (opt) {
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'b':
+			ring_size = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (rounds < 1 || ring_size < 64) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	std::string stream;
+	int frames = 0;
+	if (optind < argc) {
+		if (! load_capture(argv[optind], ring_size, stream, frames)) return 1;
+	} else {
+		srand(1);
+		char payload[200];
+		memset(payload, 'x', sizeof(payload));
+		for (; frames < 1000000; ++frames) {
+			append_frame(stream, rand() % 60000, 7, payload, 4 + rand() % 193, 0);
+		}
+	}
+	if (frames == 0) {
+		fprintf(stderr, "no frames\n");
+		return 1;
+	}
+	printf("%d frames, %.1f bytes per frame, %d byte ring\n", frames, (double) stream.size() / frames, ring_size);
+
+	static conn conns[32768];
+	for (int uid = 0; uid < 65536; uid += 2) {
+		peers[uid] = &conns[uid / 2];
+	}
+
+	ring r;
+	r.buf  = (char *) malloc(ring_size);
+	r.size = ring_size;
+
+	const char * names[] = { "per frame", "scanned", "fill only" };
+	void (* parsers[])(ring &, tally &) = { per_frame, scanned, fill_only };
+	uint64_t misses[2];
+	for (int p = 0; p < 3; ++p) {
+		tally t = { 0, 0 };
+		const double start = now();
+		for (int i = 0; i < rounds; ++i) {
+			r.start = r.len = 0;
+			size_t pos = 0;
+			while (pos < stream.size()) {
+				pos = r.fill(stream, pos);
+				parsers[p](r, t);
+			}
+		}
+		const double secs = now() - start;
+		const double total = (double) frames * rounds;
+		printf("%-10s %8.1f M frames/s %6.2f ns/frame\n", names[p], total / secs / 1e6, secs * 1e9 / total);
+		if (p == 2) break;
+		misses[p] = t.misses;
+		if (t.frames != (uint64_t) frames * rounds) {
+			printf("%s parsed %llu frames instead of %llu\n", names[p], (unsigned long long) t.frames, (unsigned long long) frames * rounds);
+			return 1;
+		}
+	}
+	if (misses[0] != misses[1]) {
+		printf("the parsers do not agree\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <set>
+#include <vector>
+#include <algorithm>
+#include <utility>
+
+// compares the uid -> connection lookup proxyserver used to do (16 entry
+// MRU cache per sender in front of a std::set) with the flat uid table.
+//
+// ./lookupbench [lookups]
+//
+// "random" picks any connected uid for every message, "game" lets every
+// sender talk to the 7 other players of its game, which is what the MRU
+// cache was good at.
+
+struct conn {
+	int faf_uid;
+	char pad[60];
+};
+
+struct conn_less_by_uid {
+	bool operator()(const conn * a, const conn * b) const {
+		return a->faf_uid < b->faf_uid;
+	}
+};
+
+typedef std::set<conn *, conn_less_by_uid> conn_set_t;
+
+#define MAX_PEERS 16
+struct mru_cache {
+	int npeers;
+	conn * peers[MAX_PEERS];
+	conn * find(int uid) {
+		for (int i = 0; i < npeers; ++i) {
+			if (peers[i]->faf_uid == uid) return peers[i];
+		}
+		return NULL;
+	}
+	void add(conn * p) {
+		if (npeers == MAX_PEERS) --npeers;
+		memmove(peers + 1, peers, npeers * sizeof(conn *));
+		peers[0] = p;
+		++npeers;
+	}
+	mru_cache() : npeers(0) { }
+};
+
+double now() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char ** argv) {
+	const int lookups = argc > 1 ? atoi(argv[1]) : 20000000;
+	const int sizes[] = { 1000, 10000, 60000 };
+
+	printf("%8s %8s %12s %12s %12s\n", "uids", "pattern", "set ns", "mru+set ns", "table ns");
+
+	for (int si = 0; si < 3; ++si) {
+		const int nconn = sizes[si];
+
+		std::vector<int> uids(65536);
+		for (int i = 0; i < 65536; ++i) uids[i] = i;
+		srand(nconn);
+		for (int i = 65535; i > 0; --i) std::swap(uids[i], uids[rand() % (i + 1)]);
+		uids.resize(nconn);
+
+		std::vector<conn *> conns(nconn);
+		conn_set_t set;
+		conn ** table = (conn **) calloc(65536, sizeof(conn *));
+		for (int i = 0; i < nconn; ++i) {
+			conns[i] = new conn;
+			conns[i]->faf_uid = uids[i];
+			set.insert(conns[i]);
+			table[uids[i]] = conns[i];
+		}
+
+		for (int pattern = 0; pattern < 2; ++pattern) {
+			// (sender, destuid) pairs, generated up front
+			std::vector<int> senders(lookups), dests(lookups);
+			for (int i = 0; i < lookups; ++i) {
+				int s = rand() % nconn;
+				senders[i] = s;
+				if (pattern == 0) {
+					dests[i] = uids[rand() % nconn];
+				} else {
+					int game = s / 8;
+					int d = game * 8 + rand() % 8;
+					dests[i] = uids[d < nconn ? d : s];
+				}
+			}
+
+			conn finder;
+			uintptr_t sink = 0;
+
+			double t0 = now();
+			for (int i = 0; i < lookups; ++i) {
+				finder.faf_uid = dests[i];
+				sink += (uintptr_t) *set.find(&finder);
+			}
+			double t1 = now();
+
+			std::vector<mru_cache> caches(nconn);
+			for (int i = 0; i < lookups; ++i) {
+				mru_cache & c = caches[senders[i]];
+				conn * p = c.find(dests[i]);
+				if (! p) {
+					finder.faf_uid = dests[i];
+					p = *set.find(&finder);
+					c.add(p);
+				}
+				sink += (uintptr_t) p;
+			}
+			double t2 = now();
+
+			for (int i = 0; i < lookups; ++i) {
+				sink += (uintptr_t) table[dests[i]];
+			}
+			double t3 = now();
+
+			printf("%8d %8s %12.1f %12.1f %12.1f%s\n", nconn, pattern ? "game" : "random",
+				   (t1 - t0) * 1e9 / lookups, (t2 - t1) * 1e9 / lookups, (t3 - t2) * 1e9 / lookups,
+				   sink == 42 ? " " : "");
+		}
+
+		for (int i = 0; i < nconn; ++i) delete conns[i];
+		free(table);
+	}
+}
@@ -4,6 +4,8 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <time.h>
 
 #include <netdb.h>
@@ -11,17 +13,34 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <poll.h>
 #include <sys/signal.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <linux/io_uring.h>
+#include <linux/mempolicy.h>
 
-#include <set>
 #include <vector>
+#include <string>
 #include <algorithm>
 
 #define DEFAULT_PORT 9134
 
-#define MAX_DESC_PER_MESSAGE 256
-#define MAX_CONTROL_MESSAGE_SIZE (4 + MAX_DESC_PER_MESSAGE * sizeof(int))
+// SCM_MAX_FD, the kernel refuses more descriptors per message
+#define MAX_DESC_PER_MESSAGE 253
+// "dsc2" followed by a desc_record per descriptor, each followed by the
+// unparsed input of the connection and what was not written to it yet.
+// the old "desc" format only carried the uid after the tag.
+#define MAX_CONTROL_MESSAGE_SIZE 65536
 #define MAX_CONTROL_MESSAGE_CONTROL_SIZE (CMSG_SPACE(MAX_DESC_PER_MESSAGE * sizeof(int)))
 
 template <int size, bool C>
@@ -42,7 +61,122 @@ struct optional_buf<size, false> {
 
 struct fd_ctx;
 
-int total_sockets = 0;
+// outbound queue limit per connection, see -o and -d
+int out_hwm = 1 << 20;
+bool drop_slow_peers = false;
+// back context pools with hugepages, see -H
+bool use_hugepages = false;
+// -e io_uring
+bool use_uring = false;
+// -E: EPOLLET on client sockets, -b: events per epoll_wait
+uint32_t epoll_et = 0;
+int epoll_batch = 32;
+
+// -I: clients silent for that long are closed, 0 for never. one that has
+// not sent its SET_UID after HANDSHAKE_TIMEOUT_MS is closed in any case
+int idle_timeout_ms = 0;
+#define HANDSHAKE_TIMEOUT_MS 10000
+
+// -r: frames and bytes per second a client may send, 0 for no limit. the
+// buckets hold one second worth and are refilled per wheel tick
+int rate_msgs = 0;
+int rate_bytes = 0;
+// -q: bytes of complete frames one client gets forwarded per turn of the
+// event loop, the rest waits on the ready list. 0 for all of them
+int drr_quantum = 0;
+#define STATUS_INTERVAL_MS 5000
+
+// edge triggered: rounds of one read per connection with more to read
+// before epoll_wait gets asked again. and accepts per listener event
+#define ET_READY_ROUNDS 16
+#define ACCEPT_BATCH 64
+
+// -U: udp port for game traffic, 0 for none
+int udp_port = 0;
+
+// -A: worker i runs on pin_cpus[i % size], its memory comes from the
+// NUMA node of that cpu and its listeners get the connections whose
+// packets that cpu receives (SO_INCOMING_CPU)
+std::vector<int> pin_cpus;
+// the node of the worker running on this thread, -1 if it is not pinned
+__thread int thread_node = -1;
+// -B: microseconds epoll_wait and reads on the client sockets busy poll
+// the NIC queue before they sleep, 0 for no busy polling
+int busy_poll_us = 0;
+
+// EPIOCSPARAMS is Linux 6.9, older headers do not have it
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+	uint32_t busy_poll_usecs;
+	uint16_t busy_poll_budget;
+	uint8_t prefer_busy_poll;
+	uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+// frames that are not complete in the receive buffer and at least this
+// big bypass it: the body goes from the sender's socket to the peer's
+// through a pipe with splice(). they may be up to MAX_FRAME_SIZE.
+#define SPLICE_MIN_FRAME 2048
+#define MAX_FRAME_SIZE (1 << 20)
+#define SPLICE_CHUNK 65536
+#define SPARE_PIPES 16
+// where the frames for nobody are spliced to
+int devnull = -1;
+
+// -m: port of the plain text metrics endpoint, 0 for none
+int metrics_port = 0;
+
+// counters per worker, only the worker writes them and the scrape on
+// worker 0 reads them as they are. the alignment keeps the counters of
+// two workers off the same cache line.
+#define LAT_BUCKETS 16
+
+struct worker_metrics {
+	uint64_t frames_in;
+	uint64_t bytes_in;
+	// to a peer here, on another worker or on another node
+	uint64_t frames_out;
+	uint64_t bytes_out;
+	uint64_t peer_hits;
+	uint64_t peer_misses;
+	uint64_t unknown_uid;
+	uint64_t oversize;
+	// writes the socket did not take completely, the rest was queued
+	uint64_t short_writes;
+	uint64_t slow_peer_drops;
+	uint64_t handed_over;
+	// closed by the timer wheel: no SET_UID in time, or silent for -I seconds
+	uint64_t handshake_timeouts;
+	uint64_t idle_timeouts;
+	// -r: frames dropped for being over the sender's budget, and their bytes
+	uint64_t rate_limited;
+	uint64_t rate_limited_bytes;
+	// -q: turns a client ended with complete frames left
+	uint64_t quantum_yields;
+	// -A: connections accepted here whose packets arrive on another cpu
+	uint64_t foreign_cpu;
+	// -C: frames written to the capture log, and those that did not fit
+	uint64_t captured;
+	uint64_t capture_drops;
+	// from the epoll_wait that read a frame to the write that sent it,
+	// bucket i counts everything below 2^i us, the last one the rest
+	uint64_t latency[LAT_BUCKETS + 1];
+	uint64_t latency_sum_us;
+	uint64_t latency_count;
+
+	void observe(int64_t us, int n) {
+		if (us < 0) us = 0;
+		int b = us == 0 ? 0 : 63 - __builtin_clzll(us) + 1;
+		latency[b < LAT_BUCKETS ? b : LAT_BUCKETS] += n;
+		latency_sum_us += us * n;
+		latency_count += n;
+	}
+} __attribute__ ((aligned (64)));
+
+// of the worker running on this thread
+__thread worker_metrics * thread_metrics = NULL;
 
 #define VPERROR(msg) vperror(msg, __FILE__, __LINE__)
 
@@ -52,135 +186,437 @@ int vperror(const char * msg, const char * srcfile = NULL, int srcline = -1) {
 	} else {
 		fprintf(stderr, "%s: %s\n", msg, strerror(errno));
 	}
+	return -1;
 }
 
-#define MAX_PEERS 16
-struct proxy_peers {
-	int npeers;
-	fd_ctx * peers[MAX_PEERS];
-	void add(fd_ctx * p);
-	fd_ctx * find(int uid);
-	void remove(fd_ctx * p);
-	void cleanup_dangling();
-	void remove_from_all_peers(fd_ctx * p);
-	void unref_all();
-	proxy_peers() : npeers(0) { }
+// bytes the kernel did not take yet, kept in a chain of fixed size chunks
+#define OUT_CHUNK_SIZE 16384
+#define OUT_CHUNK_CACHE 256
+#define OUT_FLUSH_IOV 16
+
+struct out_chunk {
+	out_chunk * next;
+	int head;
+	int tail;
+	char data[OUT_CHUNK_SIZE];
+};
+
+struct out_queue {
+	out_chunk * first;
+	out_chunk * last;
+	int len;
+	bool empty() const { return len == 0; }
+	void append(const char * p, int n);
+	int flush(int fd);
+	void copy_to(char * dst) const;
+	void clear();
+	out_queue() : first(NULL), last(NULL), len(0) { }
 };
 
+struct frame_stream;
+
 struct fd_ctx {
 	int faf_uid;
 	int fd;
 	bool is_server;
-	proxy_peers peers;
+	// the receive buffer of clients is a ring, unparsed data starts at
+	// buf_start and wraps around at FDCTX_CLIENT_BUFSIZE
+	int buf_start;
 	int buf_len;
+	// our own reference plus one per waiter list we are on
 	int refcount;
 	int protocol;
+	uint32_t ev_mask;
+	// paused: we stopped reading because a peer's out queue went over out_hwm
+	// dropped: too slow to keep up, waiting for its own event to be closed
+	bool paused;
+	bool dropped;
+	// edge triggered: more to read, on the worker's ready list
+	bool ready;
+	// cluster mode: -1 for clients, 0 for a link another node relays to
+	// us over, otherwise the node on the other end of our link or of a
+	// PROTO_BOOK connection. none of them count as a connection.
+	int link_node;
+	out_queue out;
+	// senders paused on our out queue, linked through wait_next
+	fd_ctx * waiters;
+	fd_ctx * wait_next;
+	// which ctx_pool we came from, -1 for malloc
+	int size_class;
+	// as a peer: our slot in the worker's pending writes, -1 if none
+	// as a sender: batch_gen of the batch still pointing into our buf
+	int pend_idx;
+	unsigned pend_gen;
+	// with -e io_uring: URING_* operations armed for us, each holds a reference
+	int uring_ops;
+	// as a sender: the large frame we are in the middle of
+	// as a peer: the sender splicing into us, holds a reference. nothing
+	// else is written to the socket until it is done, it queues in out.
+	frame_stream * stream;
+	fd_ctx * stream_in;
+	// the worker's timer wheel: our slot list, when we are due and the
+	// tick we last read something at, all in wheel ticks
+	fd_ctx * tw_next;
+	fd_ctx ** tw_pprev;
+	uint64_t tw_due;
+	uint64_t last_active;
+	// -r: what is left in the buckets as of tick rl_tick. -q: how much
+	// more may be forwarded this turn
+	int64_t rl_msgs;
+	int64_t rl_bytes;
+	uint64_t rl_tick;
+	int deficit;
+	// bumped whenever the context goes back to its pool, not touched by
+	// the constructor. see ctx_ref.
+	unsigned gen;
 	char buf[1];
 
-	void remove_myself_from_peer_caches() {
-		peers.remove_from_all_peers(this);
-	}
-	void cache_remove(fd_ctx * p) {
-		peers.remove(p);
-	}
-	fd_ctx() : refcount(1) { }
+	fd_ctx() : buf_start(0), buf_len(0), refcount(1), ev_mask(EPOLLIN | epoll_et), paused(false), dropped(false), ready(false), link_node(-1), waiters(NULL), wait_next(NULL),
+			   pend_idx(-1), pend_gen(0), uring_ops(0), stream(NULL), stream_in(NULL), tw_pprev(NULL),
+			   rl_msgs(0), rl_bytes(0), rl_tick(~(uint64_t) 0), deficit(0) { }
 	~fd_ctx();
 };
 
+struct frame_stream {
+	// NULL: the rest goes to devnull
+	fd_ctx * peer;
+	uint16_t uid;
+	// wire size of the frame, and what is still to be read of it
+	int size;
+	int left;
+	// in the pipe, not taken by the peer yet. stalled: the peer is full,
+	// we wait for its EPOLLOUT and stop reading meanwhile
+	int piped;
+	int sent;
+	bool stalled;
+	int pipe[2];
+	// when the peer is busy or on another worker the frame is read in
+	// here instead and routed once it is complete
+	char * gather;
+	int gathered;
+};
+
+// a context that may be closed and freed by the time it is looked at
+// again. pool arenas are never given back, so gen can still be read after
+// the context went back to the pool, or was handed out again. only for
+// contexts from a pool.
+struct ctx_ref {
+	fd_ctx * p;
+	unsigned gen;
+
+	ctx_ref(fd_ctx * p) : p(p), gen(p->gen) { }
+	fd_ctx * get() const { return p->gen == gen ? p : NULL; }
+};
+
 static const int FDCTX_CLIENT_BUFSIZE     = 4096 - sizeof(fd_ctx);
 static const int FDCTX_TCP_SERVER_BUFSIZE = 256  - sizeof(fd_ctx);
 static const int FDCTX_CTRL_BUFSIZE       = 0;
 
-fd_ctx * allocate_fdctx(int bufsize) {
-	void * memp = malloc(sizeof(fd_ctx) + bufsize);
-	return new (memp) fd_ctx();
+// contexts of the two common sizes are carved out of page aligned arenas
+// and recycled through a free list per thread, nothing goes back to malloc
+#define POOL_ARENA_SIZE (2 << 20)
+#define POOL_CLIENT     0
+#define POOL_TCP_SERVER 1
+#define POOL_CLASSES    2
+
+struct ctx_pool {
+	int obj_size;
+	void * free_list;
+	int in_use;
+	int high_water;
+	int capacity;
+
+	void * get();
+	void put(void * p);
+	bool grow();
+};
+
+__thread ctx_pool ctx_pools[POOL_CLASSES] = {
+	{ sizeof(fd_ctx) + FDCTX_CLIENT_BUFSIZE },
+	{ sizeof(fd_ctx) + FDCTX_TCP_SERVER_BUFSIZE },
+};
+
+// -A: pages of p go to node from now on, with move those that are
+// somewhere else already follow. no libnuma, the syscall is all we need
+void bind_to_node(void * p, size_t len, int node, bool move) {
+	if (node < 0 || node >= 64) {
+		return;
+	}
+	uint64_t mask = 1ull << node;
+	// the kernel takes the number of bits plus one
+	if (syscall(SYS_mbind, p, len, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, move ? MPOL_MF_MOVE : 0) < 0) {
+		VPERROR("mbind");
+	}
 }
 
-void deallocate_fdctx(fd_ctx * p) {
-	p->~fd_ctx();
-	free(p);
+bool ctx_pool::grow() {
+	void * arena = MAP_FAILED;
+	if (use_hugepages) {
+		arena = mmap(NULL, POOL_ARENA_SIZE, PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	}
+	if (arena == MAP_FAILED) {
+		arena = mmap(NULL, POOL_ARENA_SIZE, PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (arena == MAP_FAILED) {
+			VPERROR("mmap");
+			return false;
+		}
+		if (use_hugepages) {
+			madvise(arena, POOL_ARENA_SIZE, MADV_HUGEPAGE);
+		}
+	}
+	// before the free list below touches the pages
+	bind_to_node(arena, POOL_ARENA_SIZE, thread_node, false);
+	const int n = POOL_ARENA_SIZE / obj_size;
+	for (int i = n - 1; i >= 0; --i) {
+		void * p = (char *) arena + i * obj_size;
+		*(void **) p = free_list;
+		free_list = p;
+	}
+	capacity += n;
+	return true;
 }
 
-fd_ctx * proxy_peers::find(int uid) {
-	for (int i = 0; i < npeers; ++i) {
-		if (peers[i]->faf_uid == uid) return peers[i];
+void * ctx_pool::get() {
+	if (unlikely(! free_list) && ! grow()) {
+		return NULL;
 	}
-	return NULL;
+	void * p = free_list;
+	free_list = *(void **) p;
+	if (++in_use > high_water) {
+		high_water = in_use;
+	}
+	return p;
 }
 
-void proxy_peers::add(fd_ctx * p) {
-	if (npeers < MAX_PEERS) {
-		// insert fresh entries at the front
-		fd_ctx * prev = peers[0];
-		for (int i = 1; i < npeers; ++i) {
-			fd_ctx * tmp = peers[i];
-			peers[i] = prev;
-			prev = tmp;
-		}
-		peers[npeers] = prev;
-		peers[0] = p;
-		++p->refcount;
-		++npeers;
+void ctx_pool::put(void * p) {
+	*(void **) p = free_list;
+	free_list = p;
+	--in_use;
+}
+
+fd_ctx * allocate_fdctx(int bufsize) {
+	int size_class = -1;
+	void * memp;
+	if (bufsize == FDCTX_CLIENT_BUFSIZE) {
+		size_class = POOL_CLIENT;
+	} else if (bufsize == FDCTX_TCP_SERVER_BUFSIZE) {
+		size_class = POOL_TCP_SERVER;
+	}
+	if (likely(size_class != -1)) {
+		memp = ctx_pools[size_class].get();
 	} else {
-		// remove oldest mapping
-		if (--peers[npeers - 1]->refcount == 0) {
-			deallocate_fdctx(peers[npeers - 1]);
+		memp = malloc(sizeof(fd_ctx) + bufsize);
+	}
+	if (unlikely(! memp)) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	// fresh arenas are zeroed, the free list link does not reach gen
+	const unsigned gen = likely(size_class != -1) ? ((fd_ctx *) memp)->gen : 0;
+	fd_ctx * p = new (memp) fd_ctx();
+	p->size_class = size_class;
+	p->gen = gen;
+	return p;
+}
+
+// one timeout per context, for handshake and idle timeouts. a tick is
+// TW_TICK_MS, level l slots are 256^l ticks wide, so the three levels
+// cover 19 days. anything due later waits on the last level and is put
+// back each time its slot comes up. adding, cancelling and each tick
+// are O(1) however many contexts there are, the worker's timerfd drives
+// the ticks.
+#define TW_TICK_MS 100
+#define TW_BITS    8
+#define TW_SLOTS   (1 << TW_BITS)
+#define TW_LEVELS  3
+
+static inline void timer_cancel(fd_ctx * c) {
+	if (c->tw_pprev) {
+		*c->tw_pprev = c->tw_next;
+		if (c->tw_next) {
+			c->tw_next->tw_pprev = c->tw_pprev;
 		}
-		--npeers;
-		add(p);
+		c->tw_pprev = NULL;
 	}
 }
 
-void proxy_peers::remove(fd_ctx * p) {
-	for (int i = 0; i < npeers; ++i) {
-		if (peers[i] == p) {
-			++i;
-			for (; i < npeers; ++i) {
-				peers[i - 1] = peers[i];
-			}
-			--npeers;
-			if (--p->refcount == 0) {
-				deallocate_fdctx(p);
+static inline void timer_link(fd_ctx ** head, fd_ctx * c) {
+	c->tw_next = *head;
+	if (c->tw_next) {
+		c->tw_next->tw_pprev = &c->tw_next;
+	}
+	c->tw_pprev = head;
+	*head = c;
+}
+
+struct timer_wheel {
+	uint64_t now;
+	fd_ctx * slots[TW_LEVELS][TW_SLOTS];
+
+	timer_wheel() : now(0) {
+		memset(slots, 0, sizeof(slots));
+	}
+
+	// at tick due, or the next one if that has passed
+	void add(fd_ctx * c, uint64_t due) {
+		timer_cancel(c);
+		c->tw_due = due > now ? due : now + 1;
+		const uint64_t delta = c->tw_due - now;
+		int level = 0;
+		while (level < TW_LEVELS - 1 && delta >= (uint64_t) 1 << (TW_BITS * (level + 1))) {
+			++level;
+		}
+		const uint64_t at = delta < (uint64_t) 1 << (TW_BITS * TW_LEVELS) ? c->tw_due : now + ((uint64_t) 1 << (TW_BITS * TW_LEVELS)) - 1;
+		timer_link(&slots[level][(at >> (TW_BITS * level)) & (TW_SLOTS - 1)], c);
+	}
+
+	// advances one tick and moves what is due now to *expired. contexts
+	// on it can still be cancelled, the list head is their tw_pprev.
+	void tick(fd_ctx ** expired) {
+		++now;
+		for (int level = 1; level < TW_LEVELS && ! (now & (((uint64_t) 1 << (TW_BITS * level)) - 1)); ++level) {
+			// the slot that just came up goes down a level, or further
+			fd_ctx * c = take(level, (now >> (TW_BITS * level)) & (TW_SLOTS - 1));
+			while (c) {
+				fd_ctx * next = c->tw_next;
+				c->tw_pprev = NULL;
+				if (c->tw_due <= now) {
+					timer_link(&slots[0][now & (TW_SLOTS - 1)], c);
+				} else {
+					add(c, c->tw_due);
+				}
+				c = next;
 			}
-			return;
 		}
+		*expired = take(0, now & (TW_SLOTS - 1));
+		if (*expired) {
+			(*expired)->tw_pprev = expired;
+		}
+	}
+
+	fd_ctx * take(int level, int slot) {
+		fd_ctx * c = slots[level][slot];
+		slots[level][slot] = NULL;
+		return c;
+	}
+};
+
+void deallocate_fdctx(fd_ctx * p) {
+	const int size_class = p->size_class;
+	timer_cancel(p);
+	++p->gen;
+	p->~fd_ctx();
+	if (likely(size_class != -1)) {
+		ctx_pools[size_class].put(p);
+	} else {
+		free(p);
+	}
+}
+
+// per worker thread
+__thread out_chunk * free_chunks = NULL;
+__thread int free_chunk_count = 0;
+
+out_chunk * allocate_chunk() {
+	out_chunk * c = free_chunks;
+	if (c) {
+		free_chunks = c->next;
+		--free_chunk_count;
+	} else {
+		c = (out_chunk *) malloc(sizeof(out_chunk));
 	}
+	c->next = NULL;
+	c->head = c->tail = 0;
+	return c;
 }
 
-void proxy_peers::remove_from_all_peers(fd_ctx * p) {
-	for (int i = 0; i < npeers; ++i) {
-		peers[i]->cache_remove(p);
+void deallocate_chunk(out_chunk * c) {
+	if (free_chunk_count < OUT_CHUNK_CACHE) {
+		c->next = free_chunks;
+		free_chunks = c;
+		++free_chunk_count;
+	} else {
+		free(c);
 	}
 }
 
-void proxy_peers::unref_all() {
-	for (int i = 0; i < npeers; ++i) {
-		if (--peers[i]->refcount == 0) {
-			deallocate_fdctx(peers[i]);
+void out_queue::append(const char * p, int n) {
+	len += n;
+	while (n) {
+		if (! last || last->tail == OUT_CHUNK_SIZE) {
+			out_chunk * c = allocate_chunk();
+			if (last) {
+				last->next = c;
+			} else {
+				first = c;
+			}
+			last = c;
 		}
+		int l = std::min(n, OUT_CHUNK_SIZE - last->tail);
+		memcpy(last->data + last->tail, p, l);
+		last->tail += l;
+		p += l;
+		n -= l;
 	}
-	npeers = 0;
 }
 
-void proxy_peers::cleanup_dangling() {
-	int oi = 0;
-	for (int i = 0; i < npeers; ++i) {
-		if (peers[i]->faf_uid == -1) {
-			if (--peers[i]->refcount == 0) {
-				deallocate_fdctx(peers[i]);
-				continue;
+// write as much as the kernel takes, -1 on a broken connection
+int out_queue::flush(int fd) {
+	while (first) {
+		iovec iov[OUT_FLUSH_IOV];
+		int iovcnt = 0;
+		int total = 0;
+		for (out_chunk * c = first; c && iovcnt < OUT_FLUSH_IOV; c = c->next, ++iovcnt) {
+			iov[iovcnt].iov_base = c->data + c->head;
+			iov[iovcnt].iov_len  = c->tail - c->head;
+			total += c->tail - c->head;
+		}
+		ssize_t n = writev(fd, iov, iovcnt);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR) return 0;
+			return -1;
+		}
+		const ssize_t written = n;
+		len -= n;
+		while (n) {
+			int l = std::min((int) n, first->tail - first->head);
+			first->head += l;
+			n -= l;
+			if (first->head == first->tail) {
+				out_chunk * c = first;
+				first = c->next;
+				deallocate_chunk(c);
 			}
 		}
-		if (i != oi) peers[oi] = peers[i];
-		++oi;
+		if (! first) last = NULL;
+		if (written < total) return 0;
+	}
+	return 0;
+}
+
+void out_queue::copy_to(char * dst) const {
+	for (const out_chunk * c = first; c; c = c->next) {
+		memcpy(dst, c->data + c->head, c->tail - c->head);
+		dst += c->tail - c->head;
 	}
-	npeers = oi;
 }
 
-struct fd_ctx_less_by_uid {
-	bool operator()(const fd_ctx * a, const fd_ctx * b) const {
-		return a->faf_uid < b->faf_uid;
+void out_queue::clear() {
+	while (first) {
+		out_chunk * c = first;
+		first = c->next;
+		deallocate_chunk(c);
 	}
+	last = NULL;
+	len = 0;
+}
+
+struct desc_record {
+	int32_t uid;
+	int32_t buf_len;
+	int32_t out_len;
 };
 
 struct proxy_msg_header {
@@ -199,18 +635,46 @@ struct proxy_msg_header_to_peer {
 	uint16_t port;
 } __attribute__ ((packed));
 
-typedef std::set<fd_ctx *, fd_ctx_less_by_uid> peer_sockets_t;
+// uids are 16 bit on the wire, so a flat table indexed by uid replaces
+// any search structure. a newer connection for a uid replaces the older
+// one, which stays connected but unreachable.
+struct peer_table {
+	fd_ctx ** slots;
+	int count;
 
-#define OUT_HEADER_OFFSET_ADJ (sizeof(proxy_msg_header) - sizeof(proxy_msg_header_to_peer))
+	fd_ctx * find(int uid) const { return slots[uid]; }
+	void insert(fd_ctx * p) {
+		if (! slots[p->faf_uid]) ++count;
+		slots[p->faf_uid] = p;
+	}
+	bool erase(fd_ctx * p) {
+		if (slots[p->faf_uid] != p) return false;
+		slots[p->faf_uid] = NULL;
+		--count;
+		return true;
+	}
+	template <typename Iter>
+	void erase(Iter beg, Iter end) {
+		for (; beg != end; ++beg) erase(*beg);
+	}
+	int size() const { return count; }
+	bool empty() const { return count == 0; }
+	void collect(std::vector<fd_ctx *> & v) const {
+		v.clear();
+		for (int uid = 0; uid < 65536 && v.size() < count; ++uid) {
+			if (slots[uid]) v.push_back(slots[uid]);
+		}
+	}
+	peer_table() : slots((fd_ctx **) calloc(65536, sizeof(fd_ctx *))), count(0) { }
+	~peer_table() { free(slots); }
+};
 
-bool got_sigusr1 = false;
+typedef peer_table peer_sockets_t;
 
-void sigusr1(int) {
-	got_sigusr1 = true;
-}
+#define OUT_HEADER_OFFSET_ADJ (sizeof(proxy_msg_header) - sizeof(proxy_msg_header_to_peer))
 
 fd_ctx::~fd_ctx() {
-	peers.unref_all();
+	out.clear();
 }
 
 char * get_ip_str(const struct sockaddr *sa, char *s, size_t maxlen) {
@@ -263,82 +727,313 @@ int poll_in(int epoll, fd_ctx * ptr) {
 	return 0;
 }
 
-template <typename Iter, typename Container>
-int send_fds(int ctrlsock, int epoll, Iter beg, Iter end, Container * all) {
-	char control[CMSG_SPACE(sizeof(int) * MAX_DESC_PER_MESSAGE)];
-	char buf[4 + sizeof(int) * MAX_DESC_PER_MESSAGE];
-	msghdr msg;
+int set_nonblocking(int fd) {
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		VPERROR("fcntl(O_NONBLOCK)"); return -1;
+	}
+	return 0;
+}
 
-	msg.msg_name       = NULL;
-	msg.msg_namelen    = 0;
-	msg.msg_control    = control;
-	msg.msg_controllen = sizeof(control);
+// -e io_uring runs the same loop on top of io_uring, through the raw
+// syscalls. receives go straight into the ring of the context, so a read
+// is only armed while the context is not paused and everything it
+// received got parsed, and it is built when the batch is submitted.
+#define URING_ENTRIES 1024
 
-	strcpy(buf, "desc");
+// low bits of user_data, the rest is the fd_ctx (or the pending index)
+#define URING_OP_READ    1
+#define URING_OP_POLLOUT 2
+#define URING_OP_ACCEPT  3
+#define URING_OP_WAKE    4
+#define URING_OP_SEND    5
+#define URING_OP_TIMER   6
+#define URING_OP_MASK    7
 
-	cmsghdr * cmp = CMSG_FIRSTHDR(&msg);
+// fd_ctx::uring_ops
+#define URING_READ_WANTED   1
+#define URING_READ_ARMED    2
+#define URING_POLLOUT_ARMED 4
 
-	cmp->cmsg_level = SOL_SOCKET;
-	cmp->cmsg_type  = SCM_RIGHTS;
+struct io_ring {
+	int fd;
+	unsigned entries;
+	unsigned * sq_head;
+	unsigned * sq_tail;
+	unsigned sq_mask;
+	io_uring_sqe * sqes;
+	unsigned * cq_head;
+	unsigned * cq_tail;
+	unsigned cq_mask;
+	io_uring_cqe * cqes;
+	// our tail, published on enter
+	unsigned sqe_tail;
+	// iovecs and msghdrs of queued sqes by slot, the kernel copies them on submit
+	iovec (* sq_iov)[2];
+	msghdr * sq_msg;
+	// contexts to arm a read for on the next wait, each holds a reference
+	std::vector<fd_ctx *> want_read;
+	// completions reaped while waiting for our sends, handled next batch
+	std::vector<io_uring_cqe> deferred;
+	unsigned enters;
 
-	int fd_count = 0;
-	Iter erase_beg;
-	bool erase_valid = false;
-	std::vector<int> to_close;
-
-	for (int * uidp = (int *) (buf + 4);
-		 beg != end && fd_count < MAX_DESC_PER_MESSAGE;
-		 ++beg, ++uidp)
-	    {
-			if ((**beg).buf_len == 0) {
-				if (! erase_valid) {
-					erase_beg = beg;
-				    erase_valid = true;
-				}
-				*uidp = (**beg).faf_uid;
-
-				* ((int *) CMSG_DATA(cmp) + fd_count) = (**beg).fd;
-				to_close.push_back((**beg).fd);
-				//if (epoll_ctl(epoll, EPOLL_CTL_DEL, (**beg).fd, NULL) < 0) {
-				//					VPERROR("epoll_ctl(DEL)");
-				//				}
-				++fd_count;
-			} else {
-				if (erase_valid) {
-					if (all) all->erase(erase_beg, beg);
-					erase_valid = false;
-				}
-			}
+	int setup();
+	io_uring_sqe * get_sqe(uint64_t user_data, unsigned * slot = NULL);
+	int enter(unsigned min_complete, int timeout_ms);
+	unsigned ready() const {
+		return __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) - *cq_head;
+	}
+	bool pop(io_uring_cqe * cqe);
+	void update(fd_ctx * p);
+	void arm_reads();
+	io_ring() : fd(-1), sqe_tail(0), sq_iov(NULL), sq_msg(NULL), enters(0) { }
+};
+
+__thread io_ring * thread_ring = NULL;
+
+int io_ring::setup() {
+	io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	p.flags      = IORING_SETUP_CQSIZE;
+	p.cq_entries = URING_ENTRIES * 4;
+	fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (fd < 0) {
+		VPERROR("io_uring_setup"); return -1;
+	}
+	const unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_SUBMIT_STABLE | IORING_FEAT_EXT_ARG;
+	if ((p.features & needed) != needed) {
+		fprintf(stderr, "io_uring: kernel lacks features %x\n", needed & ~p.features);
+		close(fd);
+		return -1;
+	}
+	entries = p.sq_entries;
+	const size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	const size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	char * rp = (char *) mmap(NULL, std::max(sq_size, cq_size), PROT_READ | PROT_WRITE,
+							  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	void * sp = mmap(NULL, p.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+					 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (rp == MAP_FAILED || sp == MAP_FAILED) {
+		VPERROR("mmap(io_uring)");
+		close(fd);
+		return -1;
+	}
+	sqes    = (io_uring_sqe *) sp;
+	sq_head = (unsigned *) (rp + p.sq_off.head);
+	sq_tail = (unsigned *) (rp + p.sq_off.tail);
+	sq_mask = * (unsigned *) (rp + p.sq_off.ring_mask);
+	unsigned * array = (unsigned *) (rp + p.sq_off.array);
+	for (unsigned i = 0; i < entries; ++i) {
+		array[i] = i;
+	}
+	cq_head = (unsigned *) (rp + p.cq_off.head);
+	cq_tail = (unsigned *) (rp + p.cq_off.tail);
+	cq_mask = * (unsigned *) (rp + p.cq_off.ring_mask);
+	cqes    = (io_uring_cqe *) (rp + p.cq_off.cqes);
+
+	sqe_tail = *sq_tail;
+	sq_iov   = new iovec[entries][2];
+	sq_msg   = new msghdr[entries];
+	return 0;
+}
+
+io_uring_sqe * io_ring::get_sqe(uint64_t user_data, unsigned * slot) {
+	if (unlikely(sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == entries)) {
+		enter(0, 0);
+	}
+	const unsigned idx = sqe_tail++ & sq_mask;
+	io_uring_sqe * sqe = &sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = user_data;
+	if (slot) {
+		*slot = idx;
+	}
+	return sqe;
+}
+
+// submit everything queued and wait for min_complete completions,
+// timeout_ms < 0 waits forever
+int io_ring::enter(unsigned min_complete, int timeout_ms) {
+	__atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+	const unsigned to_submit = sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	if (! to_submit && ! min_complete) {
+		return 0;
+	}
+	unsigned flags = 0;
+	io_uring_getevents_arg arg;
+	__kernel_timespec ts;
+	void * argp = NULL;
+	size_t argsz = 0;
+	if (min_complete) {
+		flags |= IORING_ENTER_GETEVENTS;
+		if (timeout_ms >= 0) {
+			ts.tv_sec  = timeout_ms / 1000;
+			ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+			memset(&arg, 0, sizeof(arg));
+			arg.ts = (uint64_t) (uintptr_t) &ts;
+			flags |= IORING_ENTER_EXT_ARG;
+			argp  = &arg;
+			argsz = sizeof(arg);
 		}
+	}
+	++enters;
+	int r = syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, argp, argsz);
+	if (r < 0 && errno != EINTR && errno != ETIME && errno != EAGAIN && errno != EBUSY) {
+		VPERROR("io_uring_enter");
+	}
+	return r;
+}
 
-	cmp->cmsg_len   = CMSG_LEN(sizeof(int) * fd_count);
-	if (erase_valid) {
-		if (all) all->erase(erase_beg, beg);
+bool io_ring::pop(io_uring_cqe * cqe) {
+	const unsigned head = *cq_head;
+	if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+		return false;
 	}
-	msg.msg_controllen  = CMSG_SPACE(fd_count * sizeof(int));
-	iovec iov;
-	iov.iov_base   = buf;
-	iov.iov_len    = 4 + fd_count * sizeof(int);
-	msg.msg_iov    = &iov;
-	msg.msg_iovlen = 1;
+	*cqe = cqes[head & cq_mask];
+	__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
 
-	if (fd_count) {
-		if (sendmsg(ctrlsock, &msg, 0) < 0) {
-			VPERROR("sendmsg");
-		} else {
-			total_sockets -= to_close.size();
-			// we dont care about caches and refcounts and destroying contexts,
-			// so we cheat and handle the global counters here
-			for (int i = 0; i < to_close.size(); ++i) {
-				if (epoll_ctl(epoll, EPOLL_CTL_DEL, to_close[i], NULL) < 0) {
-					VPERROR("epoll_ctl");
+// what update_events does with epoll. dropped peers keep reading, the
+// read fails after the shutdown and closes them.
+void io_ring::update(fd_ctx * p) {
+	if ((! p->paused || p->dropped) && ! (p->uring_ops & (URING_READ_WANTED | URING_READ_ARMED))) {
+		p->uring_ops |= URING_READ_WANTED;
+		++p->refcount;
+		want_read.push_back(p);
+	}
+	if (! p->out.empty() && ! (p->uring_ops & URING_POLLOUT_ARMED)) {
+		p->uring_ops |= URING_POLLOUT_ARMED;
+		++p->refcount;
+		io_uring_sqe * sqe = get_sqe((uintptr_t) p | URING_OP_POLLOUT);
+		sqe->opcode        = IORING_OP_POLL_ADD;
+		sqe->fd            = p->fd;
+		sqe->poll32_events = POLLOUT;
+	}
+}
+
+// keep EPOLLOUT armed only while there is something queued
+int update_events(int epoll, fd_ctx * p) {
+	if (thread_ring) {
+		thread_ring->update(p);
+		return 0;
+	}
+	bool in  = ! p->paused;
+	bool out = ! p->out.empty();
+	if (unlikely(p->stream || p->stream_in)) {
+		// a splice in progress decides, see stream_pump
+		if (p->stream && p->stream->stalled) {
+			in = false;
+		}
+		if (p->stream_in) {
+			out = p->stream_in->stream->stalled;
+		}
+	}
+	uint32_t events = (in ? EPOLLIN : 0) | (out ? EPOLLOUT : 0) | epoll_et;
+	if (events == p->ev_mask) {
+		return 0;
+	}
+	epoll_event ev;
+	ev.events   = events;
+	ev.data.ptr = (void *) p;
+	if (epoll_ctl(epoll, EPOLL_CTL_MOD, p->fd, &ev) < 0) {
+		VPERROR("epoll_ctl(MOD)"); return -1;
+	}
+	p->ev_mask = events;
+	return 0;
+}
+
+// queue what is left of iov after the first skip bytes went out
+void queue_unsent(int epoll, fd_ctx * peer, const iovec * iov, int iovcnt, int skip) {
+	bool queued = false;
+	for (int i = 0; i < iovcnt; ++i) {
+		if (skip >= (int) iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		peer->out.append((const char *) iov[i].iov_base + skip, iov[i].iov_len - skip);
+		skip = 0;
+		queued = true;
+	}
+	if (queued) {
+		update_events(epoll, peer);
+	}
+}
+
+void send_to_peer(int epoll, fd_ctx * peer, const iovec * iov, int iovcnt) {
+	if (unlikely(peer->dropped)) {
+		return;
+	}
+	int skip = 0;
+	if (likely(peer->out.empty() && ! peer->stream_in)) {
+		int len = 0;
+		for (int i = 0; i < iovcnt; ++i) {
+			len += iov[i].iov_len;
+		}
+		int n = iovcnt == 1 ? write(peer->fd, iov[0].iov_base, len) : writev(peer->fd, iov, iovcnt);
+		if (unlikely(n < 0)) {
+			if (errno != EAGAIN && errno != EINTR) {
+				if (errno != ECONNRESET && errno != EPIPE) {
+					VPERROR("write");
 				}
-				
-				close(to_close[i]);
+				return;
 			}
+			n = 0;
+		}
+		if (likely(n == len)) {
+			return;
 		}
+		skip = n;
+		++thread_metrics->short_writes;
+	}
+	queue_unsent(epoll, peer, iov, iovcnt, skip);
+}
+
+void send_to_peer(int epoll, fd_ctx * peer, const char * data, int len) {
+	iovec iov;
+	iov.iov_base = (void *) data;
+	iov.iov_len  = len;
+	send_to_peer(epoll, peer, &iov, 1);
+}
+
+// stop reading from sender until the out queue of peer drained
+void wait_for_drain(int epoll, fd_ctx * sender, fd_ctx * peer) {
+	if (sender->paused) {
+		return;
+	}
+	sender->paused = true;
+	++sender->refcount;
+	sender->wait_next = peer->waiters;
+	peer->waiters = sender;
+	update_events(epoll, sender);
+}
+
+void wake_waiters(int epoll, fd_ctx * p) {
+	while (p->waiters) {
+		fd_ctx * w = p->waiters;
+		p->waiters = w->wait_next;
+		w->wait_next = NULL;
+		w->paused = false;
+		if (w->fd != -1) {
+			update_events(epoll, w);
+		}
+		if (--w->refcount == 0) {
+			deallocate_fdctx(w);
+		}
+	}
+}
+
+// peers too slow to keep up are shut down here and closed once their
+// own event comes in, the context might still show up later in this batch
+void drop_peer(fd_ctx * peer) {
+	fprintf(stderr, "dropping slow peer %d (%d bytes queued)\n", peer->faf_uid, peer->out.len);
+	++thread_metrics->slow_peer_drops;
+	peer->dropped = true;
+	peer->out.clear();
+	shutdown(peer->fd, SHUT_RDWR);
+	if (thread_ring) {
+		thread_ring->update(peer);
 	}
-	return fd_count;
 }
 
 template <typename T>
@@ -346,210 +1041,3392 @@ struct dummy_erase_container {
 	void erase(T *, T *) { }
 };
 
-int send_fd(int ctrlsock, int epoll, fd_ctx * ctxp) {
-	return send_fds(ctrlsock, epoll, &ctxp, &ctxp + 1, (dummy_erase_container<fd_ctx *> *) NULL);
-}
+// messages for a uid owned by another worker go through a single producer,
+// single consumer ring per (source, destination) pair. records are the
+// already rewritten frame prefixed by an xq_record, padded to 8 bytes.
+#define MAX_WORKERS 64
+#define XQ_SIZE (1 << 18)
+#define XQ_WRAP 0xffffffff
 
-int main(int argc, char ** argv) {
-	int listen_port = -1;
-	char listen_port_str[8];
-	const char * ctrl_socket_path = NULL;
+struct xq_record {
+	uint32_t len;
+	uint16_t destuid;
+	uint16_t flags;
+};
 
-	{
-		int opt;
-		while ((opt = getopt(argc, argv, "p:hu:")) != EOF) {
-			switch (opt) {
-			case 'p' :
-				listen_port = atoi(optarg);
-				break;
-			case 'h' :
-				fprintf(stderr, "%s [-p port] [-u socket-path]\n", argv[0]);
-				fprintf(stderr, "default: -p 9134\n");
-				exit(0);
-			case 'u' :
-				ctrl_socket_path = optarg;
-				break;
-			}
-		}
-		argc -= optind;
-		argv += optind;
+struct xthread_queue {
+	uint64_t tail __attribute__ ((aligned (64)));
+	uint64_t head __attribute__ ((aligned (64)));
+	char data[XQ_SIZE] __attribute__ ((aligned (64)));
+
+	bool room(int len) const {
+		const uint64_t need = (sizeof(xq_record) + len + 7) & ~7;
+		const uint64_t pos  = tail & (XQ_SIZE - 1);
+		const uint64_t skip = pos + need > XQ_SIZE ? XQ_SIZE - pos : 0;
+		return tail + skip + need - __atomic_load_n(&head, __ATOMIC_ACQUIRE) <= XQ_SIZE;
 	}
+	bool push(uint16_t destuid, const iovec * iov, int iovcnt, uint16_t flags = 0);
+};
 
-	if (listen_port == -1) {
-		listen_port = 9134;
+// records without a frame that tell worker 0 about a uid registered or
+// gone on another worker, for the cluster peer book
+#define XQ_BOOK_ADD 1
+#define XQ_BOOK_DEL 2
+// a large frame does not go through the ring, only the malloced buffer
+// with it does. the frame starts OUT_HEADER_OFFSET_ADJ bytes into it,
+// already rewritten. the receiver frees it.
+#define XQ_HEAP 4
+// a frame for several uids on the receiving worker, [u8 count][uids]
+// in front of the rewritten frame
+#define XQ_MULTI 8
+
+bool xthread_queue::push(uint16_t destuid, const iovec * iov, int iovcnt, uint16_t flags) {
+	int len = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		len += iov[i].iov_len;
 	}
-	sprintf(listen_port_str, "%d", listen_port);
+	if (! room(len)) {
+		return false;
+	}
+	const uint64_t need = (sizeof(xq_record) + len + 7) & ~7;
+	const uint64_t t    = tail;
+	uint64_t pos        = t & (XQ_SIZE - 1);
+	const uint64_t skip = pos + need > XQ_SIZE ? XQ_SIZE - pos : 0;
 
-	typedef std::vector<fd_ctx *> server_sockets_t;
-	server_sockets_t server_sockets;
-	peer_sockets_t peer_sockets;
+	if (skip) {
+		((xq_record *) (data + pos))->len = XQ_WRAP;
+		pos = 0;
+	}
+	xq_record * r = (xq_record *) (data + pos);
+	r->len     = len;
+	r->destuid = destuid;
+	r->flags   = flags;
+	char * dst = (char *) (r + 1);
+	for (int i = 0; i < iovcnt; ++i) {
+		memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+		dst += iov[i].iov_len;
+	}
+	__atomic_store_n(&tail, t + skip + need, __ATOMIC_RELEASE);
+	return true;
+}
 
-	fd_ctx ctrl_socket, ctrl_socket_conn;
-	bool ctrl_socket_mode_listen = false;
-	bool decay_mode = false;
+int nworkers = 1;
+struct worker;
+worker * workers = NULL;
+
+// which worker a registered uid lives on, only maintained with -t
+int16_t uid_owner[65536];
+
+// uid 0 is never a peer, frames to it are requests to the proxy itself.
+// CTRL_UDP_REGISTER carries a 32 bit token, the proxy answers with the
+// same port and its 16 bit udp port (0 without -U).
+#define CTRL_UID 0
+#define CTRL_UDP_REGISTER 1
+// [u8 count][count u16 uids] of a game, answered with the same port and
+// the 16 byte address (ipv4 mapped) and u16 port of the node to connect
+// to for it, all zero for the node asked
+#define CTRL_PLACE 2
+// no body, answered with the same port and no body either. keeps a
+// client from counting as idle with -I and tells it we are still there
+#define CTRL_KEEPALIVE 3
+
+// a frame to MULTICAST_UID goes to every uid of the list in front of its
+// payload: {size, port, destuid} + [u8 count][count u16 uids] + payload.
+// each of them gets the same {size, port} + payload, the list is gone.
+// the uid itself can not be taken by a client.
+#define MULTICAST_UID 0xffff
+
+// datagrams from clients are [token][srcuid][port][destuid] + payload,
+// to clients [port] + payload. one to CTRL_UID only makes us learn the
+// address. the header is rewritten in place for either way out.
+struct udp_msg_header {
+	uint32_t token;
+	uint16_t srcuid;
+	uint16_t port;
+	uint16_t destuid;
+} __attribute__ ((packed));
+
+#define UDP_BATCH 64
+#define UDP_MAX_DATAGRAM 2048
 
-	ctrl_socket.fd = -1;
-	ctrl_socket_conn.fd = -1;
+// the token a uid registered over tcp and the address its datagrams come
+// from. addresses are learned by whichever worker receives a datagram, so
+// an entry is a seqlock: odd seq while written, readers retry and a
+// second writer just skips its update.
+struct udp_peer {
+	uint32_t seq;
+	uint32_t token;
+	uint32_t addrlen;
+	sockaddr_in6 addr;
+};
 
-	int sockets_inherited = 0;
+udp_peer * udp_peers = NULL;
 
-	int epoll = epoll_create(1024);
-	if (epoll < 0) {
-		VPERROR("epoll_create"); exit(1);
+bool udp_store(uint16_t uid, uint32_t token, const sockaddr_in6 * addr, socklen_t addrlen) {
+	udp_peer & e = udp_peers[uid];
+	uint32_t s = __atomic_load_n(&e.seq, __ATOMIC_RELAXED);
+	if ((s & 1) || ! __atomic_compare_exchange_n(&e.seq, &s, s + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		return false;
+	}
+	if (addrlen && e.token != token) {
+		// the uid registered again or went away since we checked the token
+		__atomic_store_n(&e.seq, s + 2, __ATOMIC_RELEASE);
+		return false;
 	}
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&e.token, token, __ATOMIC_RELAXED);
+	e.addrlen = addrlen;
+	if (addrlen) {
+		memcpy(&e.addr, addr, addrlen);
+	}
+	__atomic_store_n(&e.seq, s + 2, __ATOMIC_RELEASE);
+	return true;
+}
 
-	if (ctrl_socket_path) {
-		int s = socket(PF_UNIX, SOCK_SEQPACKET, 0);
-		if (s < 0) {
-			VPERROR("socket(AF_UNIX)");
-			exit(1);
-		}
-		struct sockaddr_un sun;
-		sun.sun_family = AF_UNIX;
-		strncpy(sun.sun_path, ctrl_socket_path, sizeof(sun.sun_path));
+// the token changes only from the worker owning the tcp connection, that
+// one has to win against address updates
+void udp_set_token(uint16_t uid, uint32_t token) {
+	if (! udp_peers) {
+		return;
+	}
+	while (! udp_store(uid, token, NULL, 0)) {
+	}
+}
 
-		if (connect(s, (sockaddr *) &sun, sizeof(sun))) {
-			if (errno == ECONNREFUSED || errno == ENOENT) {
-				if (errno == ECONNREFUSED) {
-					if (unlink(ctrl_socket_path) < 0) {
-						fprintf(stderr, "unlink(%s): %s\n", ctrl_socket_path, strerror(errno));
-						exit(1);
+// false if uid has no address yet or it is being changed right now
+bool udp_lookup(uint16_t uid, sockaddr_in6 * addr, socklen_t * addrlen) {
+	const udp_peer & e = udp_peers[uid];
+	const uint32_t s = __atomic_load_n(&e.seq, __ATOMIC_ACQUIRE);
+	if (s & 1) {
+		return false;
+	}
+	*addrlen = std::min((uint32_t) sizeof(*addr), e.addrlen);
+	memcpy(addr, &e.addr, *addrlen);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&e.seq, __ATOMIC_RELAXED) == s && *addrlen;
+}
+
+// recvmmsg goes into in and buf, the datagrams to pass on are sent
+// straight out of buf with one sendmmsg
+struct udp_batch {
+	mmsghdr in[UDP_BATCH];
+	iovec in_iov[UDP_BATCH];
+	sockaddr_in6 from[UDP_BATCH];
+	mmsghdr out[UDP_BATCH];
+	iovec out_iov[UDP_BATCH];
+	sockaddr_in6 to[UDP_BATCH];
+	char buf[UDP_BATCH][UDP_MAX_DATAGRAM];
+};
+
+// -M / -S: cluster mode. a frame for a uid connected to another node goes
+// there unchanged over a link, a connection to that node's client port
+// that sent SET_UID CTRL_UID. the master knows which node every uid is on
+// and tells all nodes, over connections to its -M port carrying
+// [size][op] + body frames, everything in network byte order:
+//	BOOK_HELLO    node -> master  client port of the node
+//	BOOK_WELCOME  master -> node  node id, client port of the master
+//	BOOK_NODE     master -> node  node id, client port, ipv6 address
+//	BOOK_UPDATE   both ways       book_record list, node 0 for gone
+// a node sends all its uids after the hello, the master answers with
+// every node and uid it knows and then passes on what changes. a node
+// that disconnects takes its uids with it.
+#define MAX_NODES 256
+#define MASTER_NODE 1
+#define BOOK_HELLO   1
+#define BOOK_WELCOME 2
+#define BOOK_NODE    3
+#define BOOK_UPDATE  4
+// keeps a frame below FDCTX_CLIENT_BUFSIZE
+#define BOOK_MAX_RECORDS 900
+#define PROTO_BOOK 0x100
+// -m scrapes, on worker 0
+#define PROTO_METRICS 0x101
+#define LINK_RETRY_MS 1000
+
+struct book_header {
+	uint32_t size;
+	uint16_t op;
+} __attribute__ ((packed));
+
+struct book_record {
+	uint16_t uid;
+	uint16_t node;
+} __attribute__ ((packed));
+
+struct book_node_msg {
+	uint16_t node;
+	uint16_t port;
+	uint8_t addr[16];
+} __attribute__ ((packed));
+
+struct cluster_node {
+	// ipv4 addresses are mapped
+	uint8_t addr[16];
+	uint16_t port;
+	// bumped when the id is given to another node, after a master restart
+	uint32_t gen;
+};
+
+bool cluster = false;
+// -M, the port nodes connect to
+int book_port = 0;
+// -S, where the master is and what we found there
+const char * book_master_name = NULL;
+sockaddr_storage book_master_addr;
+socklen_t book_master_addrlen = 0;
+// set by worker 0, read by all
+int self_node = 0;
+// -p, what the other nodes open their links to
+int client_port = 0;
+cluster_node nodes[MAX_NODES];
+uint8_t uid_node[65536];
+
+void to_addr16(const sockaddr * sa, uint8_t * addr) {
+	if (sa->sa_family == AF_INET6) {
+		memcpy(addr, &((const sockaddr_in6 *) sa)->sin6_addr, 16);
+	} else {
+		memset(addr, 0, 10);
+		addr[10] = addr[11] = 0xff;
+		memcpy(addr + 12, &((const sockaddr_in *) sa)->sin_addr, 4);
+	}
+}
+
+socklen_t from_addr16(const uint8_t * addr, uint16_t port, sockaddr_storage * ss) {
+	memset(ss, 0, sizeof(*ss));
+	if (IN6_IS_ADDR_V4MAPPED((const in6_addr *) addr)) {
+		sockaddr_in * sin = (sockaddr_in *) ss;
+		sin->sin_family = AF_INET;
+		sin->sin_port   = htons(port);
+		memcpy(&sin->sin_addr, addr + 12, 4);
+		return sizeof(*sin);
+	}
+	sockaddr_in6 * sin6 = (sockaddr_in6 *) ss;
+	sin6->sin6_family = AF_INET6;
+	sin6->sin6_port   = htons(port);
+	memcpy(&sin6->sin6_addr, addr, 16);
+	return sizeof(*sin6);
+}
+
+// worker 0 only. the links of every worker to the old address go away
+// the next time they are used.
+void set_node(int node, const uint8_t * addr, uint16_t port) {
+	cluster_node & n = nodes[node];
+	if (n.port == port && memcmp(n.addr, addr, 16) == 0) {
+		return;
+	}
+	memcpy(n.addr, addr, 16);
+	n.port = port;
+	__atomic_add_fetch(&n.gen, 1, __ATOMIC_RELEASE);
+}
+
+double now_ms() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+// -C: the frames clients send, appended to a memory mapped file that
+// ./replay plays back. a worker takes the file a block at a time with one
+// atomic add and fills its block without a syscall or a lock. the length
+// of a record is written last, a record of length 0 means the rest of the
+// block is unused, a block starting with one the end of the log. records
+// are in host byte order, only the proxy headers are left out of them.
+#define CAPTURE_MAGIC    "nofatcap"
+#define CAPTURE_VERSION  1
+#define CAPTURE_PAYLOADS 1
+#define CAPTURE_BLOCK    (1 << 20)
+#define CAPTURE_DEFAULT_MB 1024
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+struct capture_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	// CLOCK_REALTIME when the capture started, record times count from there
+	uint64_t start_ns;
+	uint64_t reserved;
+};
+
+struct capture_record {
+	// 8 byte aligned, header and captured bytes
+	uint32_t reclen;
+	// bytes of the frame behind the {size, port, destuid} header
+	uint32_t size;
+	uint64_t ts_ns;
+	uint16_t srcuid;
+	uint16_t destuid;
+	uint16_t port;
+	uint16_t reserved;
+	// how many of them follow: all with -P, otherwise only the uid list
+	// of a multicast
+	uint32_t caplen;
+	uint32_t reserved2;
+};
+
+struct capture_log {
+	int fd;
+	char * base;
+	uint64_t size;
+	// the next block to take
+	uint64_t tail;
+	uint64_t start_mono_ns;
+	bool payloads;
+};
+
+capture_log * capture = NULL;
+
+uint64_t mono_ns() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// path[:megabytes], the file is created sparse at its full size
+bool capture_open(const char * spec, bool payloads) {
+	std::string path(spec);
+	uint64_t mb = CAPTURE_DEFAULT_MB;
+	const size_t colon = path.rfind(':');
+	if (colon != std::string::npos) {
+		mb = strtoull(path.c_str() + colon + 1, NULL, 10);
+		path.resize(colon);
+	}
+	if (path.empty() || mb < 1) {
+		fprintf(stderr, "-C needs path[:megabytes]\n");
+		return false;
+	}
+	capture_log * c = new capture_log;
+	c->size = mb << 20;
+	c->fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (c->fd < 0 || ftruncate(c->fd, c->size) < 0) {
+		fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+		return false;
+	}
+	c->base = (char *) mmap(NULL, c->size, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+	if (c->base == MAP_FAILED) {
+		VPERROR("mmap(capture)");
+		return false;
+	}
+	capture_header * h = (capture_header *) c->base;
+	memcpy(h->magic, CAPTURE_MAGIC, sizeof(h->magic));
+	h->version = CAPTURE_VERSION;
+	h->flags   = payloads ? CAPTURE_PAYLOADS : 0;
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	h->start_ns = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	// the first block starts behind the header
+	c->tail = sizeof(capture_header);
+	c->start_mono_ns = mono_ns();
+	c->payloads = payloads;
+	capture = c;
+	return true;
+}
+
+// cut the file down to the blocks taken, on a normal exit. a killed proxy
+// leaves it at full size, the rest reads as the end of the log
+void capture_close() {
+	if (! capture) {
+		return;
+	}
+	const uint64_t used = std::min(__atomic_load_n(&capture->tail, __ATOMIC_ACQUIRE), capture->size);
+	munmap(capture->base, capture->size);
+	if (ftruncate(capture->fd, used) < 0) {
+		VPERROR("ftruncate(capture)");
+	}
+	close(capture->fd);
+}
+
+volatile sig_atomic_t sigusr1_count = 0;
+
+void sigusr1(int) {
+	++sigusr1_count;
+}
+
+// copy n bytes starting at ring offset pos, wrapping around the end
+void ring_copy_out(const fd_ctx * c, int pos, char * dst, int n) {
+	int l = std::min(n, FDCTX_CLIENT_BUFSIZE - pos);
+	memcpy(dst, c->buf + pos, l);
+	memcpy(dst + l, c->buf, n - l);
+}
+
+void ring_copy_in(fd_ctx * c, int pos, const char * src, int n) {
+	int l = std::min(n, FDCTX_CLIENT_BUFSIZE - pos);
+	memcpy(c->buf + pos, src, l);
+	memcpy(c->buf, src + l, n - l);
+}
+
+// iovecs describing the free part of the ring
+int ring_free_iov(fd_ctx * c, iovec * iov) {
+	int tail = c->buf_start + c->buf_len;
+	if (tail >= FDCTX_CLIENT_BUFSIZE) {
+		tail -= FDCTX_CLIENT_BUFSIZE;
+		iov[0].iov_base = c->buf + tail;
+		iov[0].iov_len  = c->buf_start - tail;
+		return 1;
+	}
+	iov[0].iov_base = c->buf + tail;
+	iov[0].iov_len  = FDCTX_CLIENT_BUFSIZE - tail;
+	if (c->buf_start == 0) {
+		return 1;
+	}
+	iov[1].iov_base = c->buf;
+	iov[1].iov_len  = c->buf_start;
+	return 2;
+}
+
+void io_ring::arm_reads() {
+	for (int i = 0; i < want_read.size(); ++i) {
+		fd_ctx * p = want_read[i];
+		p->uring_ops &= ~URING_READ_WANTED;
+		if (p->fd != -1 && (! p->paused || p->dropped)) {
+			unsigned slot;
+			io_uring_sqe * sqe = get_sqe((uintptr_t) p | URING_OP_READ, &slot);
+			sqe->opcode = IORING_OP_READV;
+			sqe->fd     = p->fd;
+			sqe->addr   = (uintptr_t) sq_iov[slot];
+			sqe->len    = ring_free_iov(p, sq_iov[slot]);
+			// the reference moves to the read
+			p->uring_ops |= URING_READ_ARMED;
+			continue;
+		}
+		if (--p->refcount == 0) {
+			deallocate_fdctx(p);
+		}
+	}
+	want_read.clear();
+}
+
+// iovecs for len bytes starting at ring offset pos
+int ring_iov(fd_ctx * c, int pos, int len, iovec * iov) {
+	if (pos >= FDCTX_CLIENT_BUFSIZE) {
+		pos -= FDCTX_CLIENT_BUFSIZE;
+	}
+	iov[0].iov_base = c->buf + pos;
+	if (likely(pos + len <= FDCTX_CLIENT_BUFSIZE)) {
+		iov[0].iov_len = len;
+		return 1;
+	}
+	iov[0].iov_len  = FDCTX_CLIENT_BUFSIZE - pos;
+	iov[1].iov_base = c->buf;
+	iov[1].iov_len  = len - iov[0].iov_len;
+	return 2;
+}
+
+void ring_consume(fd_ctx * c, int n) {
+	c->buf_len -= n;
+	if (c->buf_len == 0) {
+		// start over at the front, most frames then never wrap
+		c->buf_start = 0;
+	} else {
+		c->buf_start += n;
+		if (c->buf_start >= FDCTX_CLIENT_BUFSIZE) {
+			c->buf_start -= FDCTX_CLIENT_BUFSIZE;
+		}
+	}
+}
+
+// turn the frame at buf_start into a frame for the peer, in place, and
+// return its iovecs
+int rewrite_to_peer(fd_ctx * c, const proxy_msg_header * h, int in_msg_size, iovec * iov) {
+	proxy_msg_header_to_peer hout;
+	hout.port = h->port;
+	const int out_size = in_msg_size - OUT_HEADER_OFFSET_ADJ;
+	hout.size = htonl(out_size);
+
+	int pos = c->buf_start + OUT_HEADER_OFFSET_ADJ;
+	if (pos >= FDCTX_CLIENT_BUFSIZE) {
+		pos -= FDCTX_CLIENT_BUFSIZE;
+	}
+	if (likely(pos + (int) sizeof(hout) <= FDCTX_CLIENT_BUFSIZE)) {
+		memcpy(c->buf + pos, &hout, sizeof(hout));
+	} else {
+		ring_copy_in(c, pos, (const char *) &hout, sizeof(hout));
+	}
+	return ring_iov(c, pos, out_size + 4, iov);
+}
+
+typedef std::vector<fd_ctx *> server_sockets_t;
+
+// frames for one peer collected during an epoll batch, they still live in
+// the receive rings of their senders (or in an inbound ring) and go out
+// with a single writev once the batch is done
+#define PENDING_IOV 64
+// per worker, reset with every flush
+#define SCRATCH_SIZE 65536
+
+struct pending_out {
+	fd_ctx * peer;
+	int iovcnt;
+	iovec iov[PENDING_IOV];
+};
+
+struct worker {
+	int id;
+	pthread_t thread;
+	// -A: the cpu we run on and its NUMA node, -1 when not pinned
+	int cpu;
+	int node;
+	int epoll;
+	int total_sockets;
+	server_sockets_t server_sockets;
+	peer_sockets_t peer_sockets;
+
+	// inbound[src] is written by worker src only
+	xthread_queue * inbound;
+	fd_ctx wake_ctx;
+	// the timerfd ticking the wheel every TW_TICK_MS
+	fd_ctx timer_ctx;
+	timer_wheel wheel;
+	uint64_t status_due;
+	bool wake_pending[MAX_WORKERS];
+	std::vector<int> wake_list;
+	uint64_t xthread_drops;
+	// senders waiting for room in a full cross-worker ring, retried every loop
+	std::vector<ctx_ref> xthread_blocked;
+	int sigusr1_seen;
+
+	// writes held back until the end of the batch, pending[0, npending)
+	std::vector<pending_out> pending;
+	int npending;
+	unsigned batch_gen;
+
+	// NULL unless -e io_uring
+	io_ring * ring;
+
+	// -E: connections that filled their buffer and have more to read
+	std::vector<ctx_ref> ready_list, ready_run;
+
+	// -U: our udp socket, every worker binds the same port
+	fd_ctx * udp_socket;
+	udp_batch * udp;
+	uint64_t udp_in, udp_out, udp_via_tcp, udp_rejected;
+
+	// cluster mode: our links to other nodes by node id
+	std::vector<fd_ctx *> links;
+	// decay mode: our link to the proxy that took over
+	fd_ctx * handoff_link;
+	double handoff_retry;
+	std::vector<double> link_retry;
+	// nodes[].gen the link was opened for
+	std::vector<uint32_t> link_gen;
+	uint64_t relayed, relay_drops;
+	// frames over SPLICE_MIN_FRAME: pipes of finished streams, pairs of fds
+	std::vector<int> spare_pipes;
+	uint64_t spliced_frames, spliced_bytes, gathered_frames;
+	// XQ_HEAP buffers drained from inbound, freed once they are written
+	std::vector<char *> heap_frames;
+	// headers built for multicast frames, they have to live as long as
+	// the pending writes pointing into them
+	char * scratch;
+	int scratch_len;
+	// only worker 0: the peer book connections and what goes out on them
+	// at the end of the batch
+	fd_ctx * book_listener;
+	std::vector<fd_ctx *> book_nodes;
+	fd_ctx * book_master;
+	double book_retry;
+	std::vector<book_record> book_out;
+	int next_node;
+
+	worker_metrics metrics;
+	// when the events of this round came in, with -m
+	double batch_time;
+	// -C: what is left of the block of the capture log we fill
+	char * capture_pos;
+	char * capture_end;
+
+	// hot restart, only used by worker 0
+	const char * ctrl_socket_path;
+	fd_ctx ctrl_socket, ctrl_socket_conn;
+	bool ctrl_socket_mode_listen;
+	bool decay_mode;
+	int sockets_inherited;
+	long bytes_inherited;
+	double inherit_start;
+	long bytes_handed_over;
+	// adopted with complete frames in their rings, parsed once the old
+	// process said done and their peers are all here as well
+	std::vector<ctx_ref> adopted_frames;
+	bool inherit_done;
+
+	worker() : id(0), cpu(-1), node(-1), epoll(-1), total_sockets(0), inbound(NULL), xthread_drops(0), sigusr1_seen(0), npending(0), batch_gen(1), ring(NULL),
+			   udp_socket(NULL), udp(NULL), udp_in(0), udp_out(0), udp_via_tcp(0), udp_rejected(0),
+			   links(MAX_NODES, (fd_ctx *) NULL), handoff_link(NULL), handoff_retry(0), link_retry(MAX_NODES, 0.0), link_gen(MAX_NODES, 0), relayed(0), relay_drops(0),
+			   spliced_frames(0), spliced_bytes(0), gathered_frames(0), scratch((char *) malloc(SCRATCH_SIZE)), scratch_len(0),
+			   book_listener(NULL), book_master(NULL), book_retry(0), next_node(MASTER_NODE + 1), batch_time(0),
+			   capture_pos(NULL), capture_end(NULL),
+			   ctrl_socket_path(NULL), ctrl_socket_mode_listen(false), decay_mode(false), sockets_inherited(0),
+			   bytes_inherited(0), inherit_start(0), bytes_handed_over(0), inherit_done(false) {
+		memset(wake_pending, 0, sizeof(wake_pending));
+		memset(&metrics, 0, sizeof(metrics));
+		wake_ctx.fd = -1;
+		timer_ctx.fd = -1;
+		status_due = STATUS_INTERVAL_MS / TW_TICK_MS;
+		ctrl_socket.fd = -1;
+		ctrl_socket_conn.fd = -1;
+	}
+
+	void pin();
+	void register_peer(fd_ctx * ctxp);
+	void unregister_peer(fd_ctx * ctxp);
+	void accept_client(int nsock);
+	bool client_writable(fd_ctx * ctxp);
+	void client_event(fd_ctx * ctxp, uint32_t events);
+	void make_ready(fd_ctx * ctxp);
+	void run_ready();
+	void close_client(fd_ctx * ctxp);
+	void queue_to_peer(fd_ctx * sender, fd_ctx * peer, const iovec * iov, int iovcnt);
+	void flush_pending();
+	void forward_remote(int owner, uint16_t uid, const iovec * iov, int iovcnt);
+	void block_on_xthread(fd_ctx * ctxp);
+	void retry_blocked();
+	void process_frames(fd_ctx * ctxp);
+	bool start_stream(fd_ctx * ctxp, const proxy_msg_header * h, int in_msg_size);
+	void stream_pump(fd_ctx * ctxp);
+	void stream_detach(frame_stream * s);
+	void stream_end(fd_ctx * ctxp);
+	void gather_done(fd_ctx * ctxp);
+	void control_frame(fd_ctx * ctxp, int in_msg_size);
+	void place_game(fd_ctx * ctxp, const uint8_t * p, int len);
+	char * scratch_alloc(int n);
+	// false: another worker's ring is full, nothing was sent
+	bool multicast(fd_ctx * ctxp, int in_msg_size);
+	void udp_event();
+	void udp_to_tcp(char * p, int len);
+	fd_ctx * connect_link(const sockaddr * sa, socklen_t sl, int node);
+	fd_ctx * open_link(int node);
+	fd_ctx * handoff_target();
+	fd_ctx * node_link(int node);
+	fd_ctx * link_for(uint16_t uid);
+	void relay_remote(fd_ctx * ctxp, uint16_t uid, int in_msg_size);
+	void book_local(uint16_t uid, bool added);
+	void book_note(uint16_t uid, bool added);
+	void book_send(fd_ctx * c, uint16_t op, const void * body, int len);
+	void book_send_records(fd_ctx * c, const book_record * recs, int n);
+	void book_connect();
+	void book_accept(int nsock);
+	void book_event(fd_ctx * ctxp, uint32_t events);
+	// false: it closed ctxp
+	bool book_message(fd_ctx * ctxp, int op, const char * p, int len);
+	void book_close(fd_ctx * ctxp);
+	void book_flush();
+	void metrics_event(fd_ctx * ctxp, uint32_t events);
+	void metrics_render(std::string & out);
+	void deliver_local(uint16_t uid, const char * p, int len);
+	void drain_inbound();
+	void timer_event();
+	void timer_expired(fd_ctx * ctxp);
+	void timer_start(fd_ctx * ctxp, int ms);
+	// -C: the frame at the start of ctxp's ring, as far as it is there
+	void capture_frame(fd_ctx * ctxp, const proxy_msg_header * h, int in_msg_size);
+	// -r: takes a frame of size bytes out of the client's buckets, true if
+	// they do not hold that much. links are never limited
+	bool over_rate(fd_ctx * ctxp, int size) {
+		if (likely(! rate_msgs && ! rate_bytes) || ctxp->link_node >= 0) {
+			return false;
+		}
+		// in 1/per_s of a frame or byte, so that a tick adds the rate as it
+		// is. 64 bit, a byte rate times per_s does not fit into a long of -mx32
+		const int64_t per_s = 1000 / TW_TICK_MS;
+		if (ctxp->rl_tick != wheel.now) {
+			// a new context starts out full
+			const int64_t ticks = ctxp->rl_tick > wheel.now ? per_s : (int64_t) std::min(wheel.now - ctxp->rl_tick, (uint64_t) per_s);
+			ctxp->rl_tick = wheel.now;
+			ctxp->rl_msgs  = std::min(rate_msgs * per_s, ctxp->rl_msgs + ticks * rate_msgs);
+			ctxp->rl_bytes = std::min(rate_bytes * per_s, ctxp->rl_bytes + ticks * rate_bytes);
+		}
+		if ((rate_msgs && ctxp->rl_msgs < per_s) || (rate_bytes && ctxp->rl_bytes < size * per_s)) {
+			++metrics.rate_limited;
+			metrics.rate_limited_bytes += size;
+			return true;
+		}
+		ctxp->rl_msgs  -= per_s;
+		ctxp->rl_bytes -= size * per_s;
+		return false;
+	}
+	void status_report();
+	void wake_remotes();
+	void close_servers();
+	void ring_arm_accept(fd_ctx * server);
+	void ring_arm_wake();
+	void ring_arm_timer();
+	void ring_complete(const io_uring_cqe & cqe);
+	void ring_batch(int timeout_ms);
+	template <typename Iter, typename Container>
+	int send_fds(int ctrlsock, Iter & beg, Iter end, Container * all);
+	int send_fd(int ctrlsock, fd_ctx * ctxp) {
+		fd_ctx ** beg = &ctxp;
+		return send_fds(ctrlsock, beg, &ctxp + 1, (dummy_erase_container<fd_ctx *> *) NULL);
+	}
+	void adopt_fds(const char * p, int n, const int * fds, int nfds, bool with_buffers);
+	void run();
+};
+
+// hands the connections in [beg, end) to the process on ctrlsock until one
+// message is full and advances beg past them. returns how many were sent,
+// -1 if sendmsg failed.
+// connections that are dropped or whose buffers do not fit into a message
+// at all are skipped and stay with us.
+template <typename Iter, typename Container>
+int worker::send_fds(int ctrlsock, Iter & beg, Iter end, Container * all) {
+	char control[CMSG_SPACE(sizeof(int) * MAX_DESC_PER_MESSAGE)];
+	char buf[MAX_CONTROL_MESSAGE_SIZE];
+	msghdr msg;
+
+	msg.msg_name       = NULL;
+	msg.msg_namelen    = 0;
+	msg.msg_control    = control;
+	msg.msg_controllen = sizeof(control);
+
+	memcpy(buf, "dsc2", 4);
+
+	cmsghdr * cmp = CMSG_FIRSTHDR(&msg);
+
+	cmp->cmsg_level = SOL_SOCKET;
+	cmp->cmsg_type  = SCM_RIGHTS;
+
+	// nothing may be held back for a socket we are about to give away
+	flush_pending();
+
+	int fd_count = 0;
+	int len = 4;
+	std::vector<fd_ctx *> to_close;
+
+	for (; beg != end && fd_count < MAX_DESC_PER_MESSAGE; ++beg) {
+		fd_ctx * c = *beg;
+		const int need = sizeof(desc_record) + c->buf_len + c->out.len;
+		// in the middle of a large frame, its socket is not at a frame boundary
+		if (c->dropped || c->stream || c->stream_in || 4 + need > MAX_CONTROL_MESSAGE_SIZE) {
+			continue;
+		}
+		if (len + need > MAX_CONTROL_MESSAGE_SIZE) {
+			break;
+		}
+		desc_record r;
+		r.uid     = c->faf_uid;
+		r.buf_len = c->buf_len;
+		r.out_len = c->out.len;
+		memcpy(buf + len, &r, sizeof(r));
+		len += sizeof(r);
+		bytes_handed_over += c->buf_len + c->out.len;
+		ring_copy_out(c, c->buf_start, buf + len, c->buf_len);
+		len += c->buf_len;
+		c->out.copy_to(buf + len);
+		len += c->out.len;
+
+		* ((int *) CMSG_DATA(cmp) + fd_count) = c->fd;
+		to_close.push_back(c);
+		++fd_count;
+	}
+
+	if (! fd_count) {
+		return 0;
+	}
+
+	cmp->cmsg_len      = CMSG_LEN(sizeof(int) * fd_count);
+	msg.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+	iovec iov;
+	iov.iov_base   = buf;
+	iov.iov_len    = len;
+	msg.msg_iov    = &iov;
+	msg.msg_iovlen = 1;
+
+	if (sendmsg(ctrlsock, &msg, 0) < 0) {
+		return VPERROR("sendmsg");
+	}
+	if (all) all->erase(&to_close[0], &to_close[0] + to_close.size());
+	total_sockets -= to_close.size();
+	metrics.handed_over += to_close.size();
+	// we dont care about caches and refcounts and destroying contexts,
+	// so we cheat and handle the global counters here
+	for (int i = 0; i < to_close.size(); ++i) {
+		if (epoll_ctl(epoll, EPOLL_CTL_DEL, to_close[i]->fd, NULL) < 0) {
+			VPERROR("epoll_ctl");
+		}
+
+		close(to_close[i]->fd);
+		to_close[i]->fd = -1;
+		to_close[i]->buf_len = 0;
+		to_close[i]->out.clear();
+		// senders paused on a socket we just gave away
+		wake_waiters(epoll, to_close[i]);
+	}
+	return fd_count;
+}
+
+// counterpart of send_fds: one context per descriptor, with the unparsed
+// input and the unsent output of the old process if it sent them along
+void worker::adopt_fds(const char * p, int n, const int * fds, int nfds, bool with_buffers) {
+	const char * end = p + n;
+	int i = 0;
+	for (; i < nfds; ++i) {
+		desc_record r;
+		if (with_buffers) {
+			if (end - p < (int) sizeof(r)) break;
+			memcpy(&r, p, sizeof(r));
+			p += sizeof(r);
+			if (r.buf_len < 0 || r.buf_len > FDCTX_CLIENT_BUFSIZE || r.out_len < 0 || end - p < r.buf_len + r.out_len) break;
+		} else {
+			if (end - p < (int) sizeof(int)) break;
+			memcpy(&r.uid, p, sizeof(int));
+			p += sizeof(int);
+			r.buf_len = 0;
+			r.out_len = 0;
+		}
+		++sockets_inherited;
+		++total_sockets;
+		fd_ctx * cp = allocate_fdctx(FDCTX_CLIENT_BUFSIZE);
+		cp->fd = fds[i];
+		cp->faf_uid = r.uid;
+		cp->is_server = false;
+		cp->protocol = IPPROTO_TCP;
+		// usually the start of a frame. a context that yielded to -q comes
+		// with complete frames as well, nobody reads them before the
+		// socket has more unless they are put on the ready list
+		memcpy(cp->buf, p, r.buf_len);
+		cp->buf_len = r.buf_len;
+		p += r.buf_len;
+		if (r.out_len) {
+			cp->out.append(p, r.out_len);
+			cp->ev_mask |= EPOLLOUT;
+			p += r.out_len;
+		}
+		bytes_inherited += r.buf_len + r.out_len;
+		set_nonblocking(cp->fd);
+		epoll_event ev;
+		ev.events = cp->ev_mask;
+		ev.data.ptr = (void *) cp;
+		if (epoll_ctl(epoll, EPOLL_CTL_ADD, cp->fd, &ev) < 0) {
+			VPERROR("epoll_ctl");
+			--total_sockets;
+			close(cp->fd);
+			deallocate_fdctx(cp);
+			continue;
+		}
+		if (cp->faf_uid != -1) {
+			register_peer(cp);
+		}
+		timer_start(cp, cp->faf_uid != -1 ? idle_timeout_ms : HANDSHAKE_TIMEOUT_MS);
+		if (cp->buf_len >= 4) {
+			if (inherit_done) {
+				make_ready(cp);
+			} else {
+				adopted_frames.push_back(cp);
+			}
+		}
+	}
+	if (i < nfds) {
+		fprintf(stderr, "malformed control message: %d of %d descriptors described\n", i, nfds);
+		exit(1);
+	}
+}
+
+void worker::register_peer(fd_ctx * ctxp) {
+	peer_sockets.insert(ctxp);
+	// a new connection for the uid has to register for udp again
+	udp_set_token(ctxp->faf_uid, 0);
+	if (nworkers > 1 || cluster) {
+		__atomic_store_n(&uid_owner[ctxp->faf_uid], (int16_t) id, __ATOMIC_RELEASE);
+	}
+	if (cluster) {
+		book_local(ctxp->faf_uid, true);
+	}
+}
+
+void worker::unregister_peer(fd_ctx * ctxp) {
+	if (! peer_sockets.erase(ctxp)) {
+		// replaced by a newer connection for the same uid
+		return;
+	}
+	if (nworkers > 1 || cluster) {
+		int16_t expected = id;
+		if (! __atomic_compare_exchange_n(&uid_owner[ctxp->faf_uid], &expected, (int16_t) -1,
+										  false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			// the uid is connected to another worker by now
+			return;
+		}
+	}
+	udp_set_token(ctxp->faf_uid, 0);
+	if (cluster) {
+		book_local(ctxp->faf_uid, false);
+	}
+}
+
+void worker::close_client(fd_ctx * ctxp) {
+	if (unlikely(ctxp->pend_gen == batch_gen && npending)) {
+		// our buffer goes back to the pool, send what still points into it
+		flush_pending();
+	}
+	if (ctxp->pend_idx >= 0) {
+		pending[ctxp->pend_idx].peer = NULL;
+		ctxp->pend_idx = -1;
+	}
+	if (ctxp->uring_ops & (URING_READ_ARMED | URING_POLLOUT_ARMED)) {
+		// completes what is armed, close alone would leave it pending
+		shutdown(ctxp->fd, SHUT_RDWR);
+	}
+	close(ctxp->fd);
+	ctxp->fd = -1;
+	if (unlikely(ctxp->stream != NULL)) {
+		stream_end(ctxp);
+	}
+	if (unlikely(ctxp->stream_in != NULL)) {
+		// the rest of the frame goes nowhere
+		stream_detach(ctxp->stream_in->stream);
+	}
+	if (ctxp->link_node < 0) {
+		--total_sockets;
+	} else if (ctxp->link_node > 0 && links[ctxp->link_node] == ctxp) {
+		links[ctxp->link_node] = NULL;
+	} else if (ctxp == handoff_link) {
+		handoff_link = NULL;
+	}
+	if (ctxp->faf_uid != -1) {
+		unregister_peer(ctxp);
+	}
+	ctxp->out.clear();
+	wake_waiters(epoll, ctxp);
+	--ctxp->refcount;
+	if (ctxp->refcount == 0) {
+		deallocate_fdctx(ctxp);
+	} else {
+		ctxp->faf_uid = -1;
+	}
+}
+
+void worker::queue_to_peer(fd_ctx * sender, fd_ctx * peer, const iovec * iov, int iovcnt) {
+	if (unlikely(peer->dropped)) {
+		return;
+	}
+	if (unlikely((! peer->out.empty() || peer->stream_in) && peer->pend_idx < 0)) {
+		// it ends up behind the queued bytes anyway. once something is
+		// pending for the peer everything has to queue up behind that.
+		send_to_peer(epoll, peer, iov, iovcnt);
+		return;
+	}
+	if (peer->pend_idx < 0) {
+		if (npending == (int) pending.size()) {
+			pending.resize(npending + 1);
+		}
+		peer->pend_idx = npending++;
+		pending[peer->pend_idx].peer   = peer;
+		pending[peer->pend_idx].iovcnt = 0;
+	}
+	if (sender) {
+		sender->pend_gen = batch_gen;
+	}
+	pending_out & po = pending[peer->pend_idx];
+	for (int i = 0; i < iovcnt; ++i) {
+		// frames back to back in the sender's ring end up in one iovec
+		if (po.iovcnt) {
+			iovec & last = po.iov[po.iovcnt - 1];
+			if ((char *) last.iov_base + last.iov_len == iov[i].iov_base) {
+				last.iov_len += iov[i].iov_len;
+				continue;
+			}
+		}
+		if (unlikely(po.iovcnt == PENDING_IOV)) {
+			send_to_peer(epoll, peer, po.iov, po.iovcnt);
+			po.iovcnt = 0;
+		}
+		po.iov[po.iovcnt++] = iov[i];
+	}
+}
+
+void worker::flush_pending() {
+	if (metrics_port && npending) {
+		metrics.observe((int64_t) ((now_ms() - batch_time) * 1000), npending);
+	}
+	int nsend = 0;
+	for (int i = 0; i < npending; ++i) {
+		pending_out & po = pending[i];
+		if (! po.peer) {
+			continue;
+		}
+		po.peer->pend_idx = -1;
+		if (ring && ! po.peer->dropped && po.peer->out.empty()) {
+			// one io_uring_enter for all of them
+			unsigned slot;
+			io_uring_sqe * sqe = ring->get_sqe(((uint64_t) i << 3) | URING_OP_SEND, &slot);
+			msghdr & msg = ring->sq_msg[slot];
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov    = po.iov;
+			msg.msg_iovlen = po.iovcnt;
+			sqe->opcode    = IORING_OP_SENDMSG;
+			sqe->fd        = po.peer->fd;
+			sqe->addr      = (uintptr_t) &msg;
+			sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+			++nsend;
+			continue;
+		}
+		send_to_peer(epoll, po.peer, po.iov, po.iovcnt);
+		if (unlikely(drop_slow_peers && po.peer->out.len > out_hwm)) {
+			drop_peer(po.peer);
+		}
+	}
+	if (nsend) {
+		// MSG_DONTWAIT sends complete during submit, anything else
+		// that shows up meanwhile waits for the next batch
+		ring->enter(nsend, -1);
+		io_uring_cqe cqe;
+		while (nsend) {
+			if (! ring->pop(&cqe)) {
+				ring->enter(1, -1);
+				continue;
+			}
+			if ((cqe.user_data & URING_OP_MASK) != URING_OP_SEND) {
+				ring->deferred.push_back(cqe);
+				continue;
+			}
+			--nsend;
+			pending_out & po = pending[cqe.user_data >> 3];
+			int sent = cqe.res;
+			if (unlikely(sent < 0)) {
+				if (sent != -EAGAIN && sent != -EINTR) {
+					if (sent != -ECONNRESET && sent != -EPIPE) {
+						errno = -sent;
+						VPERROR("sendmsg");
 					}
+					continue;
 				}
-				ctrl_socket_listen(s, ctrl_socket_path);
-				ctrl_socket.fd = s;
-				poll_in(epoll, &ctrl_socket);
-				ctrl_socket_mode_listen = true;
+				sent = 0;
+			}
+			queue_unsent(epoll, po.peer, po.iov, po.iovcnt, sent);
+			if (unlikely(drop_slow_peers && po.peer->out.len > out_hwm)) {
+				drop_peer(po.peer);
+			}
+		}
+	}
+	npending = 0;
+	scratch_len = 0;
+	++batch_gen;
+}
+
+void worker::forward_remote(int owner, uint16_t uid, const iovec * iov, int iovcnt) {
+	if (unlikely(! workers[owner].inbound[id].push(uid, iov, iovcnt))) {
+		++xthread_drops;
+		return;
+	}
+	if (! wake_pending[owner]) {
+		wake_pending[owner] = true;
+		wake_list.push_back(owner);
+	}
+}
+
+void worker::block_on_xthread(fd_ctx * ctxp) {
+	if (! ctxp->paused) {
+		ctxp->paused = true;
+		update_events(epoll, ctxp);
+	}
+	xthread_blocked.push_back(ctxp);
+}
+
+void worker::retry_blocked() {
+	std::vector<ctx_ref> blocked;
+	blocked.swap(xthread_blocked);
+	for (int i = 0; i < blocked.size(); ++i) {
+		fd_ctx * c = blocked[i].get();
+		if (c && c->fd != -1) {
+			c->paused = false;
+			update_events(epoll, c);
+			process_frames(c);
+		}
+	}
+}
+
+// a frame some other worker handed us, we can not pause its sender
+void worker::deliver_local(uint16_t uid, const char * p, int len) {
+	fd_ctx * peer = peer_sockets.find(uid);
+	if (! peer) {
+		return;
+	}
+	iovec iov;
+	iov.iov_base = (void *) p;
+	iov.iov_len  = len;
+	queue_to_peer(NULL, peer, &iov, 1);
+	if (unlikely(drop_slow_peers && peer->out.len > out_hwm)) {
+		drop_peer(peer);
+	}
+}
+
+void worker::drain_inbound() {
+	uint64_t v;
+	if (read(wake_ctx.fd, &v, sizeof(v)) < 0 && errno != EAGAIN) {
+		VPERROR("read(eventfd)");
+	}
+	uint64_t heads[MAX_WORKERS];
+	for (int src = 0; src < nworkers; ++src) {
+		xthread_queue & q = inbound[src];
+		uint64_t h = q.head;
+		const uint64_t t = __atomic_load_n(&q.tail, __ATOMIC_ACQUIRE);
+		while (h != t) {
+			xq_record * r = (xq_record *) (q.data + (h & (XQ_SIZE - 1)));
+			if (r->len == XQ_WRAP) {
+				h += XQ_SIZE - (h & (XQ_SIZE - 1));
+				continue;
+			}
+			if (unlikely(r->flags == XQ_HEAP)) {
+				char * p;
+				memcpy(&p, r + 1, sizeof(p));
+				const proxy_msg_header_to_peer * h = (const proxy_msg_header_to_peer *) (p + OUT_HEADER_OFFSET_ADJ);
+				deliver_local(r->destuid, (const char *) h, ntohl(h->size) + 4);
+				heap_frames.push_back(p);
+			} else if (unlikely(r->flags == XQ_MULTI)) {
+				const uint8_t * list = (const uint8_t *) (r + 1);
+				const int count = list[0];
+				const char * frame = (const char *) list + 1 + 2 * count;
+				const int len = r->len - 1 - 2 * count;
+				for (int i = 0; i < count; ++i) {
+					uint16_t uid;
+					memcpy(&uid, list + 1 + 2 * i, sizeof(uid));
+					deliver_local(ntohs(uid), frame, len);
+				}
+			} else if (unlikely(r->flags)) {
+				book_note(r->destuid, r->flags == XQ_BOOK_ADD);
 			} else {
-				fprintf(stderr, "connect(%s): %s\n", ctrl_socket_path, strerror(errno));
+				deliver_local(r->destuid, (const char *) (r + 1), r->len);
+			}
+			h += (sizeof(xq_record) + r->len + 7) & ~7;
+		}
+		heads[src] = h;
+	}
+	// the records are only handed back once the writes pointing into them are done
+	flush_pending();
+	for (int src = 0; src < nworkers; ++src) {
+		__atomic_store_n(&inbound[src].head, heads[src], __ATOMIC_RELEASE);
+	}
+	for (int i = 0; i < heap_frames.size(); ++i) {
+		free(heap_frames[i]);
+	}
+	heap_frames.clear();
+}
+
+void worker::wake_remotes() {
+	for (int i = 0; i < wake_list.size(); ++i) {
+		uint64_t one = 1;
+		if (write(workers[wake_list[i]].wake_ctx.fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+			VPERROR("write(eventfd)");
+		}
+		wake_pending[wake_list[i]] = false;
+	}
+	wake_list.clear();
+}
+
+void worker::close_servers() {
+	for (int i = 0; i < server_sockets.size(); ++i) {
+		fprintf(stderr, "close server %s\n", server_sockets[i]->buf);
+		if (ring) {
+			// ends the multishot accept
+			shutdown(server_sockets[i]->fd, SHUT_RDWR);
+		} else if (epoll_ctl(epoll, EPOLL_CTL_DEL, server_sockets[i]->fd, NULL) < 0) {
+			VPERROR("epoll_ctl");
+		}
+		close(server_sockets[i]->fd);
+		server_sockets[i]->fd = -1;
+		--total_sockets;
+	}
+}
+
+void worker::ring_arm_accept(fd_ctx * server) {
+	io_uring_sqe * sqe = ring->get_sqe((uintptr_t) server | URING_OP_ACCEPT);
+	sqe->opcode       = IORING_OP_ACCEPT;
+	sqe->fd           = server->fd;
+	sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK;
+}
+
+void worker::ring_arm_wake() {
+	io_uring_sqe * sqe = ring->get_sqe((uintptr_t) &wake_ctx | URING_OP_WAKE);
+	sqe->opcode        = IORING_OP_POLL_ADD;
+	sqe->fd            = wake_ctx.fd;
+	sqe->poll32_events = POLLIN;
+}
+
+void worker::ring_arm_timer() {
+	io_uring_sqe * sqe = ring->get_sqe((uintptr_t) &timer_ctx | URING_OP_TIMER);
+	sqe->opcode        = IORING_OP_POLL_ADD;
+	sqe->fd            = timer_ctx.fd;
+	sqe->poll32_events = POLLIN;
+}
+
+void worker::ring_complete(const io_uring_cqe & cqe) {
+	fd_ctx * ctxp = (fd_ctx *) (uintptr_t) (cqe.user_data & ~(uint64_t) URING_OP_MASK);
+	const int res = cqe.res;
+
+	switch (cqe.user_data & URING_OP_MASK) {
+	case URING_OP_ACCEPT:
+		if (res >= 0) {
+			accept_client(res);
+		} else if (ctxp->fd != -1 && res != -EAGAIN && res != -EINTR) {
+			errno = -res;
+			VPERROR("accept");
+		}
+		if (! (cqe.flags & IORING_CQE_F_MORE) && ctxp->fd != -1) {
+			ring_arm_accept(ctxp);
+		}
+		return;
+	case URING_OP_WAKE:
+		drain_inbound();
+		ring_arm_wake();
+		return;
+	case URING_OP_TIMER:
+		timer_event();
+		ring_arm_timer();
+		return;
+	case URING_OP_POLLOUT:
+		ctxp->uring_ops &= ~URING_POLLOUT_ARMED;
+		if (ctxp->fd == -1) {
+			break;
+		}
+		if (unlikely(ctxp->dropped)) {
+			close_client(ctxp);
+		} else {
+			client_writable(ctxp);
+		}
+		break;
+	case URING_OP_READ:
+		ctxp->uring_ops &= ~URING_READ_ARMED;
+		if (ctxp->fd == -1) {
+			break;
+		}
+		if (unlikely(ctxp->dropped)) {
+			close_client(ctxp);
+		} else if (likely(res > 0)) {
+			ctxp->last_active = wheel.now;
+			ctxp->buf_len += res;
+			process_frames(ctxp);
+			if (ctxp->fd != -1) {
+				update_events(epoll, ctxp);
+			}
+		} else if (res == -EAGAIN || res == -EINTR) {
+			update_events(epoll, ctxp);
+		} else {
+			if (res < 0 && res != -ECONNRESET) {
+				errno = -res;
+				VPERROR("read");
+			}
+			close_client(ctxp);
+		}
+		break;
+	}
+	if (--ctxp->refcount == 0) {
+		deallocate_fdctx(ctxp);
+	}
+}
+
+void worker::ring_batch(int timeout_ms) {
+	ring->arm_reads();
+	ring->enter(ring->deferred.empty() ? 1 : 0, timeout_ms);
+
+	std::vector<io_uring_cqe> todo;
+	todo.swap(ring->deferred);
+	for (int i = 0; i < todo.size(); ++i) {
+		ring_complete(todo[i]);
+	}
+	// whatever completes while we are at it is left for the next batch
+	io_uring_cqe cqe;
+	for (unsigned n = ring->ready(); n && ring->pop(&cqe); --n) {
+		ring_complete(cqe);
+	}
+}
+
+// -A: of the SO_REUSEPORT sockets on a port the one of the cpu that
+// received the packet gets it, the first packet of a connection for a
+// listener. that cpu is the one that serves the NIC queue, so its
+// interrupts should go to the cpus of -A. Linux 6.2 and later honour it
+// within a SO_REUSEPORT group
+void set_incoming_cpu(int s, int cpu) {
+	if (cpu >= 0 && setsockopt(s, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) {
+		VPERROR("setsockopt(SO_INCOMING_CPU)");
+	}
+}
+
+void open_listeners(worker & w, int listen_port) {
+	char listen_port_str[8];
+	sprintf(listen_port_str, "%d", listen_port);
+
+	struct addrinfo hints, * ai_res;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	hints.ai_flags    = AI_PASSIVE;
+
+	int r = getaddrinfo(NULL, listen_port_str, &hints, &ai_res);
+	if (r) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(r));
+		exit(1);
+	}
+
+	for (struct addrinfo * ai = ai_res; ai; ai = ai->ai_next) {
+		int s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (s < 0) {
+			VPERROR("socket"); exit(1);
+		}
+		if (ai->ai_family == AF_INET6) {
+			int on = 1;
+			if (setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY,
+						   (char *)&on, sizeof(on)) == -1) {
+				VPERROR("setsockopt(IPV6_ONLY)");
+				exit(1);
+			}
+		}
+		{
+			int on = 1;
+			if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (char *) &on, sizeof(on)) == -1) {
+				VPERROR("setsockopt(REUSEADDR)");
+				exit(1);
+			}
+		}
+		// every worker has its own listener, the kernel spreads connections
+		if (nworkers > 1) {
+			int on = 1;
+			if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (char *) &on, sizeof(on)) == -1) {
+				VPERROR("setsockopt(REUSEPORT)");
+				exit(1);
 			}
+			set_incoming_cpu(s, w.cpu);
+		}
+		if (bind(s, ai->ai_addr, ai->ai_addrlen) < 0) {
+			VPERROR("bind"); exit(1);
+		}
+		if (listen(s, SOMAXCONN) < 0) {
+			VPERROR("listen"); exit(1);
+		}
+		// accepted until EAGAIN
+		set_nonblocking(s);
+		fd_ctx * c = allocate_fdctx(FDCTX_TCP_SERVER_BUFSIZE);
+		c->fd = s;
+		c->is_server = true;
+		c->protocol  = ai->ai_protocol;
+		char * strp  = c->buf;
+		int slen     = FDCTX_TCP_SERVER_BUFSIZE;
+		if (ai->ai_family == AF_INET6) {
+			*strp++ = '[';
+			slen -= 2;
+		}
+		get_ip_str(ai->ai_addr, strp, slen);
+		if (ai->ai_family == AF_INET6) {
+			strcat(c->buf, "]");
+		}
+		sprintf(c->buf + strlen(c->buf), ":%d", listen_port);
+		w.server_sockets.push_back(c);
+	}
+	freeaddrinfo(ai_res);
+}
+
+// a dual stack socket where the system has one, plain ipv4 otherwise
+void open_udp(worker & w) {
+	int family = AF_INET6;
+	int s = socket(AF_INET6, SOCK_DGRAM, 0);
+	if (s < 0) {
+		family = AF_INET;
+		s = socket(AF_INET, SOCK_DGRAM, 0);
+	}
+	if (s < 0) {
+		VPERROR("socket(SOCK_DGRAM)"); exit(1);
+	}
+	int on = 1, off = 0;
+	if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (char *) &on, sizeof(on)) == -1) {
+		VPERROR("setsockopt(REUSEPORT)"); exit(1);
+	}
+	set_incoming_cpu(s, w.cpu);
+	sockaddr_in6 sin6;
+	sockaddr_in sin;
+	memset(&sin6, 0, sizeof(sin6));
+	memset(&sin, 0, sizeof(sin));
+	int r;
+	if (family == AF_INET6) {
+		setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &off, sizeof(off));
+		sin6.sin6_family = AF_INET6;
+		sin6.sin6_addr   = in6addr_any;
+		sin6.sin6_port   = htons(udp_port);
+		r = bind(s, (sockaddr *) &sin6, sizeof(sin6));
+	} else {
+		sin.sin_family      = AF_INET;
+		sin.sin_addr.s_addr = htonl(INADDR_ANY);
+		sin.sin_port        = htons(udp_port);
+		r = bind(s, (sockaddr *) &sin, sizeof(sin));
+	}
+	if (r < 0) {
+		VPERROR("bind(udp)"); exit(1);
+	}
+	set_nonblocking(s);
+
+	fd_ctx * c = allocate_fdctx(FDCTX_TCP_SERVER_BUFSIZE);
+	c->fd = s;
+	c->is_server = true;
+	c->protocol  = IPPROTO_UDP;
+	sprintf(c->buf, "%s:%d/udp", family == AF_INET6 ? "[::]" : "0.0.0.0", udp_port);
+	w.udp_socket = c;
+	w.udp = new udp_batch;
+	for (int i = 0; i < UDP_BATCH; ++i) {
+		w.udp->in_iov[i].iov_base = w.udp->buf[i];
+		w.udp->in_iov[i].iov_len  = UDP_MAX_DATAGRAM;
+		msghdr & m = w.udp->in[i].msg_hdr;
+		memset(&m, 0, sizeof(m));
+		m.msg_name    = &w.udp->from[i];
+		m.msg_namelen = sizeof(w.udp->from[i]);
+		m.msg_iov     = &w.udp->in_iov[i];
+		m.msg_iovlen  = 1;
+	}
+}
+
+// -M and -m: a dual stack listener on worker 0 for something else than clients
+void open_side_listener(worker & w, int port, int protocol) {
+	int family = AF_INET6;
+	int s = socket(AF_INET6, SOCK_STREAM, 0);
+	if (s < 0) {
+		family = AF_INET;
+		s = socket(AF_INET, SOCK_STREAM, 0);
+	}
+	if (s < 0) {
+		VPERROR("socket"); exit(1);
+	}
+	int on = 1, off = 0;
+	if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (char *) &on, sizeof(on)) == -1) {
+		VPERROR("setsockopt(REUSEADDR)"); exit(1);
+	}
+	sockaddr_storage ss;
+	memset(&ss, 0, sizeof(ss));
+	socklen_t sl;
+	if (family == AF_INET6) {
+		setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &off, sizeof(off));
+		sockaddr_in6 * sin6 = (sockaddr_in6 *) &ss;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_addr   = in6addr_any;
+		sin6->sin6_port   = htons(port);
+		sl = sizeof(*sin6);
+	} else {
+		sockaddr_in * sin = (sockaddr_in *) &ss;
+		sin->sin_family      = AF_INET;
+		sin->sin_addr.s_addr = htonl(INADDR_ANY);
+		sin->sin_port        = htons(port);
+		sl = sizeof(*sin);
+	}
+	if (bind(s, (sockaddr *) &ss, sl) < 0) {
+		VPERROR(protocol == PROTO_BOOK ? "bind(-M)" : "bind(-m)"); exit(1);
+	}
+	if (listen(s, SOMAXCONN) < 0) {
+		VPERROR("listen"); exit(1);
+	}
+	set_nonblocking(s);
+	fd_ctx * c = allocate_fdctx(FDCTX_TCP_SERVER_BUFSIZE);
+	c->fd = s;
+	c->is_server = true;
+	c->protocol  = protocol;
+	c->link_node = 0;
+	if (protocol == PROTO_BOOK) {
+		w.book_listener = c;
+	}
+	poll_in(w.epoll, c);
+}
+
+void worker::accept_client(int nsock) {
+	++total_sockets;
+	if (busy_poll_us && setsockopt(nsock, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(busy_poll_us)) < 0) {
+		// EPERM above net.core.busy_read without CAP_NET_ADMIN, say it once
+		static bool said = false;
+		if (! said) {
+			said = true;
+			VPERROR("setsockopt(SO_BUSY_POLL)");
+		}
+	}
+	if (cpu >= 0) {
+		int incoming = -1;
+		socklen_t len = sizeof(incoming);
+		if (getsockopt(nsock, SOL_SOCKET, SO_INCOMING_CPU, &incoming, &len) == 0 && incoming >= 0 && incoming != cpu) {
+			++metrics.foreign_cpu;
+		}
+	}
+	fd_ctx * cp = allocate_fdctx(FDCTX_CLIENT_BUFSIZE);
+	cp->fd = nsock;
+	cp->faf_uid = -1;
+	cp->is_server = false;
+	cp->protocol = IPPROTO_TCP;
+	cp->buf_len = 0;
+	timer_start(cp, HANDSHAKE_TIMEOUT_MS);
+
+	if (ring) {
+		update_events(epoll, cp);
+		return;
+	}
+	epoll_event ev;
+	ev.events = cp->ev_mask;
+	ev.data.ptr = (void *) cp;
+	if (epoll_ctl(epoll, EPOLL_CTL_ADD, nsock, &ev) < 0) {
+		VPERROR("epoll_ctl");
+		--total_sockets;
+		close(nsock);
+		deallocate_fdctx(cp);
+	}
+}
+
+// the socket can take more of the out queue, false if it got closed
+bool worker::client_writable(fd_ctx * ctxp) {
+	if (unlikely(ctxp->stream_in != NULL)) {
+		stream_pump(ctxp->stream_in);
+		if (ctxp->stream_in) {
+			// what queued up meanwhile waits for the end of the frame
+			return true;
+		}
+	}
+	if (ctxp->out.flush(ctxp->fd) < 0) {
+		if (errno != ECONNRESET && errno != EPIPE) {
+			VPERROR("writev");
+		}
+		close_client(ctxp);
+		return false;
+	}
+	if (ctxp->waiters && ctxp->out.len <= out_hwm / 2) {
+		wake_waiters(epoll, ctxp);
+	}
+	update_events(epoll, ctxp);
+	return true;
+}
+
+// the header and what we have of a large frame go into a pipe or the
+// gather buffer, the rest of it is moved by stream_pump. false if there
+// is no pipe to be had.
+bool worker::start_stream(fd_ctx * ctxp, const proxy_msg_header * h, int in_msg_size) {
+	frame_stream * s = new frame_stream;
+	s->peer     = NULL;
+	s->uid      = ntohs(h->destuid);
+	s->size     = in_msg_size + 4;
+	s->left     = s->size - ctxp->buf_len;
+	s->piped    = 0;
+	s->sent     = 0;
+	s->stalled  = false;
+	s->pipe[0]  = s->pipe[1] = -1;
+	s->gather   = NULL;
+	s->gathered = 0;
+
+	fd_ctx * target = NULL;
+	bool relay  = false;
+	bool gather = false;
+	++metrics.frames_in;
+	metrics.bytes_in += s->size;
+	// multicast frames have to fit into the receive buffer, larger ones are
+	// skipped, like frames over the sender's -r budget
+	if (s->uid != CTRL_UID && s->uid != MULTICAST_UID && ! over_rate(ctxp, s->size)) {
+		if (unlikely(capture != NULL) && ctxp->link_node < 0) {
+			capture_frame(ctxp, h, in_msg_size);
+		}
+		target = peer_sockets.find(s->uid);
+		if (target) {
+			++metrics.peer_hits;
 		} else {
-			char buf[16];
-			ssize_t n = send(s, "unlisten", sizeof("unlisten") - 1, 0);
-			if (n < 0) {
-				VPERROR("sendmsg");
+			++metrics.peer_misses;
+			const int owner = nworkers > 1 ? __atomic_load_n(&uid_owner[s->uid], __ATOMIC_ACQUIRE) : -1;
+			if (owner >= 0 && owner != id) {
+				gather = true;
+			} else if ((cluster || decay_mode) && ctxp->link_node < 0 && owner < 0) {
+				target = link_for(s->uid);
+				relay  = true;
+			} else {
+				++metrics.unknown_uid;
+			}
+		}
+	}
+	if (target && target->pend_idx >= 0) {
+		// frames ahead of this one for the same peer
+		flush_pending();
+	}
+	if (target && (target->dropped || target->fd == -1)) {
+		target = NULL;
+	}
+	if (target && (! target->out.empty() || target->stream_in)) {
+		// splicing now would put the frame ahead of what is queued
+		gather = true;
+	}
+
+	if (gather) {
+		s->gather = (char *) malloc(s->size);
+		if (! s->gather) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		ring_copy_out(ctxp, ctxp->buf_start, s->gather, ctxp->buf_len);
+		s->gathered = ctxp->buf_len;
+	} else {
+		if (! spare_pipes.empty()) {
+			s->pipe[1] = spare_pipes.back();
+			spare_pipes.pop_back();
+			s->pipe[0] = spare_pipes.back();
+			spare_pipes.pop_back();
+		} else if (pipe2(s->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+			VPERROR("pipe2");
+			delete s;
+			return false;
+		}
+		if (target) {
+			s->peer = target;
+			target->stream_in = ctxp;
+			++target->refcount;
+			// the pipe is empty and much larger than the ring, this never blocks
+			iovec iov[2];
+			int pos = ctxp->buf_start;
+			int len = ctxp->buf_len;
+			if (! relay) {
+				rewrite_to_peer(ctxp, h, in_msg_size, iov);
+				pos += OUT_HEADER_OFFSET_ADJ;
+				if (pos >= FDCTX_CLIENT_BUFSIZE) {
+					pos -= FDCTX_CLIENT_BUFSIZE;
+				}
+				len -= OUT_HEADER_OFFSET_ADJ;
+			}
+			const int iovcnt = ring_iov(ctxp, pos, len, iov);
+			if (writev(s->pipe[1], iov, iovcnt) != len) {
+				VPERROR("writev(pipe)");
 				exit(1);
+			}
+			s->piped = len;
+			if (relay) {
+				++relayed;
+			}
+		}
+	}
+	ring_consume(ctxp, ctxp->buf_len);
+	ctxp->stream = s;
+	return true;
+}
+
+void worker::stream_pump(fd_ctx * ctxp) {
+	frame_stream * s = ctxp->stream;
+	if (s->gather) {
+		while (s->left) {
+			int n = read(ctxp->fd, s->gather + s->gathered, s->left);
+			if (n < 0) {
+				if (errno == EAGAIN || errno == EINTR) {
+					return;
+				}
+				if (errno != ECONNRESET) {
+					VPERROR("read");
+				}
+				close_client(ctxp);
+				return;
 			} else if (n == 0) {
-				fprintf(stderr, "unexpected EOF\n");
-				exit(1);
+				close_client(ctxp);
+				return;
+			}
+			s->gathered += n;
+			s->left -= n;
+		}
+		gather_done(ctxp);
+		return;
+	}
+	const bool was_stalled = s->stalled;
+	s->stalled = false;
+	for (;;) {
+		while (s->piped) {
+			fd_ctx * peer = s->peer;
+			int n = splice(s->pipe[0], NULL, peer ? peer->fd : devnull, NULL, s->piped,
+						   SPLICE_F_NONBLOCK | SPLICE_F_MOVE | (s->left ? SPLICE_F_MORE : 0));
+			if (n < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				if (errno == EAGAIN && peer) {
+					s->stalled = true;
+					update_events(epoll, peer);
+					update_events(epoll, ctxp);
+					return;
+				}
+				if (errno != EPIPE && errno != ECONNRESET) {
+					VPERROR("splice");
+				}
+				// the peer is gone, its own event closes it. the rest
+				// of the frame goes nowhere.
+				if (! peer) {
+					close_client(ctxp);
+					return;
+				}
+				stream_detach(s);
+				continue;
+			}
+			s->piped -= n;
+			if (peer) {
+				s->sent += n;
+			}
+		}
+		if (was_stalled) {
+			update_events(epoll, ctxp);
+		}
+		if (! s->left) {
+			stream_end(ctxp);
+			return;
+		}
+		int n = splice(ctxp->fd, NULL, s->pipe[1], NULL, std::min(s->left, SPLICE_CHUNK),
+					   SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				return;
+			}
+			if (errno != ECONNRESET) {
+				VPERROR("splice");
+			}
+			close_client(ctxp);
+			return;
+		} else if (n == 0) {
+			close_client(ctxp);
+			return;
+		}
+		s->left -= n;
+		s->piped += n;
+	}
+}
+
+// the peer takes what queued up in out meanwhile
+void worker::stream_detach(frame_stream * s) {
+	fd_ctx * peer = s->peer;
+	fd_ctx * sender = peer->stream_in;
+	s->peer = NULL;
+	peer->stream_in = NULL;
+	if (peer->fd != -1) {
+		update_events(epoll, peer);
+	}
+	if (s->stalled) {
+		// what is in the pipe goes to devnull now, without waiting
+		s->stalled = false;
+		if (sender->fd != -1) {
+			update_events(epoll, sender);
+			make_ready(sender);
+		}
+	}
+	if (--peer->refcount == 0) {
+		deallocate_fdctx(peer);
+	}
+}
+
+// done with the frame, or the sender went away in the middle of it
+void worker::stream_end(fd_ctx * ctxp) {
+	frame_stream * s = ctxp->stream;
+	const bool cut = s->left || s->piped;
+	if (s->peer) {
+		if (cut && s->sent) {
+			fprintf(stderr, "frame to %d cut short\n", s->peer->faf_uid);
+			drop_peer(s->peer);
+		} else if (! cut) {
+			++spliced_frames;
+			spliced_bytes += s->sent;
+			++metrics.frames_out;
+			metrics.bytes_out += s->sent;
+		}
+		stream_detach(s);
+	}
+	if (s->pipe[0] != -1) {
+		if (cut || spare_pipes.size() >= 2 * SPARE_PIPES) {
+			close(s->pipe[0]);
+			close(s->pipe[1]);
+		} else {
+			spare_pipes.push_back(s->pipe[0]);
+			spare_pipes.push_back(s->pipe[1]);
+		}
+	}
+	free(s->gather);
+	delete s;
+	ctxp->stream = NULL;
+	if (ctxp->fd != -1) {
+		update_events(epoll, ctxp);
+		// the next frames may be in the socket already
+		if (epoll_et) {
+			make_ready(ctxp);
+		}
+	}
+}
+
+// the whole frame is in s->gather, route it like process_frames would
+void worker::gather_done(fd_ctx * ctxp) {
+	frame_stream * s = ctxp->stream;
+	const proxy_msg_header * h = (const proxy_msg_header *) s->gather;
+	const int in_msg_size = s->size - 4;
+	proxy_msg_header_to_peer hout;
+	hout.size = htonl(in_msg_size - OUT_HEADER_OFFSET_ADJ);
+	hout.port = h->port;
+	iovec iov[2];
+	iov[0].iov_base = &hout;
+	iov[0].iov_len  = sizeof(hout);
+	iov[1].iov_base = s->gather + sizeof(*h);
+	iov[1].iov_len  = s->size - sizeof(*h);
+	const uint16_t port = h->port;
+
+	fd_ctx * peer = peer_sockets.find(s->uid);
+	bool sent = false;
+	if (peer) {
+		send_to_peer(epoll, peer, iov, 2);
+		sent = true;
+		if (unlikely(drop_slow_peers && peer->out.len > out_hwm)) {
+			drop_peer(peer);
+		}
+	} else {
+		const int owner = nworkers > 1 ? __atomic_load_n(&uid_owner[s->uid], __ATOMIC_ACQUIRE) : -1;
+		if (owner >= 0 && owner != id) {
+			// the buffer goes along, rewritten in place
+			proxy_msg_header_to_peer * o = (proxy_msg_header_to_peer *) (s->gather + OUT_HEADER_OFFSET_ADJ);
+			o->size = hout.size;
+			o->port = port;
+			iovec r;
+			r.iov_base = &s->gather;
+			r.iov_len  = sizeof(s->gather);
+			if (unlikely(! workers[owner].inbound[id].push(s->uid, &r, 1, XQ_HEAP))) {
+				++xthread_drops;
+			} else {
+				s->gather = NULL;
+				sent = true;
+				if (! wake_pending[owner]) {
+					wake_pending[owner] = true;
+					wake_list.push_back(owner);
+				}
+			}
+		} else if ((cluster || decay_mode) && ctxp->link_node < 0 && owner < 0) {
+			fd_ctx * link = link_for(s->uid);
+			if (link) {
+				send_to_peer(epoll, link, s->gather, s->size);
+				++relayed;
+				sent = true;
+			}
+		}
+	}
+	if (sent) {
+		++metrics.frames_out;
+		metrics.bytes_out += s->size;
+	}
+	++gathered_frames;
+	stream_end(ctxp);
+}
+
+void worker::capture_frame(fd_ctx * ctxp, const proxy_msg_header * h, int in_msg_size) {
+	const int size = in_msg_size + 4 - sizeof(proxy_msg_header);
+	const int pos = (ctxp->buf_start + sizeof(proxy_msg_header)) % FDCTX_CLIENT_BUFSIZE;
+	// a frame being streamed is only partly in the ring
+	const int buffered = std::min(size, ctxp->buf_len - (int) sizeof(proxy_msg_header));
+	const uint16_t dest = ntohs(h->destuid);
+	int caplen = 0;
+	if (capture->payloads) {
+		caplen = buffered;
+	} else if (dest == MULTICAST_UID && buffered > 0) {
+		caplen = std::min(buffered, 1 + 2 * (uint8_t) ctxp->buf[pos]);
+	}
+	const uint32_t reclen = (sizeof(capture_record) + caplen + 7) & ~7;
+
+	if (unlikely(capture_pos + reclen > capture_end)) {
+		// the rest of this block stays zero, readers skip it
+		const uint64_t blocks = (reclen + CAPTURE_BLOCK - 1) / CAPTURE_BLOCK;
+		// a full log is only read from then on
+		uint64_t off = __atomic_load_n(&capture->tail, __ATOMIC_RELAXED);
+		if (off + blocks * CAPTURE_BLOCK <= capture->size) {
+			off = __atomic_fetch_add(&capture->tail, blocks * CAPTURE_BLOCK, __ATOMIC_RELAXED);
+		}
+		if (off + blocks * CAPTURE_BLOCK > capture->size) {
+			capture_pos = capture_end = NULL;
+			++metrics.capture_drops;
+			return;
+		}
+		capture_pos = capture->base + off;
+		capture_end = capture_pos + blocks * CAPTURE_BLOCK;
+		// one page fault for the block instead of one per page; older
+		// kernels fault them in one by one as before
+		madvise(capture_pos, capture_end - capture_pos, MADV_POPULATE_WRITE);
+	}
+
+	capture_record * r = (capture_record *) capture_pos;
+	r->size      = size;
+	r->ts_ns     = mono_ns() - capture->start_mono_ns;
+	r->srcuid    = ctxp->faf_uid;
+	r->destuid   = dest;
+	r->port      = ntohs(h->port);
+	r->reserved  = 0;
+	r->caplen    = caplen;
+	r->reserved2 = 0;
+	ring_copy_out(ctxp, pos, (char *) (r + 1), caplen);
+	__atomic_store_n(&r->reclen, reclen, __ATOMIC_RELEASE);
+	capture_pos += reclen;
+	++metrics.captured;
+}
+
+void worker::process_frames(fd_ctx * ctxp) {
+	bool closed = false;
+	// -q: the turn ended before the frames did
+	bool yielded = false;
+
+	while (ctxp->buf_len >= 4) {
+		// the header is copied out only when it wraps around
+		char hbuf[sizeof(proxy_msg_header)];
+		proxy_msg_header * h = (proxy_msg_header *) (ctxp->buf + ctxp->buf_start);
+		if (unlikely(ctxp->buf_start + (int) sizeof(proxy_msg_header) > FDCTX_CLIENT_BUFSIZE)) {
+			ring_copy_out(ctxp, ctxp->buf_start, hbuf, sizeof(hbuf));
+			h = (proxy_msg_header *) hbuf;
+		}
+		const int in_msg_size = ntohl(h->size);
+		// no splicing with io_uring, and not before SET_UID
+		const bool can_stream = ! ring && (ctxp->faf_uid != -1 || ctxp->link_node >= 0);
+
+		if (unlikely(in_msg_size < 0 || in_msg_size > MAX_FRAME_SIZE ||
+					 (in_msg_size + 4 > FDCTX_CLIENT_BUFSIZE && ! can_stream))) {
+			// message to big
+			++metrics.oversize;
+			if (! ring && epoll_ctl(epoll, EPOLL_CTL_DEL, ctxp->fd, NULL) < 0) {
+				VPERROR("epoll_ctl");
+			}
+			close_client(ctxp);
+			closed = true;
+			break;
+		}
+
+		if (in_msg_size + 4 > ctxp->buf_len) {
+			if (in_msg_size + 4 >= SPLICE_MIN_FRAME && can_stream && ctxp->buf_len >= (int) sizeof(proxy_msg_header) &&
+				unlikely(! start_stream(ctxp, h, in_msg_size))) {
+				close_client(ctxp);
+				closed = true;
+			}
+			break;
+		}
+
+		if (unlikely(drr_quantum) && ! ring && ctxp->link_node < 0 && ! ctxp->paused) {
+			if (ctxp->deficit < in_msg_size + 4) {
+				++metrics.quantum_yields;
+				yielded = true;
+				make_ready(ctxp);
+				break;
+			}
+			ctxp->deficit -= in_msg_size + 4;
+		}
+
+		if (unlikely(ctxp->faf_uid == -1 && ctxp->link_node < 0)) {
+			proxy_msg_header_set_uid * hu = (proxy_msg_header_set_uid *) h;
+			const int uid = ntohs(hu->uid);
+			ring_consume(ctxp, in_msg_size + 4);
+			if ((cluster || ctrl_socket_path) && uid == CTRL_UID) {
+				// another node relaying to us, or the proxy we took over
+				// from, not a client
+				ctxp->link_node = 0;
+				--total_sockets;
+				timer_cancel(ctxp);
+				continue;
+			}
+			if (unlikely(uid == MULTICAST_UID)) {
+				close_client(ctxp);
+				closed = true;
+				break;
+			}
+			ctxp->faf_uid = uid;
+			register_peer(ctxp);
+			// the handshake timeout becomes the idle one
+			timer_cancel(ctxp);
+			timer_start(ctxp, idle_timeout_ms);
+			continue; // -> next message from this fd_ctx
+		}
+
+		// in decay mode the peers still here are served as before, frames
+		// for the uids handed over go to the new proxy (link_for)
+		if (likely(in_msg_size >= 4)) {
+			int uid = ntohs(h->destuid);
+
+			if (unlikely(over_rate(ctxp, in_msg_size + 4))) {
+				++metrics.frames_in;
+				metrics.bytes_in += in_msg_size + 4;
+				ring_consume(ctxp, in_msg_size + 4);
+				continue;
+			}
+
+			if (unlikely(uid == CTRL_UID)) {
+				control_frame(ctxp, in_msg_size);
+				ring_consume(ctxp, in_msg_size + 4);
+				continue;
+			}
+			// only once the frame is sure to go, one left for a full ring
+			// comes here again
+			const bool captured = unlikely(capture != NULL) && ctxp->link_node < 0;
+			if (unlikely(uid == MULTICAST_UID)) {
+				if (unlikely(! multicast(ctxp, in_msg_size))) {
+					block_on_xthread(ctxp);
+					break;
+				}
+				if (captured) {
+					capture_frame(ctxp, h, in_msg_size);
+				}
+				++metrics.frames_in;
+				metrics.bytes_in += in_msg_size + 4;
+				ring_consume(ctxp, in_msg_size + 4);
+				continue;
+			}
+
+			fd_ctx * peer = peer_sockets.find(uid);
+			iovec oiov[2];
+
+			if (unlikely(! peer)) {
+				++metrics.peer_misses;
+				int owner = nworkers > 1 ? __atomic_load_n(&uid_owner[uid], __ATOMIC_ACQUIRE) : -1;
+				if (owner >= 0 && owner != id) {
+					if (unlikely(! workers[owner].inbound[id].room(in_msg_size - OUT_HEADER_OFFSET_ADJ + 4))) {
+						// leave the frame where it is and try again next loop
+						block_on_xthread(ctxp);
+						break;
+					}
+					if (captured) {
+						capture_frame(ctxp, h, in_msg_size);
+					}
+					int oiovcnt = rewrite_to_peer(ctxp, h, in_msg_size, oiov);
+					forward_remote(owner, uid, oiov, oiovcnt);
+					++metrics.frames_out;
+					metrics.bytes_out += in_msg_size + 4;
+				} else if ((cluster || decay_mode) && ctxp->link_node < 0 && owner < 0) {
+					if (captured) {
+						capture_frame(ctxp, h, in_msg_size);
+					}
+					// what came over a link is never passed on again
+					relay_remote(ctxp, uid, in_msg_size);
+				} else {
+					++metrics.unknown_uid;
+				}
+				++metrics.frames_in;
+				metrics.bytes_in += in_msg_size + 4;
+				ring_consume(ctxp, in_msg_size + 4);
+				continue;
+			}
+			++metrics.peer_hits;
+			++metrics.frames_out;
+			metrics.bytes_out += in_msg_size + 4;
+			if (captured) {
+				capture_frame(ctxp, h, in_msg_size);
+			}
+
+			int oiovcnt = rewrite_to_peer(ctxp, h, in_msg_size, oiov);
+
+			queue_to_peer(ctxp, peer, oiov, oiovcnt);
+			if (unlikely(peer->out.len > out_hwm)) {
+				if (drop_slow_peers) {
+					drop_peer(peer);
+				} else {
+					// the rest of this buffer still goes out, we just
+					// stop reading more from the sender
+					wait_for_drain(epoll, ctxp, peer);
+				}
+			}
+		}
+		++metrics.frames_in;
+		metrics.bytes_in += in_msg_size + 4;
+		ring_consume(ctxp, in_msg_size + 4);
+	}
+	if (! yielded) {
+		// nothing queued up, nothing saved for later (deficit round robin)
+		ctxp->deficit = 0;
+	}
+	// we want to get rid of clients as soon as possible and
+	// dont wait for them to send the next message to trigger it
+	if (unlikely(! closed && decay_mode) && ctxp->link_node < 0 && send_fd(ctrl_socket_conn.fd, ctxp) > 0) {
+		if (ctxp->faf_uid != -1) {
+			unregister_peer(ctxp);
+		}
+	}
+}
+
+// a frame to CTRL_UID from an identified client
+void worker::control_frame(fd_ctx * ctxp, int in_msg_size) {
+	char msg[sizeof(proxy_msg_header) + 1 + 2 * 255];
+	const int len = std::min(in_msg_size + 4, (int) sizeof(msg));
+	ring_copy_out(ctxp, ctxp->buf_start, msg, len);
+	const proxy_msg_header * h = (const proxy_msg_header *) msg;
+	if (ntohs(h->port) == CTRL_PLACE) {
+		place_game(ctxp, (const uint8_t *) msg + sizeof(*h), len - sizeof(*h));
+		return;
+	}
+	if (ntohs(h->port) == CTRL_KEEPALIVE) {
+		proxy_msg_header_to_peer reply;
+		reply.size = htonl(sizeof(reply.port));
+		reply.port = htons(CTRL_KEEPALIVE);
+		send_to_peer(epoll, ctxp, (const char *) &reply, sizeof(reply));
+		return;
+	}
+	if (ntohs(h->port) != CTRL_UDP_REGISTER || len < (int) (sizeof(*h) + sizeof(uint32_t))) {
+		return;
+	}
+	uint32_t token;
+	memcpy(&token, msg + sizeof(*h), sizeof(token));
+	if (udp_peers) {
+		udp_set_token(ctxp->faf_uid, token);
+	}
+
+	struct {
+		proxy_msg_header_to_peer h;
+		uint16_t udp_port;
+	} __attribute__ ((packed)) reply;
+	reply.h.size   = htonl(sizeof(reply) - 4);
+	reply.h.port   = htons(CTRL_UDP_REGISTER);
+	reply.udp_port = htons(udp_peers ? udp_port : 0);
+	send_to_peer(epoll, ctxp, (const char *) &reply, sizeof(reply));
+}
+
+char * worker::scratch_alloc(int n) {
+	if (unlikely(scratch_len + n > SCRATCH_SIZE)) {
+		flush_pending();
+	}
+	char * p = scratch + scratch_len;
+	scratch_len += n;
+	return p;
+}
+
+// the uids are sorted out first: connected here, on another worker or on
+// another node. a full ring to one of the workers leaves the whole frame
+// for the next loop, like a frame for a single uid. then the payload goes
+// to the local peers straight out of the sender's ring behind a header
+// from scratch, every other worker gets one record with its uids and
+// every other node one multicast frame with the uids it has.
+bool worker::multicast(fd_ctx * ctxp, int in_msg_size) {
+	char msg[sizeof(proxy_msg_header) + 1 + 2 * 255];
+	if (in_msg_size + 4 < (int) sizeof(proxy_msg_header) + 1) {
+		return true;
+	}
+	ring_copy_out(ctxp, ctxp->buf_start, msg, sizeof(proxy_msg_header) + 1);
+	const int count = (uint8_t) msg[sizeof(proxy_msg_header)];
+	const int head = sizeof(proxy_msg_header) + 1 + 2 * count;
+	if (in_msg_size + 4 < head) {
+		return true;
+	}
+	ring_copy_out(ctxp, ctxp->buf_start, msg, head);
+	const proxy_msg_header * h = (const proxy_msg_header *) msg;
+	const int payload = in_msg_size + 4 - head;
+
+	// per uid: -1 unknown, 0 local, 1 + owner, or MAX_WORKERS + 1 + node,
+	// where node 0 is the proxy we handed over to in decay mode
+	int where[255];
+	bool to_worker[MAX_WORKERS] = { false };
+	bool to_node = false;
+	for (int i = 0; i < count; ++i) {
+		uint16_t uid;
+		memcpy(&uid, msg + sizeof(proxy_msg_header) + 1 + 2 * i, sizeof(uid));
+		uid = ntohs(uid);
+		where[i] = -1;
+		if (uid == CTRL_UID || uid == MULTICAST_UID) {
+			continue;
+		}
+		if (peer_sockets.find(uid)) {
+			where[i] = 0;
+			continue;
+		}
+		const int owner = nworkers > 1 ? __atomic_load_n(&uid_owner[uid], __ATOMIC_ACQUIRE) : -1;
+		if (owner >= 0 && owner != id) {
+			where[i] = 1 + owner;
+			to_worker[owner] = true;
+		} else if (unlikely(decay_mode) && ctxp->link_node < 0 && owner < 0) {
+			where[i] = MAX_WORKERS + 1;
+			to_node = true;
+		} else if (cluster && ctxp->link_node < 0 && owner < 0) {
+			const int node = __atomic_load_n(&uid_node[uid], __ATOMIC_ACQUIRE);
+			if (node && node != __atomic_load_n(&self_node, __ATOMIC_RELAXED)) {
+				where[i] = MAX_WORKERS + 1 + node;
+				to_node = true;
+			}
+		}
+	}
+	const int xq_len = 1 + 2 * count + sizeof(proxy_msg_header_to_peer) + payload;
+	for (int w = 0; w < nworkers; ++w) {
+		if (to_worker[w] && unlikely(! workers[w].inbound[id].room(xq_len))) {
+			return false;
+		}
+	}
+
+	proxy_msg_header_to_peer * hout = (proxy_msg_header_to_peer *) scratch_alloc(sizeof(*hout));
+	hout->size = htonl(payload + sizeof(hout->port));
+	hout->port = h->port;
+	iovec iov[3];
+	iov[0].iov_base = hout;
+	iov[0].iov_len  = sizeof(*hout);
+	const int iovcnt = 1 + ring_iov(ctxp, ctxp->buf_start + head, payload, iov + 1);
+
+	for (int i = 0; i < count; ++i) {
+		if (where[i] == 0) {
+			uint16_t uid;
+			memcpy(&uid, msg + sizeof(proxy_msg_header) + 1 + 2 * i, sizeof(uid));
+			fd_ctx * peer = peer_sockets.find(ntohs(uid));
+			++metrics.peer_hits;
+			++metrics.frames_out;
+			metrics.bytes_out += sizeof(*hout) + payload;
+			queue_to_peer(ctxp, peer, iov, iovcnt);
+			if (unlikely(peer->out.len > out_hwm)) {
+				if (drop_slow_peers) {
+					drop_peer(peer);
+				} else {
+					wait_for_drain(epoll, ctxp, peer);
+				}
+			}
+		} else if (where[i] < 0) {
+			++metrics.unknown_uid;
+		} else {
+			++metrics.peer_misses;
+		}
+	}
+
+	for (int w = 0; w < nworkers; ++w) {
+		if (! to_worker[w]) {
+			continue;
+		}
+		uint8_t list[1 + 2 * 255];
+		int n = 0;
+		for (int i = 0; i < count; ++i) {
+			if (where[i] == 1 + w) {
+				memcpy(list + 1 + 2 * n++, msg + sizeof(proxy_msg_header) + 1 + 2 * i, sizeof(uint16_t));
+			}
+		}
+		list[0] = n;
+		iovec xiov[4];
+		xiov[0].iov_base = list;
+		xiov[0].iov_len  = 1 + 2 * n;
+		memcpy(xiov + 1, iov, iovcnt * sizeof(iovec));
+		workers[w].inbound[id].push(MULTICAST_UID, xiov, 1 + iovcnt, XQ_MULTI);
+		if (! wake_pending[w]) {
+			wake_pending[w] = true;
+			wake_list.push_back(w);
+		}
+		metrics.frames_out += n;
+		metrics.bytes_out += n * (sizeof(*hout) + payload);
+	}
+
+	for (int node = decay_mode ? 0 : 1; to_node && node < MAX_NODES; ++node) {
+		int n = 0;
+		for (int i = 0; i < count; ++i) {
+			n += where[i] == MAX_WORKERS + 1 + node;
+		}
+		if (! n) {
+			continue;
+		}
+		fd_ctx * link = node ? node_link(node) : handoff_target();
+		if (! link) {
+			continue;
+		}
+		// the frame as it came in, with the uids of that node only
+		char * p = scratch_alloc(sizeof(proxy_msg_header) + 1 + 2 * n);
+		proxy_msg_header * rh = (proxy_msg_header *) p;
+		rh->size    = htonl(sizeof(proxy_msg_header) - 4 + 1 + 2 * n + payload);
+		rh->port    = h->port;
+		rh->destuid = htons(MULTICAST_UID);
+		p[sizeof(*rh)] = n;
+		for (int i = 0, k = 0; i < count; ++i) {
+			if (where[i] == MAX_WORKERS + 1 + node) {
+				memcpy(p + sizeof(*rh) + 1 + 2 * k++, msg + sizeof(proxy_msg_header) + 1 + 2 * i, sizeof(uint16_t));
 			}
+		}
+		iovec riov[3];
+		riov[0].iov_base = p;
+		riov[0].iov_len  = sizeof(*rh) + 1 + 2 * n;
+		const int riovcnt = 1 + ring_iov(ctxp, ctxp->buf_start + head, payload, riov + 1);
+		queue_to_peer(ctxp, link, riov, riovcnt);
+		++relayed;
+		++metrics.frames_out;
+		metrics.bytes_out += riov[0].iov_len + payload;
+		if (unlikely(link->out.len > out_hwm)) {
+			wait_for_drain(epoll, ctxp, link);
+		}
+	}
+	return true;
+}
 
-			// blocking read
-			n = recv(s, buf, sizeof(buf), 0);
-			if (strncmp(buf, "unlistening", strlen("unlistening")) != 0) {
-				fprintf(stderr, "running server reported: ");
-				fwrite(buf, n, 1, stderr);
-				exit(1);
+// the node most of the game's uids are on, on a tie or for a new game the
+// one with the fewest uids in the peer book. the book is all we know about
+// the load of the other nodes, it counts every identified client.
+void worker::place_game(fd_ctx * ctxp, const uint8_t * p, int len) {
+	const int self = __atomic_load_n(&self_node, __ATOMIC_RELAXED);
+	int best = self;
+	if (cluster && len >= 1) {
+		const int count = std::min((int) p[0], (len - 1) / 2);
+		int peers[MAX_NODES] = { 0 };
+		for (int i = 0; i < count; ++i) {
+			uint16_t uid;
+			memcpy(&uid, p + 1 + 2 * i, sizeof(uid));
+			++peers[__atomic_load_n(&uid_node[ntohs(uid)], __ATOMIC_ACQUIRE)];
+		}
+		int load[MAX_NODES] = { 0 };
+		for (int uid = 0; uid < 65536; ++uid) {
+			++load[__atomic_load_n(&uid_node[uid], __ATOMIC_RELAXED)];
+		}
+		for (int node = 1; node < MAX_NODES; ++node) {
+			if (node == self || ! nodes[node].port) {
+				continue;
+			}
+			if (peers[node] > peers[best] || (peers[node] == peers[best] && load[node] < load[best])) {
+				best = node;
 			}
-			ctrl_socket_conn.fd = s;
-			poll_in(epoll, &ctrl_socket_conn);
 		}
 	}
 
-	{
-		struct addrinfo hints, * ai_res;
-		hints.ai_family   = AF_UNSPEC;
-		hints.ai_socktype = SOCK_STREAM;
-		hints.ai_protocol = IPPROTO_TCP;
-		hints.ai_flags    = AI_PASSIVE;
+	struct {
+		proxy_msg_header_to_peer h;
+		uint8_t addr[16];
+		uint16_t port;
+	} __attribute__ ((packed)) reply;
+	memset(&reply, 0, sizeof(reply));
+	reply.h.size = htonl(sizeof(reply) - 4);
+	reply.h.port = htons(CTRL_PLACE);
+	if (best != self) {
+		memcpy(reply.addr, nodes[best].addr, sizeof(reply.addr));
+		reply.port = htons(nodes[best].port);
+	}
+	send_to_peer(epoll, ctxp, (const char *) &reply, sizeof(reply));
+}
 
-		int r = getaddrinfo(NULL, listen_port_str, &hints, &ai_res);
-		if (r) {
-			fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(r));
-			exit(1);
+// one recvmmsg per event, like one read per connection
+void worker::udp_event() {
+	udp_batch & b = *udp;
+	for (int i = 0; i < UDP_BATCH; ++i) {
+		b.in[i].msg_hdr.msg_namelen = sizeof(b.from[i]);
+	}
+	int n = recvmmsg(udp_socket->fd, b.in, UDP_BATCH, MSG_DONTWAIT, NULL);
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EINTR) {
+			VPERROR("recvmmsg");
+		}
+		return;
+	}
+	udp_in += n;
+
+	int nout = 0;
+	for (int i = 0; i < n; ++i) {
+		char * p = b.buf[i];
+		const int len = b.in[i].msg_len;
+		if (unlikely(len < (int) sizeof(udp_msg_header) || (b.in[i].msg_hdr.msg_flags & MSG_TRUNC))) {
+			++udp_rejected;
+			continue;
+		}
+		udp_msg_header * h = (udp_msg_header *) p;
+		const uint16_t srcuid = ntohs(h->srcuid);
+		if (unlikely(! h->token || __atomic_load_n(&udp_peers[srcuid].token, __ATOMIC_RELAXED) != h->token)) {
+			++udp_rejected;
+			continue;
+		}
+
+		// learned from the first datagram and again whenever a NAT moves it
+		sockaddr_in6 & to = b.to[nout];
+		socklen_t tolen;
+		const socklen_t fromlen = b.in[i].msg_hdr.msg_namelen;
+		if (unlikely(! udp_lookup(srcuid, &to, &tolen) || tolen != fromlen || memcmp(&to, &b.from[i], fromlen))) {
+			udp_store(srcuid, h->token, &b.from[i], fromlen);
 		}
 
-		for (struct addrinfo * ai = ai_res; ai; ai = ai->ai_next) {
-			int s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-			if (s < 0) {
-				VPERROR("socket"); exit(1);
+		const uint16_t destuid = ntohs(h->destuid);
+		if (destuid == CTRL_UID) {
+			continue;
+		}
+		if (! udp_lookup(destuid, &to, &tolen)) {
+			udp_to_tcp(p, len);
+			continue;
+		}
+		// [port] + payload, right in front of the payload
+		memmove(p + sizeof(*h) - sizeof(uint16_t), &h->port, sizeof(uint16_t));
+		b.out_iov[nout].iov_base = p + sizeof(*h) - sizeof(uint16_t);
+		b.out_iov[nout].iov_len  = len - sizeof(*h) + sizeof(uint16_t);
+		msghdr & m = b.out[nout].msg_hdr;
+		memset(&m, 0, sizeof(m));
+		m.msg_name    = &to;
+		m.msg_namelen = tolen;
+		m.msg_iov     = &b.out_iov[nout];
+		m.msg_iovlen  = 1;
+		++nout;
+	}
+
+	for (int sent = 0; sent < nout; ) {
+		int r = sendmmsg(udp_socket->fd, b.out + sent, nout - sent, MSG_DONTWAIT);
+		if (r < 0) {
+			// a full socket buffer drops the rest, as any router would
+			if (errno != EAGAIN && errno != EINTR) {
+				VPERROR("sendmmsg");
 			}
-			if (ai->ai_family == AF_INET6) {
-				int on = 1;
-				if (setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, 
-							   (char *)&on, sizeof(on)) == -1) {
-					VPERROR("setsockopt(IPV6_ONLY)");
-					exit(1);
+			break;
+		}
+		sent += r;
+		udp_out += r;
+	}
+	// the frames that went to tcp instead still point into buf
+	if (npending) {
+		flush_pending();
+	}
+}
+
+// the peer has no udp address, it gets the datagram as a tcp frame
+void worker::udp_to_tcp(char * p, int len) {
+	const udp_msg_header * h = (const udp_msg_header *) p;
+	const uint16_t destuid = ntohs(h->destuid);
+	proxy_msg_header_to_peer hout;
+	hout.port = h->port;
+	hout.size = htonl(len - sizeof(*h) + sizeof(hout.port));
+	char * frame = p + sizeof(*h) - sizeof(hout);
+	memcpy(frame, &hout, sizeof(hout));
+
+	iovec iov;
+	iov.iov_base = frame;
+	iov.iov_len  = len - sizeof(*h) + sizeof(hout);
+
+	fd_ctx * peer = peer_sockets.find(destuid);
+	if (peer) {
+		queue_to_peer(NULL, peer, &iov, 1);
+		if (unlikely(drop_slow_peers && peer->out.len > out_hwm)) {
+			drop_peer(peer);
+		}
+		++udp_via_tcp;
+		return;
+	}
+	int owner = nworkers > 1 ? __atomic_load_n(&uid_owner[destuid], __ATOMIC_ACQUIRE) : -1;
+	if (owner >= 0 && owner != id) {
+		// nobody to pause, a full ring loses the datagram
+		forward_remote(owner, destuid, &iov, 1);
+		++udp_via_tcp;
+	}
+}
+
+// a link is connected like any client, it just starts with SET_UID
+// CTRL_UID instead of a uid. frames queue up until the connect is through.
+fd_ctx * worker::open_link(int node) {
+	const double now = now_ms();
+	if (now < link_retry[node] || ! nodes[node].port) {
+		return NULL;
+	}
+	link_retry[node] = now + LINK_RETRY_MS;
+	link_gen[node] = __atomic_load_n(&nodes[node].gen, __ATOMIC_ACQUIRE);
+
+	sockaddr_storage ss;
+	socklen_t sl = from_addr16(nodes[node].addr, nodes[node].port, &ss);
+	fd_ctx * c = connect_link((sockaddr *) &ss, sl, node);
+	if (c) {
+		links[node] = c;
+	}
+	return c;
+}
+
+// in decay mode the uids we do not have any more are on the proxy we
+// handed them to, it listens on our port and takes a link like a node
+fd_ctx * worker::handoff_target() {
+	if (handoff_link) {
+		return handoff_link;
+	}
+	const double now = now_ms();
+	if (now < handoff_retry) {
+		return NULL;
+	}
+	handoff_retry = now + LINK_RETRY_MS;
+	sockaddr_in sin;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family      = AF_INET;
+	sin.sin_port        = htons(client_port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	// not a node, and not one of our connections either
+	handoff_link = connect_link((sockaddr *) &sin, sizeof(sin), 0);
+	return handoff_link;
+}
+
+fd_ctx * worker::connect_link(const sockaddr * sa, socklen_t sl, int node) {
+	int s = socket(sa->sa_family, SOCK_STREAM, 0);
+	if (s < 0) {
+		VPERROR("socket");
+		return NULL;
+	}
+	int on = 1;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char *) &on, sizeof(on));
+	set_nonblocking(s);
+	if (connect(s, sa, sl) < 0 && errno != EINPROGRESS) {
+		VPERROR("connect(link)");
+		close(s);
+		return NULL;
+	}
+	fd_ctx * c = allocate_fdctx(FDCTX_CLIENT_BUFSIZE);
+	c->fd = s;
+	c->faf_uid = -1;
+	c->is_server = false;
+	c->protocol = IPPROTO_TCP;
+	c->link_node = node;
+	epoll_event ev;
+	ev.events = c->ev_mask;
+	ev.data.ptr = (void *) c;
+	if (epoll_ctl(epoll, EPOLL_CTL_ADD, s, &ev) < 0) {
+		VPERROR("epoll_ctl");
+		close(s);
+		deallocate_fdctx(c);
+		return NULL;
+	}
+	proxy_msg_header_set_uid hello;
+	hello.size = htonl(sizeof(hello.uid));
+	hello.uid  = htons(CTRL_UID);
+	c->out.append((const char *) &hello, sizeof(hello));
+	update_events(epoll, c);
+	return c;
+}
+
+// the link to the node the peer book has uid on, NULL if none
+fd_ctx * worker::link_for(uint16_t uid) {
+	if (unlikely(decay_mode)) {
+		fd_ctx * link = handoff_target();
+		if (! link) {
+			++relay_drops;
+		}
+		return link;
+	}
+	const int node = __atomic_load_n(&uid_node[uid], __ATOMIC_ACQUIRE);
+	if (! node || node == __atomic_load_n(&self_node, __ATOMIC_RELAXED)) {
+		++metrics.unknown_uid;
+		return NULL;
+	}
+	return node_link(node);
+}
+
+fd_ctx * worker::node_link(int node) {
+	fd_ctx * link = links[node];
+	if (link && unlikely(link_gen[node] != __atomic_load_n(&nodes[node].gen, __ATOMIC_ACQUIRE))) {
+		close_client(link);
+		link = NULL;
+	}
+	if (! link && ! (link = open_link(node))) {
+		++relay_drops;
+	}
+	return link;
+}
+
+// uid is on another node, the frame goes there as it came in
+void worker::relay_remote(fd_ctx * ctxp, uint16_t uid, int in_msg_size) {
+	fd_ctx * link = link_for(uid);
+	if (! link) {
+		return;
+	}
+	iovec iov[2];
+	int iovcnt = ring_iov(ctxp, ctxp->buf_start, in_msg_size + 4, iov);
+	queue_to_peer(ctxp, link, iov, iovcnt);
+	++relayed;
+	++metrics.frames_out;
+	metrics.bytes_out += in_msg_size + 4;
+	if (unlikely(link->out.len > out_hwm)) {
+		wait_for_drain(epoll, ctxp, link);
+	}
+}
+
+// the peer book is kept by worker 0, the others tell it through their ring
+void worker::book_local(uint16_t uid, bool added) {
+	if (id == 0) {
+		book_note(uid, added);
+		return;
+	}
+	if (unlikely(! workers[0].inbound[id].push(uid, NULL, 0, added ? XQ_BOOK_ADD : XQ_BOOK_DEL))) {
+		fprintf(stderr, "[%d] cross-worker ring full, peer book update for %d lost\n", id, uid);
+		return;
+	}
+	if (! wake_pending[0]) {
+		wake_pending[0] = true;
+		wake_list.push_back(0);
+	}
+}
+
+void worker::book_note(uint16_t uid, bool added) {
+	// the rings of two workers are drained in any order, a uid that moved
+	// between them must not be reported gone after it came back
+	if (! added && __atomic_load_n(&uid_owner[uid], __ATOMIC_ACQUIRE) >= 0) {
+		return;
+	}
+	book_record r;
+	r.uid = uid;
+	if (book_port) {
+		if (added) {
+			__atomic_store_n(&uid_node[uid], (uint8_t) MASTER_NODE, __ATOMIC_RELEASE);
+		} else if (uid_node[uid] == MASTER_NODE) {
+			__atomic_store_n(&uid_node[uid], (uint8_t) 0, __ATOMIC_RELEASE);
+		} else {
+			return;
+		}
+		r.node = added ? MASTER_NODE : 0;
+	} else {
+		// the master puts in our node id
+		r.node = added ? 1 : 0;
+	}
+	book_out.push_back(r);
+}
+
+void worker::book_send(fd_ctx * c, uint16_t op, const void * body, int len) {
+	book_header h;
+	h.size = htonl(sizeof(h.op) + len);
+	h.op   = htons(op);
+	iovec iov[2];
+	iov[0].iov_base = &h;
+	iov[0].iov_len  = sizeof(h);
+	iov[1].iov_base = (void *) body;
+	iov[1].iov_len  = len;
+	send_to_peer(epoll, c, iov, len ? 2 : 1);
+}
+
+void worker::book_send_records(fd_ctx * c, const book_record * recs, int n) {
+	book_record out[BOOK_MAX_RECORDS];
+	for (int i = 0; i < n; i += BOOK_MAX_RECORDS) {
+		const int m = std::min(n - i, BOOK_MAX_RECORDS);
+		for (int j = 0; j < m; ++j) {
+			out[j].uid  = htons(recs[i + j].uid);
+			out[j].node = htons(recs[i + j].node);
+		}
+		book_send(c, BOOK_UPDATE, out, m * sizeof(book_record));
+	}
+}
+
+// as a node: hello and every uid we have, queued until the connect is through
+void worker::book_connect() {
+	book_retry = now_ms() + LINK_RETRY_MS;
+	int s = socket(book_master_addr.ss_family, SOCK_STREAM, 0);
+	if (s < 0) {
+		VPERROR("socket");
+		return;
+	}
+	set_nonblocking(s);
+	if (connect(s, (sockaddr *) &book_master_addr, book_master_addrlen) < 0 && errno != EINPROGRESS) {
+		VPERROR("connect(master)");
+		close(s);
+		return;
+	}
+	fd_ctx * c = allocate_fdctx(FDCTX_CLIENT_BUFSIZE);
+	c->fd = s;
+	c->faf_uid = -1;
+	c->is_server = false;
+	c->protocol = PROTO_BOOK;
+	c->link_node = MASTER_NODE;
+	if (poll_in(epoll, c) < 0) {
+		close(s);
+		deallocate_fdctx(c);
+		return;
+	}
+	c->ev_mask = EPOLLIN;
+	book_master = c;
+
+	uint16_t port = htons(client_port);
+	book_send(c, BOOK_HELLO, &port, sizeof(port));
+	std::vector<book_record> mine;
+	for (int uid = 0; uid < 65536; ++uid) {
+		if (__atomic_load_n(&uid_owner[uid], __ATOMIC_ACQUIRE) >= 0) {
+			book_record r;
+			r.uid  = uid;
+			r.node = 1;
+			mine.push_back(r);
+		}
+	}
+	if (! mine.empty()) {
+		book_send_records(c, &mine[0], mine.size());
+	}
+	book_out.clear();
+	update_events(epoll, c);
+}
+
+void worker::book_accept(int nsock) {
+	fd_ctx * c = allocate_fdctx(FDCTX_CLIENT_BUFSIZE);
+	c->fd = nsock;
+	c->faf_uid = -1;
+	c->is_server = false;
+	c->protocol = PROTO_BOOK;
+	// a node id once it said hello
+	c->link_node = 0;
+	if (poll_in(epoll, c) < 0) {
+		close(nsock);
+		deallocate_fdctx(c);
+		return;
+	}
+	c->ev_mask = EPOLLIN;
+}
+
+void worker::book_event(fd_ctx * ctxp, uint32_t events) {
+	if (ctxp->is_server) {
+		for (int i = 0; i < ACCEPT_BATCH; ++i) {
+			int nsock = accept4(ctxp->fd, NULL, NULL, SOCK_NONBLOCK);
+			if (nsock < 0) {
+				if (errno != EAGAIN && errno != EINTR) {
+					VPERROR("accept");
 				}
+				break;
 			}
-			{
-				int on = 1;
-				if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (char *) &on, sizeof(on)) == -1) {
-					VPERROR("setsockopt(REUSEADDR)");
-					exit(1);
+			book_accept(nsock);
+		}
+		return;
+	}
+	if (events & EPOLLOUT) {
+		if (ctxp->out.flush(ctxp->fd) < 0) {
+			VPERROR(ctxp == book_master ? "connection to master" : "connection to node");
+			book_close(ctxp);
+			return;
+		}
+		update_events(epoll, ctxp);
+	}
+	if (! (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+		return;
+	}
+	// read until EAGAIN, the descriptor may be edge triggered with -E
+	char msg[FDCTX_CLIENT_BUFSIZE];
+	for (;;) {
+		iovec riov[2];
+		int riovcnt = ring_free_iov(ctxp, riov);
+		int n = readv(ctxp->fd, riov, riovcnt);
+		if (n <= 0) {
+			if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+				return;
+			}
+			book_close(ctxp);
+			return;
+		}
+		ctxp->buf_len += n;
+		while (ctxp->buf_len >= (int) sizeof(book_header)) {
+			book_header h;
+			ring_copy_out(ctxp, ctxp->buf_start, (char *) &h, sizeof(h));
+			const int size = ntohl(h.size);
+			if (size < (int) sizeof(h.op) || size + 4 > FDCTX_CLIENT_BUFSIZE) {
+				fprintf(stderr, "bad peer book frame of %d bytes\n", size);
+				book_close(ctxp);
+				return;
+			}
+			if (size + 4 > ctxp->buf_len) {
+				break;
+			}
+			ring_copy_out(ctxp, ctxp->buf_start, msg, size + 4);
+			ring_consume(ctxp, size + 4);
+			if (! book_message(ctxp, ntohs(h.op), msg + sizeof(h), size - sizeof(h.op))) {
+				return;
+			}
+		}
+	}
+}
+
+bool worker::book_message(fd_ctx * ctxp, int op, const char * p, int len) {
+	switch (op) {
+	case BOOK_HELLO : {
+		if (! book_port || ctxp->link_node || len < 2) {
+			break;
+		}
+		uint16_t port;
+		memcpy(&port, p, sizeof(port));
+		sockaddr_storage ss;
+		socklen_t sl = sizeof(ss);
+		uint8_t addr[16];
+		if (getpeername(ctxp->fd, (sockaddr *) &ss, &sl) < 0) {
+			VPERROR("getpeername");
+			book_close(ctxp);
+			return false;
+		}
+		to_addr16((sockaddr *) &ss, addr);
+		// a node that comes back keeps its id
+		int node = MASTER_NODE + 1;
+		for (; node < next_node; ++node) {
+			if (nodes[node].port == ntohs(port) && memcmp(nodes[node].addr, addr, 16) == 0) {
+				break;
+			}
+		}
+		if (node == next_node) {
+			if (next_node == MAX_NODES) {
+				fprintf(stderr, "more than %d nodes\n", MAX_NODES - 1);
+				book_close(ctxp);
+				return false;
+			}
+			set_node(node, addr, ntohs(port));
+			++next_node;
+		}
+		char name[INET6_ADDRSTRLEN];
+		inet_ntop(AF_INET6, addr, name, sizeof(name));
+		fprintf(stderr, "node %d joined from [%s]:%d\n", node, name, nodes[node].port);
+		ctxp->link_node = node;
+
+		uint16_t welcome[2] = { htons(node), htons(client_port) };
+		book_send(ctxp, BOOK_WELCOME, welcome, sizeof(welcome));
+		book_node_msg nm;
+		nm.node = htons(node);
+		nm.port = htons(nodes[node].port);
+		memcpy(nm.addr, addr, 16);
+		for (int i = 0; i < book_nodes.size(); ++i) {
+			book_send(book_nodes[i], BOOK_NODE, &nm, sizeof(nm));
+		}
+		std::vector<book_record> all;
+		for (int i = MASTER_NODE + 1; i < next_node; ++i) {
+			if (i == node) {
+				continue;
+			}
+			nm.node = htons(i);
+			nm.port = htons(nodes[i].port);
+			memcpy(nm.addr, nodes[i].addr, 16);
+			book_send(ctxp, BOOK_NODE, &nm, sizeof(nm));
+		}
+		for (int uid = 0; uid < 65536; ++uid) {
+			if (uid_node[uid]) {
+				book_record r;
+				r.uid  = uid;
+				r.node = uid_node[uid];
+				all.push_back(r);
+			}
+		}
+		if (! all.empty()) {
+			book_send_records(ctxp, &all[0], all.size());
+		}
+		book_nodes.push_back(ctxp);
+		break;
+	}
+	case BOOK_WELCOME : {
+		if (book_port || len < 4) {
+			break;
+		}
+		uint16_t welcome[2];
+		memcpy(welcome, p, sizeof(welcome));
+		__atomic_store_n(&self_node, (int) ntohs(welcome[0]), __ATOMIC_RELAXED);
+		uint8_t addr[16];
+		to_addr16((sockaddr *) &book_master_addr, addr);
+		set_node(MASTER_NODE, addr, ntohs(welcome[1]));
+		// the whole book follows, forget what changed while we were away
+		for (int uid = 0; uid < 65536; ++uid) {
+			__atomic_store_n(&uid_node[uid], (uint8_t) 0, __ATOMIC_RELAXED);
+		}
+		fprintf(stderr, "joined the cluster as node %d\n", self_node);
+		break;
+	}
+	case BOOK_NODE : {
+		if (book_port || len < (int) sizeof(book_node_msg)) {
+			break;
+		}
+		book_node_msg nm;
+		memcpy(&nm, p, sizeof(nm));
+		const int node = ntohs(nm.node);
+		if (node > MASTER_NODE && node < MAX_NODES) {
+			set_node(node, nm.addr, ntohs(nm.port));
+		}
+		break;
+	}
+	case BOOK_UPDATE : {
+		const book_record * recs = (const book_record *) p;
+		const int n = len / sizeof(book_record);
+		for (int i = 0; i < n; ++i) {
+			book_record r;
+			memcpy(&r, recs + i, sizeof(r));
+			r.uid  = ntohs(r.uid);
+			r.node = ntohs(r.node);
+			if (! book_port) {
+				if (r.node < MAX_NODES) {
+					__atomic_store_n(&uid_node[r.uid], (uint8_t) r.node, __ATOMIC_RELEASE);
 				}
+				continue;
+			}
+			// from a node that did not say hello yet
+			if (! ctxp->link_node) {
+				break;
 			}
-			if (bind(s, ai->ai_addr, ai->ai_addrlen) < 0) {
-				VPERROR("bind"); exit(1);
+			if (r.node) {
+				r.node = ctxp->link_node;
+			} else if (uid_node[r.uid] != ctxp->link_node) {
+				// connected somewhere else by now
+				continue;
+			}
+			__atomic_store_n(&uid_node[r.uid], (uint8_t) r.node, __ATOMIC_RELEASE);
+			book_out.push_back(r);
+		}
+		break;
+	}
+	}
+	return true;
+}
+
+void worker::book_close(fd_ctx * ctxp) {
+	if (ctxp == book_master) {
+		fprintf(stderr, "lost the master, reconnecting\n");
+		book_master = NULL;
+		book_retry = now_ms() + LINK_RETRY_MS;
+	} else {
+		std::vector<fd_ctx *>::iterator it = std::find(book_nodes.begin(), book_nodes.end(), ctxp);
+		if (it != book_nodes.end()) {
+			book_nodes.erase(it);
+		}
+		const int node = ctxp->link_node;
+		if (node > 0) {
+			fprintf(stderr, "node %d left\n", node);
+			for (int uid = 0; uid < 65536; ++uid) {
+				if (uid_node[uid] == node) {
+					__atomic_store_n(&uid_node[uid], (uint8_t) 0, __ATOMIC_RELEASE);
+					book_record r;
+					r.uid  = uid;
+					r.node = 0;
+					book_out.push_back(r);
+				}
 			}
-			if (listen(s, 50) < 0) {
-				VPERROR("listen"); exit(1);
+		}
+	}
+	close_client(ctxp);
+}
+
+// at the end of a batch, every node gets the same records
+void worker::book_flush() {
+	if (book_port) {
+		for (int i = 0; i < book_nodes.size(); ++i) {
+			book_send_records(book_nodes[i], &book_out[0], book_out.size());
+		}
+	} else if (book_master) {
+		book_send_records(book_master, &book_out[0], book_out.size());
+	}
+	book_out.clear();
+}
+
+// one scrape per connection: read the request, answer, close once it is out
+void worker::metrics_event(fd_ctx * ctxp, uint32_t events) {
+	if (ctxp->is_server) {
+		for (int i = 0; i < ACCEPT_BATCH; ++i) {
+			int nsock = accept4(ctxp->fd, NULL, NULL, SOCK_NONBLOCK);
+			if (nsock < 0) {
+				if (errno != EAGAIN && errno != EINTR) {
+					VPERROR("accept");
+				}
+				break;
 			}
-			fd_ctx * c = allocate_fdctx(FDCTX_TCP_SERVER_BUFSIZE);
-			c->fd = s;
-			c->is_server = true;
-			c->protocol  = ai->ai_protocol;
-			char * strp  = c->buf;
-			int slen     = FDCTX_TCP_SERVER_BUFSIZE;
-			if (ai->ai_family == AF_INET6) {
-				*strp++ = '[';
-				slen -= 2;
+			fd_ctx * c = allocate_fdctx(FDCTX_CLIENT_BUFSIZE);
+			c->fd = nsock;
+			c->faf_uid = -1;
+			c->is_server = false;
+			c->protocol = PROTO_METRICS;
+			if (poll_in(epoll, c) < 0) {
+				close(nsock);
+				deallocate_fdctx(c);
+				continue;
 			}
-			get_ip_str(ai->ai_addr, strp, slen);
-			if (ai->ai_family == AF_INET6) {
-				strcat(c->buf, "]");
+			c->ev_mask = EPOLLIN;
+		}
+		return;
+	}
+	bool done = false;
+	if (events & EPOLLOUT) {
+		done = ctxp->out.flush(ctxp->fd) < 0 || ctxp->out.empty();
+	} else if (ctxp->out.empty()) {
+		// the request is not looked at, it only has to be complete
+		int n = read(ctxp->fd, ctxp->buf + ctxp->buf_len, FDCTX_CLIENT_BUFSIZE - ctxp->buf_len);
+		if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+			return;
+		}
+		if (n <= 0) {
+			done = true;
+		} else {
+			ctxp->buf_len += n;
+			if (memmem(ctxp->buf, ctxp->buf_len, "\r\n\r\n", 4) || memmem(ctxp->buf, ctxp->buf_len, "\n\n", 2) ||
+				ctxp->buf_len == FDCTX_CLIENT_BUFSIZE) {
+				std::string body;
+				metrics_render(body);
+				char head[128];
+				int hl = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+								  "Content-Length: %d\r\nConnection: close\r\n\r\n", (int) body.size());
+				ctxp->out.append(head, hl);
+				ctxp->out.append(body.data(), body.size());
+				done = ctxp->out.flush(ctxp->fd) < 0 || ctxp->out.empty();
 			}
-			sprintf(c->buf + strlen(c->buf), ":%d", listen_port);
-			server_sockets.push_back(c);
 		}
-		freeaddrinfo(ai_res);
 	}
+	if (done) {
+		close(ctxp->fd);
+		ctxp->out.clear();
+		deallocate_fdctx(ctxp);
+		return;
+	}
+	update_events(epoll, ctxp);
+}
+
+static void metric_head(std::string & out, const char * name, const char * type, const char * help) {
+	out += "# HELP ";
+	out += name;
+	out += " ";
+	out += help;
+	out += "\n# TYPE ";
+	out += name;
+	out += " ";
+	out += type;
+	out += "\n";
+}
+
+// Prometheus text format, one series per worker. the counters of the
+// other workers are read while they are being written, each of them is
+// at most a moment old.
+void worker::metrics_render(std::string & out) {
+	static const struct {
+		const char * name;
+		const char * help;
+		uint64_t worker_metrics::* field;
+	} counters[] = {
+		{ "nofat_frames_in_total", "frames read from clients and links", &worker_metrics::frames_in },
+		{ "nofat_bytes_in_total", "bytes of those frames", &worker_metrics::bytes_in },
+		{ "nofat_frames_forwarded_total", "frames handed to a peer, another worker or another node", &worker_metrics::frames_out },
+		{ "nofat_bytes_forwarded_total", "bytes of those frames", &worker_metrics::bytes_out },
+		{ "nofat_peer_hits_total", "destination uids connected to the same worker", &worker_metrics::peer_hits },
+		{ "nofat_peer_misses_total", "destination uids not connected to the same worker", &worker_metrics::peer_misses },
+		{ "nofat_unknown_uid_total", "frames for a uid connected nowhere", &worker_metrics::unknown_uid },
+		{ "nofat_oversize_total", "connections closed for a frame larger than allowed", &worker_metrics::oversize },
+		{ "nofat_short_writes_total", "writes the socket did not take completely", &worker_metrics::short_writes },
+		{ "nofat_slow_peer_drops_total", "peers disconnected by -d or a frame cut short", &worker_metrics::slow_peer_drops },
+		{ "nofat_handed_over_total", "connections handed to the next proxy with -u", &worker_metrics::handed_over },
+		{ "nofat_handshake_timeouts_total", "clients closed for not sending SET_UID in time", &worker_metrics::handshake_timeouts },
+		{ "nofat_idle_timeouts_total", "clients closed for being silent longer than -I", &worker_metrics::idle_timeouts },
+		{ "nofat_rate_limited_frames_total", "frames dropped for being over the sender's -r budget", &worker_metrics::rate_limited },
+		{ "nofat_rate_limited_bytes_total", "bytes of the frames dropped for -r", &worker_metrics::rate_limited_bytes },
+		{ "nofat_quantum_yields_total", "turns a client ended with frames left over -q", &worker_metrics::quantum_yields },
+		{ "nofat_foreign_cpu_total", "connections accepted by a worker not on the cpu their packets arrive on (-A)", &worker_metrics::foreign_cpu },
+		{ "nofat_captured_frames_total", "frames written to the -C capture log", &worker_metrics::captured },
+		{ "nofat_capture_drops_total", "frames that did not fit into the -C capture log any more", &worker_metrics::capture_drops },
+	};
+	char line[256];
+	for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); ++i) {
+		metric_head(out, counters[i].name, "counter", counters[i].help);
+		for (int w = 0; w < nworkers; ++w) {
+			snprintf(line, sizeof(line), "%s{worker=\"%d\"} %" PRIu64 "\n", counters[i].name, w, workers[w].metrics.*counters[i].field);
+			out += line;
+		}
+	}
+
+	// what the workers kept as plain members before
+	metric_head(out, "nofat_connections", "gauge", "client connections");
+	for (int w = 0; w < nworkers; ++w) {
+		snprintf(line, sizeof(line), "nofat_connections{worker=\"%d\"} %d\n", w,
+				 (int) (workers[w].total_sockets - workers[w].server_sockets.size()));
+		out += line;
+	}
+	metric_head(out, "nofat_peers", "gauge", "connections that sent SET_UID");
+	for (int w = 0; w < nworkers; ++w) {
+		snprintf(line, sizeof(line), "nofat_peers{worker=\"%d\"} %d\n", w, workers[w].peer_sockets.size());
+		out += line;
+	}
+	static const struct {
+		const char * name;
+		const char * help;
+		uint64_t worker::* field;
+	} plain[] = {
+		{ "nofat_xthread_drops_total", "frames lost between workers", &worker::xthread_drops },
+		{ "nofat_relayed_total", "frames sent to another node", &worker::relayed },
+		{ "nofat_relay_drops_total", "frames for another node without a link", &worker::relay_drops },
+		{ "nofat_spliced_frames_total", "large frames moved with splice()", &worker::spliced_frames },
+		{ "nofat_gathered_frames_total", "large frames read in before sending", &worker::gathered_frames },
+		{ "nofat_udp_in_total", "datagrams received", &worker::udp_in },
+		{ "nofat_udp_out_total", "datagrams sent", &worker::udp_out },
+	};
+	for (size_t i = 0; i < sizeof(plain) / sizeof(plain[0]); ++i) {
+		metric_head(out, plain[i].name, "counter", plain[i].help);
+		for (int w = 0; w < nworkers; ++w) {
+			snprintf(line, sizeof(line), "%s{worker=\"%d\"} %" PRIu64 "\n", plain[i].name, w, workers[w].*plain[i].field);
+			out += line;
+		}
+	}
+
+	// one histogram over all workers
+	metric_head(out, "nofat_forward_latency_us", "histogram", "from the epoll_wait that read a frame to the write that sent it, per destination and batch");
+	uint64_t cumulative = 0, sum = 0, count = 0;
+	for (int b = 0; b < LAT_BUCKETS; ++b) {
+		for (int w = 0; w < nworkers; ++w) {
+			cumulative += workers[w].metrics.latency[b];
+		}
+		snprintf(line, sizeof(line), "nofat_forward_latency_us_bucket{le=\"%ld\"} %" PRIu64 "\n", 1L << b, cumulative);
+		out += line;
+	}
+	for (int w = 0; w < nworkers; ++w) {
+		sum   += workers[w].metrics.latency_sum_us;
+		count += workers[w].metrics.latency_count;
+	}
+	snprintf(line, sizeof(line), "nofat_forward_latency_us_bucket{le=\"+Inf\"} %" PRIu64 "\nnofat_forward_latency_us_sum %" PRIu64 "\n"
+			 "nofat_forward_latency_us_count %" PRIu64 "\n", count, sum, count);
+	out += line;
+}
+
+void worker::client_event(fd_ctx * ctxp, uint32_t events) {
+	if (unlikely(ctxp->dropped)) {
+		close_client(ctxp);
+		return;
+	}
+	if (unlikely(events & EPOLLOUT) && ! client_writable(ctxp)) {
+		return;
+	}
+	if (unlikely(decay_mode) && ctxp->link_node < 0 && send_fd(ctrl_socket_conn.fd, ctxp) > 0) {
+		fprintf(stderr, "single send\n");
+		if (ctxp->faf_uid != -1) {
+			unregister_peer(ctxp);
+		}
+		return;
+	}
+
+	if (! (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+		return;
+	}
+	ctxp->last_active = wheel.now;
+	if (unlikely(ctxp->stream != NULL)) {
+		// ends with make_ready for what comes after the frame
+		stream_pump(ctxp);
+		return;
+	}
+
+	if (unlikely(ctxp->pend_gen == batch_gen && npending)) {
+		// pending frames still point into the ring space we read into
+		flush_pending();
+	}
+	if (unlikely(drr_quantum)) {
+		ctxp->deficit += drr_quantum;
+	}
+	iovec riov[2];
+	int riovcnt = ring_free_iov(ctxp, riov);
+	if (unlikely(! riov[0].iov_len)) {
+		// -q left a full ring of complete frames for this turn. edge
+		// triggered, the socket may still have more for the next one
+		process_frames(ctxp);
+		if (epoll_et && ctxp->fd != -1 && ! ctxp->paused && ! ctxp->dropped) {
+			make_ready(ctxp);
+		}
+		return;
+	}
+	const int room = riov[0].iov_len + (riovcnt > 1 ? riov[1].iov_len : 0);
+	int n = readv(ctxp->fd, riov, riovcnt);
+	if (unlikely(n < 0)) {
+		if (errno != ECONNRESET && errno != EAGAIN && errno != EINTR) {
+			VPERROR("read");
+		}
+		if (errno == ECONNRESET) {
+			close_client(ctxp);
+		} else if (drr_quantum || ctxp->buf_len) {
+			// back from the ready list for what -q or the old process left
+			process_frames(ctxp);
+		}
+		return;
+	} else if (unlikely(n == 0)) {
+		close_client(ctxp);
+		return;
+	}
+	ctxp->buf_len += n;
+	process_frames(ctxp);
+	// level triggered epoll reports what is left, edge triggered only once
+	// more arrives. a short read means the socket ran dry, otherwise we
+	// come back for the rest after everybody else had a read
+	if (epoll_et && n == room && ctxp->fd != -1 && ! ctxp->paused && ! ctxp->dropped) {
+		make_ready(ctxp);
+	}
+}
+
+void worker::make_ready(fd_ctx * ctxp) {
+	if (ctxp->ready) {
+		return;
+	}
+	ctxp->ready = true;
+	ready_list.push_back(ctxp);
+}
+
+void worker::run_ready() {
+	ready_run.swap(ready_list);
+	for (int i = 0; i < ready_run.size(); ++i) {
+		fd_ctx * c = ready_run[i].get();
+		if (! c) {
+			continue;
+		}
+		c->ready = false;
+		// paused since, the event comes back with EPOLLIN
+		if (c->fd != -1 && ! c->paused) {
+			client_event(c, EPOLLIN);
+		}
+	}
+	ready_run.clear();
+}
+
+// ms from now, rounded up to whole ticks. 0 leaves the context alone
+void worker::timer_start(fd_ctx * ctxp, int ms) {
+	if (ms > 0) {
+		wheel.add(ctxp, wheel.now + (ms + TW_TICK_MS - 1) / TW_TICK_MS);
+	}
+}
+
+// a client that never identified itself, or one that went silent. a
+// paused sender is not read from, so it only looks silent
+void worker::timer_expired(fd_ctx * ctxp) {
+	if (ctxp->fd == -1 || ctxp->link_node >= 0) {
+		return;
+	}
+	if (ctxp->faf_uid == -1) {
+		++metrics.handshake_timeouts;
+		close_client(ctxp);
+		return;
+	}
+	if (! idle_timeout_ms) {
+		return;
+	}
+	const uint64_t idle = (idle_timeout_ms + TW_TICK_MS - 1) / TW_TICK_MS;
+	if (ctxp->paused) {
+		wheel.add(ctxp, wheel.now + idle);
+	} else if (wheel.now - ctxp->last_active < idle) {
+		wheel.add(ctxp, ctxp->last_active + idle);
+	} else {
+		++metrics.idle_timeouts;
+		close_client(ctxp);
+	}
+}
+
+// one or more ticks passed, more if the loop was busy for a while
+void worker::timer_event() {
+	uint64_t n;
+	if (read(timer_ctx.fd, &n, sizeof(n)) < 0) {
+		if (errno != EAGAIN) {
+			VPERROR("read(timerfd)");
+		}
+		return;
+	}
+	while (n--) {
+		fd_ctx * expired;
+		wheel.tick(&expired);
+		while (expired) {
+			fd_ctx * c = expired;
+			timer_cancel(c);
+			timer_expired(c);
+		}
+	}
+	if (unlikely(wheel.now >= status_due)) {
+		status_report();
+		status_due = wheel.now + STATUS_INTERVAL_MS / TW_TICK_MS;
+	}
+	if (unlikely(cluster) && id == 0 && ! book_port && ! book_master && now_ms() >= book_retry) {
+		book_connect();
+	}
+}
+
+void worker::status_report() {
+	const ctx_pool & cp = ctx_pools[POOL_CLIENT];
+	if (nworkers > 1) {
+		fprintf(stderr, "[%d] %d connections, %d identified peers, %" PRIu64 " cross-worker drops, ctx pool %d/%d (high %d)\n", id,
+				(int) (total_sockets - server_sockets.size()), (int) peer_sockets.size(), xthread_drops,
+				cp.in_use, cp.capacity, cp.high_water);
+	} else {
+		fprintf(stderr, "%d connections, %d identified peers, ctx pool %d/%d (high %d)\n",
+				(int) (total_sockets - server_sockets.size()), (int) peer_sockets.size(),
+				cp.in_use, cp.capacity, cp.high_water);
+	}
+	if (udp) {
+		fprintf(stderr, "[%d] udp %" PRIu64 " in, %" PRIu64 " out, %" PRIu64 " via tcp, %" PRIu64 " rejected\n", id,
+				udp_in, udp_out, udp_via_tcp, udp_rejected);
+	}
+	if (spliced_frames || gathered_frames) {
+		fprintf(stderr, "[%d] large frames: %" PRIu64 " spliced (%" PRIu64 " bytes), %" PRIu64 " copied\n", id,
+				spliced_frames, spliced_bytes, gathered_frames);
+	}
+	if (cluster) {
+		fprintf(stderr, "[%d] node %d: %" PRIu64 " relayed, %" PRIu64 " dropped\n", id,
+				__atomic_load_n(&self_node, __ATOMIC_RELAXED), relayed, relay_drops);
+	}
+	if (metrics.foreign_cpu) {
+		fprintf(stderr, "[%d] cpu %d: %" PRIu64 " connections with packets on another cpu\n", id, cpu, metrics.foreign_cpu);
+	}
+	if (metrics.handshake_timeouts || metrics.idle_timeouts) {
+		fprintf(stderr, "[%d] timeouts: %" PRIu64 " without SET_UID, %" PRIu64 " idle\n", id,
+				metrics.handshake_timeouts, metrics.idle_timeouts);
+	}
+	if (metrics.rate_limited || metrics.quantum_yields) {
+		fprintf(stderr, "[%d] over budget: %" PRIu64 " frames (%" PRIu64 " bytes) dropped, %" PRIu64 " turns cut short\n", id,
+				metrics.rate_limited, metrics.rate_limited_bytes, metrics.quantum_yields);
+	}
+	if (capture) {
+		fprintf(stderr, "[%d] capture: %" PRIu64 " frames, %" PRIu64 " did not fit\n", id,
+				metrics.captured, metrics.capture_drops);
+	}
+}
 
-	for (int i = 0; i < server_sockets.size(); ++i) {
-		poll_in(epoll, server_sockets[i]);
+// before anything of ours is allocated on this thread
+void worker::pin() {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	const int r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (r) {
+		fprintf(stderr, "[%d] can not run on cpu %d: %s\n", id, cpu, strerror(r));
+		exit(1);
+	}
+	unsigned c, n;
+	if (syscall(SYS_getcpu, &c, &n, NULL) == 0) {
+		node = n;
+	}
+	thread_node = node;
+	// the rings the other workers write to us are read here
+	if (inbound) {
+		bind_to_node(inbound, nworkers * sizeof(xthread_queue), node, true);
 	}
+	fprintf(stderr, "[%d] on cpu %d, node %d\n", id, cpu, node);
+}
 
-	epoll_event epoll_events[32];
-	const int epoll_max_events = 32;
+void worker::run() {
+	if (cpu >= 0) {
+		pin();
+	}
+	std::vector<epoll_event> epoll_events(epoll_batch);
+	thread_metrics = &metrics;
 
-	fd_ctx fd_ctx_finder;
-	signal(SIGUSR1, sigusr1);
-	signal(SIGPIPE, SIG_IGN);
+	if (busy_poll_us) {
+		epoll_params ep;
+		memset(&ep, 0, sizeof(ep));
+		ep.busy_poll_usecs = busy_poll_us;
+		if (ioctl(epoll, EPIOCSPARAMS, &ep) < 0 && id == 0) {
+			// the sockets still busy poll on their own reads
+			fprintf(stderr, "-B: no busy polling in epoll_wait (%s), it needs Linux 6.9\n", strerror(errno));
+		}
+	}
 
-	total_sockets  = server_sockets.size();
-	time_t status_time = time(NULL);
+	total_sockets += server_sockets.size();
 
-	while (total_sockets) {
-		if (unlikely(got_sigusr1)) {
-			// close listening sockets
+	timer_ctx.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_ctx.fd < 0) {
+		VPERROR("timerfd_create");
+		exit(1);
+	}
+	itimerspec its;
+	its.it_interval.tv_sec  = 0;
+	its.it_interval.tv_nsec = TW_TICK_MS * 1000000L;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(timer_ctx.fd, 0, &its, NULL) < 0) {
+		VPERROR("timerfd_settime");
+		exit(1);
+	}
+	poll_in(epoll, &timer_ctx);
+
+	if (use_uring) {
+		ring = new io_ring;
+		if (ring->setup() < 0) {
+			fprintf(stderr, "io_uring not available, using epoll\n");
+			delete ring;
+			ring = NULL;
+		} else {
+			// the listeners and the eventfd stay in the epoll set unused
+			thread_ring = ring;
 			for (int i = 0; i < server_sockets.size(); ++i) {
-				fprintf(stderr, "close server %s\n", server_sockets[i]->buf);
-				if (epoll_ctl(epoll, EPOLL_CTL_DEL, server_sockets[i]->fd, NULL) < 0) {
-					VPERROR("epoll_ctl");
-				}
-				close(server_sockets[i]->fd);
-				--total_sockets;
+				ring_arm_accept(server_sockets[i]);
+			}
+			if (wake_ctx.fd != -1) {
+				ring_arm_wake();
 			}
-			got_sigusr1 = false;
+			ring_arm_timer();
 		}
-		if (unlikely(status_time + 5 < time(NULL))) {
-			fprintf(stderr, "%d connections, %d identified peers\n", total_sockets - server_sockets.size(), peer_sockets.size());
-			status_time = time(NULL);
+	}
+
+	while (total_sockets) {
+		if (unlikely(sigusr1_seen != sigusr1_count)) {
+			// close listening sockets
+			close_servers();
+			sigusr1_seen = sigusr1_count;
 		}
 
-		int ep_num = epoll_wait(epoll, epoll_events, epoll_max_events, 1000);
+		if (unlikely(! xthread_blocked.empty())) {
+			retry_blocked();
+			flush_pending();
+		}
+		if (! wake_list.empty()) {
+			wake_remotes();
+		}
+
+		// the timerfd wakes us for everything that is due
+		const int timeout = ! ready_list.empty() ? 0 : xthread_blocked.empty() ? -1 : 1;
+		int ep_num = 0;
+		if (ring) {
+			ring_batch(timeout);
+		} else {
+			ep_num = epoll_wait(epoll, &epoll_events[0], epoll_batch, timeout);
+		}
 		if (unlikely(ep_num < 0)) {
 			if (errno == EINTR) continue;
 			VPERROR("epoll_wait"); continue;
 		}
+		if (metrics_port) {
+			batch_time = now_ms();
+		}
 		bool epoll_restart = false;
 		for (int epi = 0; epi < ep_num && ! epoll_restart; ++epi) {
 			fd_ctx * ctxp = (fd_ctx *) epoll_events[epi].data.ptr;
 
-			if (unlikely(ctxp == &ctrl_socket)) {
+			if (unlikely(ctxp == &wake_ctx)) {
+				drain_inbound();
+			} else if (unlikely(ctxp == &timer_ctx)) {
+				timer_event();
+			} else if (unlikely(ctxp == &ctrl_socket)) {
 				sockaddr_storage ss;
 				socklen_t sl = sizeof(ss);
-				
+
 				int nsock = accept(ctxp->fd, (sockaddr *) &ss, &sl);
 				if (nsock < 0) {
 					VPERROR("accept"); continue;
@@ -585,25 +4462,28 @@ int main(int argc, char ** argv) {
 						poll_in(epoll, &ctrl_socket);
 					} else {
 						if (strncmp(buf, "unlisten", sizeof("unlisten") - 1) == 0) {
-							for (int i = 0; i < server_sockets.size(); ++i) {
-								fprintf(stderr, "close server %s\n", server_sockets[i]->buf);
-								if (epoll_ctl(epoll, EPOLL_CTL_DEL, server_sockets[i]->fd, NULL) < 0) {
-									VPERROR("epoll_ctl");
-								}
-								close(server_sockets[i]->fd);
-								--total_sockets;
-							}
+							close_servers();
 							if (write(ctrl_socket_conn.fd, "unlistening", sizeof("unlistening") - 1) < 0) {
 								VPERROR("write");
 							} else {
+								const double t0 = now_ms();
 								int nsent = 0;
-								
-								do {
-									nsent = send_fds(ctrl_socket_conn.fd, epoll, peer_sockets.begin(), peer_sockets.end(), &peer_sockets);
-									if (nsent) {
-										fprintf(stderr, "bulk send: %d\n", nsent);
-									}
-								} while (nsent && ! peer_sockets.empty());
+								int nmsgs = 0;
+								std::vector<fd_ctx *> to_send;
+								peer_sockets.collect(to_send);
+
+								std::vector<fd_ctx *>::iterator it = to_send.begin();
+								while (it != to_send.end()) {
+									int n = send_fds(ctrl_socket_conn.fd, it, to_send.end(), &peer_sockets);
+									if (n < 0) break;
+									nsent += n;
+									++nmsgs;
+								}
+								if (write(ctrl_socket_conn.fd, "done", sizeof("done") - 1) < 0) {
+									VPERROR("write");
+								}
+								fprintf(stderr, "bulk send: %d sockets (%ld bytes buffered) in %d messages, %.1f ms, %d left\n",
+										nsent, bytes_handed_over, nmsgs, now_ms() - t0, peer_sockets.size());
 								epoll_restart = true;
 								decay_mode = true;
 							}
@@ -641,40 +4521,28 @@ int main(int argc, char ** argv) {
 						fprintf(stderr, "unexpected close\n");
 						close(ctxp->fd);
 					} else {
-						if (strncmp((const char *) iov.iov_base, "desc", std::min(4, n)) == 0) {
+						const bool v2 = strncmp((const char *) iov.iov_base, "dsc2", std::min(4, n)) == 0;
+						if (v2 || strncmp((const char *) iov.iov_base, "desc", std::min(4, n)) == 0) {
 							cmsghdr * cmp = CMSG_FIRSTHDR(&msg);
-							if (cmp->cmsg_level != SOL_SOCKET || cmp->cmsg_type != SCM_RIGHTS) {
+							if (! cmp || cmp->cmsg_level != SOL_SOCKET || cmp->cmsg_type != SCM_RIGHTS) {
 								fprintf(stderr, "malformed control message: wrong type\n");
 								exit(1);
 							}
-
-							int * uidp = (int *) ((char *) iov.iov_base + 4);
-							int * uidpend = (int *) ((char *) iov.iov_base + n);
-
-							int fd_count = 0;
-							for (; uidp < uidpend; ++uidp, ++fd_count) {
-								int fd = * ((int *) CMSG_DATA(cmp) + fd_count);
-								++sockets_inherited;
-								++total_sockets;
-								fd_ctx * cp = allocate_fdctx(FDCTX_CLIENT_BUFSIZE);
-								cp->fd = fd;
-								cp->faf_uid = *uidp;
-								cp->is_server = false;
-								cp->protocol = IPPROTO_TCP;
-								cp->buf_len = 0;
-								epoll_event ev;
-								ev.events = EPOLLIN;
-								ev.data.ptr = (void *) cp;
-								if (epoll_ctl(epoll, EPOLL_CTL_ADD, cp->fd, &ev) < 0) {
-									VPERROR("epoll_ctl");
-									--total_sockets;
-									close(cp->fd);
-									deallocate_fdctx(cp);
-								}
-								if (cp->faf_uid != -1) {
-									peer_sockets.insert(cp);
+							if (! inherit_start) {
+								inherit_start = now_ms();
+							}
+							adopt_fds((const char *) iov.iov_base + 4, n - 4, (const int *) CMSG_DATA(cmp),
+									  (cmp->cmsg_len - CMSG_LEN(0)) / sizeof(int), v2);
+						} else if (strncmp((const char *) iov.iov_base, "done", std::min(4, n)) == 0) {
+							fprintf(stderr, "adopted %d sockets (%ld bytes buffered) in %.1f ms\n",
+									sockets_inherited, bytes_inherited, now_ms() - inherit_start);
+							inherit_done = true;
+							for (int i = 0; i < adopted_frames.size(); ++i) {
+								if (fd_ctx * c = adopted_frames[i].get()) {
+									make_ready(c);
 								}
 							}
+							adopted_frames.clear();
 						} else if (strncmp((const char *) iov.iov_base, "exit", std::min(4, n)) == 0) {
 							close(ctxp->fd);
 							int s = socket(PF_UNIX, SOCK_SEQPACKET, 0);
@@ -690,177 +4558,450 @@ int main(int argc, char ** argv) {
 						}
 					}
 				}
+			} else if (ctxp == udp_socket) {
+				udp_event();
+			} else if (unlikely(ctxp->protocol == PROTO_BOOK)) {
+				book_event(ctxp, epoll_events[epi].events);
+			} else if (unlikely(ctxp->protocol == PROTO_METRICS)) {
+				metrics_event(ctxp, epoll_events[epi].events);
 			} else if (unlikely(ctxp->is_server && ctxp->protocol == IPPROTO_TCP)) {
-				sockaddr_storage saddr;
-				socklen_t saddrlen = sizeof(saddr);
-				int nsock = accept(ctxp->fd, (sockaddr *) &saddr, &saddrlen);
-				if (nsock < 0) {
-					VPERROR("accept");
-				} else {
-					++total_sockets;
-					fd_ctx * cp = allocate_fdctx(FDCTX_CLIENT_BUFSIZE);
-					cp->fd = nsock;
-					cp->faf_uid = -1;
-					cp->is_server = false;
-					cp->protocol = IPPROTO_TCP;
-					cp->buf_len = 0;
-
-					epoll_event ev;
-					ev.events = EPOLLIN;
-					ev.data.ptr = (void *) cp;
-					if (epoll_ctl(epoll, EPOLL_CTL_ADD, nsock, &ev) < 0) {
-						VPERROR("epoll_ctl");
-						--total_sockets;
-						close(nsock);
-						deallocate_fdctx(cp);
+				for (int i = 0; i < ACCEPT_BATCH; ++i) {
+					sockaddr_storage saddr;
+					socklen_t saddrlen = sizeof(saddr);
+					int nsock = accept4(ctxp->fd, (sockaddr *) &saddr, &saddrlen, SOCK_NONBLOCK);
+					if (nsock < 0) {
+						if (errno != EAGAIN && errno != EINTR) {
+							VPERROR("accept");
+						}
+						break;
 					}
+					accept_client(nsock);
 				}
 			} else {
-				if (unlikely(decay_mode && ctxp->buf_len == 0)) {
-					fprintf(stderr, "single send\n");
-					send_fd(ctrl_socket_conn.fd, epoll, ctxp);
-					if (ctxp->faf_uid != -1) {
-						peer_sockets.erase(ctxp);
-					}
-					continue; // -> next epoll result
-				}
+				client_event(ctxp, epoll_events[epi].events);
+			}
+		}
+		if (npending) {
+			flush_pending();
+		}
+		// every round is a batch of its own, one writev per destination
+		for (int r = 0; r < ET_READY_ROUNDS && ! ready_list.empty() && ! epoll_restart; ++r) {
+			run_ready();
+			if (npending) {
+				flush_pending();
+			}
+		}
+		if (! wake_list.empty()) {
+			wake_remotes();
+		}
+		if (unlikely(cluster) && id == 0) {
+			if (! book_out.empty()) {
+				book_flush();
+			}
+		}
+	}
+	if (handoff_link && handoff_link->out.len) {
+		// the last frames we forwarded, they are not sent anywhere else.
+		// blocking, but not for longer than a link retry
+		int fl = fcntl(handoff_link->fd, F_GETFL);
+		fcntl(handoff_link->fd, F_SETFL, fl & ~O_NONBLOCK);
+		timeval tv = { LINK_RETRY_MS / 1000, (LINK_RETRY_MS % 1000) * 1000 };
+		setsockopt(handoff_link->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		const double until = now_ms() + LINK_RETRY_MS;
+		while (handoff_link->out.len && now_ms() < until && handoff_link->out.flush(handoff_link->fd) >= 0) {
+		}
+	}
+	if (decay_mode && ctrl_socket_path) {
+		close(ctrl_socket.fd);
+		unlink(ctrl_socket_path);
+		if (write(ctrl_socket_conn.fd, "exit", strlen("exit")) < 0) {
+			VPERROR("send");
+		}
+	}
+	if (nworkers > 1) {
+		fprintf(stderr, "[%d] exit due to %d sockets left to serve\n", id, total_sockets);
+	} else {
+		fprintf(stderr, "exit due to %d sockets left to serve\n", total_sockets);
+	}
+}
 
-				int n = read(ctxp->fd, ctxp->buf + ctxp->buf_len, FDCTX_CLIENT_BUFSIZE - ctxp->buf_len);
-				if (unlikely(n < 0)) {
-					if (errno != ECONNRESET && errno != EAGAIN && errno != EINTR) {
-						VPERROR("read");
-					}
-					continue;
-				} else if (unlikely(n == 0)) {
-					close(ctxp->fd);
-					--total_sockets;
-					if (ctxp->faf_uid != -1) {
-						peer_sockets.erase(ctxp);
-					}
-					ctxp->remove_myself_from_peer_caches();
-					--ctxp->refcount;
-					if (ctxp->refcount == 0) {
-						deallocate_fdctx(ctxp);
-					} else {
-						ctxp->faf_uid = -1;
-					}
-				} else {
-					ctxp->buf_len += n;
-					char * buf_head = ctxp->buf;
-					bool postprocess = true;
-
-					while (buf_head < ctxp->buf + ctxp->buf_len) {
-						const int buf_len = ctxp->buf + ctxp->buf_len - buf_head;
-						if (buf_len < 4) {
-							break;
-						}
-						proxy_msg_header * h = (proxy_msg_header *) buf_head;
-						const int in_msg_size = ntohl(h->size);
+void * worker_main(void * arg) {
+	((worker *) arg)->run();
+	return NULL;
+}
 
-						if (unlikely(in_msg_size > FDCTX_CLIENT_BUFSIZE)) {
-							// message to big
-							if (epoll_ctl(epoll, EPOLL_CTL_DEL, ctxp->fd, NULL) < 0) {
-								VPERROR("epoll_ctl");
-							}
-							close(ctxp->fd);
-							--total_sockets;
-							if (ctxp->faf_uid != -1) {
-								peer_sockets.erase(ctxp);
-							}
-							ctxp->remove_myself_from_peer_caches();
-							--ctxp->refcount;
-							if (ctxp->refcount == 0) {
-								deallocate_fdctx(ctxp);
-							} else {
-								ctxp->faf_uid = -1;
-							}
-							postprocess = false;
-							break;
-						}
+// 0-3,8,10-11
+bool parse_cpu_list(const char * s, std::vector<int> & cpus) {
+	while (*s) {
+		char * end;
+		const long first = strtol(s, &end, 10);
+		long last = first;
+		if (end == s) {
+			return false;
+		}
+		if (*end == '-') {
+			s = end + 1;
+			last = strtol(s, &end, 10);
+			if (end == s) {
+				return false;
+			}
+		}
+		if (first < 0 || last < first || last >= CPU_SETSIZE) {
+			return false;
+		}
+		for (long c = first; c <= last; ++c) {
+			cpus.push_back(c);
+		}
+		if (*end == ',') {
+			++end;
+		} else if (*end) {
+			return false;
+		}
+		s = end;
+	}
+	return ! cpus.empty();
+}
 
-						if (in_msg_size + 4 > buf_len) {
-							break;
-						}
+int main(int argc, char ** argv) {
+	int listen_port = -1;
+	const char * ctrl_socket_path = NULL;
+	const char * capture_spec = NULL;
+	bool capture_payloads = false;
+
+	{
+		int opt;
+		while ((opt = getopt(argc, argv, "p:hu:o:dt:He:Eb:U:M:S:m:I:r:q:C:PA:B:")) != EOF) {
+			switch (opt) {
+			case 'p' :
+				listen_port = atoi(optarg);
+				break;
+			case 'h' :
+				fprintf(stderr, "%s [-p port] [-u socket-path] [-o out-queue-bytes] [-d] [-t threads] [-H] [-e epoll|io_uring]\n"
+						"    [-E] [-b events] [-U udp-port] [-M book-port | -S master-host:book-port] [-m metrics-port]\n"
+						"    [-I idle-seconds] [-r frames/s[:bytes/s]] [-q quantum-bytes] [-C capture-path[:megabytes] [-P]]\n"
+						"    [-A cpu-list] [-B busy-poll-us]\n", argv[0]);
+				fprintf(stderr, "default: -p 9134 -o %d -t 1 -e epoll -b %d\n", out_hwm, epoll_batch);
+				exit(0);
+			case 'u' :
+				ctrl_socket_path = optarg;
+				break;
+			case 'o' :
+				out_hwm = atoi(optarg);
+				break;
+			case 'd' :
+				drop_slow_peers = true;
+				break;
+			case 'H' :
+				use_hugepages = true;
+				break;
+			case 'e' :
+				if (strcmp(optarg, "io_uring") == 0) {
+					use_uring = true;
+				} else if (strcmp(optarg, "epoll") != 0) {
+					fprintf(stderr, "unknown engine %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'E' :
+				epoll_et = EPOLLET;
+				break;
+			case 'b' :
+				epoll_batch = atoi(optarg);
+				if (epoll_batch < 1) {
+					fprintf(stderr, "-b must be at least 1\n");
+					exit(1);
+				}
+				break;
+			case 'U' :
+				udp_port = atoi(optarg);
+				if (udp_port < 1 || udp_port > 65535) {
+					fprintf(stderr, "-U needs a port\n");
+					exit(1);
+				}
+				break;
+			case 'M' :
+				book_port = atoi(optarg);
+				if (book_port < 1 || book_port > 65535) {
+					fprintf(stderr, "-M needs a port\n");
+					exit(1);
+				}
+				cluster = true;
+				break;
+			case 'm' :
+				metrics_port = atoi(optarg);
+				if (metrics_port < 1 || metrics_port > 65535) {
+					fprintf(stderr, "-m needs a port\n");
+					exit(1);
+				}
+				break;
+			case 'I' :
+				idle_timeout_ms = atoi(optarg) * 1000;
+				if (idle_timeout_ms < 0) {
+					fprintf(stderr, "-I needs seconds\n");
+					exit(1);
+				}
+				break;
+			case 'r' : {
+				char * end;
+				long long msgs = strtoll(optarg, &end, 10), bytes = 0;
+				if (*end == ':') {
+					bytes = strtoll(end + 1, &end, 10);
+				}
+				if (*end || msgs < 0 || bytes < 0 || msgs > INT_MAX || bytes > INT_MAX) {
+					fprintf(stderr, "-r needs frames/s[:bytes/s]\n");
+					exit(1);
+				}
+				rate_msgs  = msgs;
+				rate_bytes = bytes;
+				break;
+			}
+			case 'q' :
+				drr_quantum = atoi(optarg);
+				if (drr_quantum < 0) {
+					fprintf(stderr, "-q needs bytes\n");
+					exit(1);
+				}
+				break;
+			case 'C' :
+				capture_spec = optarg;
+				break;
+			case 'A' :
+				if (! parse_cpu_list(optarg, pin_cpus)) {
+					fprintf(stderr, "-A needs cpus like 0-3,8,10\n");
+					exit(1);
+				}
+				break;
+			case 'B' :
+				busy_poll_us = atoi(optarg);
+				if (busy_poll_us < 1) {
+					fprintf(stderr, "-B needs microseconds\n");
+					exit(1);
+				}
+				break;
+			case 'P' :
+				capture_payloads = true;
+				break;
+			case 'S' :
+				book_master_name = optarg;
+				cluster = true;
+				break;
+			case 't' :
+				nworkers = atoi(optarg);
+				if (nworkers < 1 || nworkers > MAX_WORKERS) {
+					fprintf(stderr, "-t must be between 1 and %d\n", MAX_WORKERS);
+					exit(1);
+				}
+				break;
+			}
+		}
+		argc -= optind;
+		argv += optind;
+	}
 
-						if (unlikely(ctxp->faf_uid == -1)) {
-							proxy_msg_header_set_uid * hu = (proxy_msg_header_set_uid *) h;
-							ctxp->faf_uid = ntohs(hu->uid);
-							peer_sockets.insert(ctxp);
+	if (listen_port == -1) {
+		listen_port = DEFAULT_PORT;
+	}
+	if (ctrl_socket_path && nworkers > 1) {
+		fprintf(stderr, "-u can not be combined with -t yet\n");
+		exit(1);
+	}
+	if (ctrl_socket_path && use_uring) {
+		fprintf(stderr, "-u can not be combined with -e io_uring yet\n");
+		exit(1);
+	}
+	if (epoll_et && use_uring) {
+		fprintf(stderr, "-E only applies to -e epoll\n");
+		exit(1);
+	}
+	// the uid -> address table does not move to the next proxy yet
+	if (udp_port && ctrl_socket_path) {
+		fprintf(stderr, "-U can not be combined with -u yet\n");
+		exit(1);
+	}
+	if (udp_port && use_uring) {
+		fprintf(stderr, "-U only applies to -e epoll\n");
+		exit(1);
+	}
+	if (udp_port) {
+		udp_peers = (udp_peer *) calloc(65536, sizeof(udp_peer));
+	}
+	if (book_port && book_master_name) {
+		fprintf(stderr, "-M and -S are exclusive\n");
+		exit(1);
+	}
+	// links and the peer book do not move to the next proxy yet
+	if (cluster && ctrl_socket_path) {
+		fprintf(stderr, "-M and -S can not be combined with -u yet\n");
+		exit(1);
+	}
+	if (cluster && use_uring) {
+		fprintf(stderr, "-M and -S only apply to -e epoll\n");
+		exit(1);
+	}
+	if (busy_poll_us && use_uring) {
+		fprintf(stderr, "-B only applies to -e epoll\n");
+		exit(1);
+	}
+	if (metrics_port && use_uring) {
+		// the scrape is served from worker 0's epoll set
+		fprintf(stderr, "-m only applies to -e epoll\n");
+		exit(1);
+	}
+	if (capture_payloads && ! capture_spec) {
+		fprintf(stderr, "-P only applies to -C\n");
+		exit(1);
+	}
+	if (capture_spec && ! capture_open(capture_spec, capture_payloads)) {
+		exit(1);
+	}
+	client_port = listen_port;
+	if (book_port) {
+		self_node = MASTER_NODE;
+	} else if (book_master_name) {
+		char host[256];
+		const char * colon = strrchr(book_master_name, ':');
+		if (! colon || colon == book_master_name || colon - book_master_name >= (int) sizeof(host)) {
+			fprintf(stderr, "-S needs host:port\n");
+			exit(1);
+		}
+		memcpy(host, book_master_name, colon - book_master_name);
+		host[colon - book_master_name] = 0;
+		// [::1]:9135
+		char * h = host;
+		if (h[0] == '[' && h[strlen(h) - 1] == ']') {
+			h[strlen(h) - 1] = 0;
+			++h;
+		}
+		addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family   = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		addrinfo * ai_res;
+		int r = getaddrinfo(h, colon + 1, &hints, &ai_res);
+		if (r) {
+			fprintf(stderr, "getaddrinfo(%s): %s\n", book_master_name, gai_strerror(r));
+			exit(1);
+		}
+		memcpy(&book_master_addr, ai_res->ai_addr, ai_res->ai_addrlen);
+		book_master_addrlen = ai_res->ai_addrlen;
+		freeaddrinfo(ai_res);
+	}
 
-							buf_head += in_msg_size + 4;
-							continue; // -> next message from this fd_ctx
-						}
+	workers = new worker[nworkers];
+	memset(uid_owner, 0xff, sizeof(uid_owner));
 
-						// in decay mode we always drop, because we expect our
-						// caches and refcounts to be inconsistent
-						// we can decay without bookkeeping if we never send any packets
-						// out (== we never expect a context to exists unless epoll still
-						// knows about it)
-						if (! decay_mode) {
-							int uid = ntohs(h->destuid);
-
-							fd_ctx * peer = ctxp->peers.find(uid);
-
-							if (unlikely(! peer)) {
-								fd_ctx_finder.faf_uid = uid;
-								peer_sockets_t::iterator iter = peer_sockets.find(&fd_ctx_finder);
-								if (iter != peer_sockets.end()) {
-									peer = *iter;
-									ctxp->peers.add(peer);
-								} else {
-									buf_head += in_msg_size + 4;
-									continue;
-								}
-							}
-							
-							int in_port = ntohs(h->port);
-							proxy_msg_header_to_peer * hout = (proxy_msg_header_to_peer *) (buf_head + OUT_HEADER_OFFSET_ADJ);
-							hout->port = htons(in_port);
-							const int out_size = in_msg_size - OUT_HEADER_OFFSET_ADJ;
-							hout->size = htonl(out_size);
-							
-							{
-								int n = write(peer->fd, (char *) hout, out_size + 4);
-								if (unlikely(n < 0)) {
-									if (errno != ECONNRESET && errno != EPIPE) {
-										VPERROR("write");
-									}
-								} else if (unlikely(n != out_size + 4)) {
-									fprintf(stderr, "short write (%d of %d\n", n, out_size + 4);
-								}
-							}
-						}
-						buf_head += in_msg_size + 4;
-					}
-					if (likely(postprocess)) {
-						int new_buflen = ctxp->buf + ctxp->buf_len - buf_head;
+	for (int i = 0; i < nworkers; ++i) {
+		worker & w = workers[i];
+		w.id = i;
+		if (! pin_cpus.empty()) {
+			w.cpu = pin_cpus[i % pin_cpus.size()];
+		}
+		w.epoll = epoll_create(1024);
+		if (w.epoll < 0) {
+			VPERROR("epoll_create"); exit(1);
+		}
+		if (nworkers > 1) {
+			void * memp;
+			if (posix_memalign(&memp, 4096, nworkers * sizeof(xthread_queue))) {
+				fprintf(stderr, "out of memory\n");
+				exit(1);
+			}
+			memset(memp, 0, nworkers * sizeof(xthread_queue));
+			w.inbound = (xthread_queue *) memp;
+			w.wake_ctx.fd = eventfd(0, EFD_NONBLOCK);
+			if (w.wake_ctx.fd < 0) {
+				VPERROR("eventfd"); exit(1);
+			}
+			poll_in(w.epoll, &w.wake_ctx);
+		}
+	}
 
-						if (unlikely(new_buflen && ctxp->buf != buf_head)) {
-							for (char * p = ctxp->buf; buf_head < ctxp->buf + ctxp->buf_len; ++p, ++buf_head) {
-								*p = *buf_head;
-							}
-						}
-						ctxp->buf_len = new_buflen;
-					}
-					// we want to get rid of clients as soon as possible and
-					// dont wait for them to send the next message to trigger it
-					if (unlikely(decay_mode && ctxp->buf_len == 0)) {
-						send_fd(ctrl_socket_conn.fd, epoll, ctxp);
-						if (ctxp->faf_uid != -1) {
-							peer_sockets.erase(ctxp);
-						}
+	worker & w0 = workers[0];
+	w0.ctrl_socket_path = ctrl_socket_path;
+
+	if (ctrl_socket_path) {
+		int s = socket(PF_UNIX, SOCK_SEQPACKET, 0);
+		if (s < 0) {
+			VPERROR("socket(AF_UNIX)");
+			exit(1);
+		}
+		struct sockaddr_un sun;
+		sun.sun_family = AF_UNIX;
+		strncpy(sun.sun_path, ctrl_socket_path, sizeof(sun.sun_path));
+
+		if (connect(s, (sockaddr *) &sun, sizeof(sun))) {
+			if (errno == ECONNREFUSED || errno == ENOENT) {
+				if (errno == ECONNREFUSED) {
+					if (unlink(ctrl_socket_path) < 0) {
+						fprintf(stderr, "unlink(%s): %s\n", ctrl_socket_path, strerror(errno));
+						exit(1);
 					}
 				}
+				ctrl_socket_listen(s, ctrl_socket_path);
+				w0.ctrl_socket.fd = s;
+				poll_in(w0.epoll, &w0.ctrl_socket);
+				w0.ctrl_socket_mode_listen = true;
+			} else {
+				fprintf(stderr, "connect(%s): %s\n", ctrl_socket_path, strerror(errno));
+			}
+		} else {
+			char buf[16];
+			ssize_t n = send(s, "unlisten", sizeof("unlisten") - 1, 0);
+			if (n < 0) {
+				VPERROR("sendmsg");
+				exit(1);
+			} else if (n == 0) {
+				fprintf(stderr, "unexpected EOF\n");
+				exit(1);
+			}
+
+			// blocking read
+			n = recv(s, buf, sizeof(buf), 0);
+			if (strncmp(buf, "unlistening", strlen("unlistening")) != 0) {
+				fprintf(stderr, "running server reported: ");
+				fwrite(buf, n, 1, stderr);
+				exit(1);
 			}
+			w0.ctrl_socket_conn.fd = s;
+			poll_in(w0.epoll, &w0.ctrl_socket_conn);
 		}
 	}
-	if (decay_mode && ctrl_socket_path) {
-		close(ctrl_socket.fd);
-		unlink(ctrl_socket_path);
-		if (write(ctrl_socket_conn.fd, "exit", strlen("exit")) < 0) {
-			VPERROR("send");
+
+	for (int i = 0; i < nworkers; ++i) {
+		open_listeners(workers[i], listen_port);
+		for (int j = 0; j < workers[i].server_sockets.size(); ++j) {
+			poll_in(workers[i].epoll, workers[i].server_sockets[j]);
+		}
+		// not counted in total_sockets, we still exit once the last tcp client is gone
+		if (udp_port) {
+			open_udp(workers[i]);
+			poll_in(workers[i].epoll, workers[i].udp_socket);
+		}
+	}
+	if (book_port) {
+		open_side_listener(w0, book_port, PROTO_BOOK);
+	}
+	if (metrics_port) {
+		open_side_listener(w0, metrics_port, PROTO_METRICS);
+	}
+
+	devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if (devnull < 0) {
+		VPERROR("open(/dev/null)"); exit(1);
+	}
+	signal(SIGUSR1, sigusr1);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (int i = 1; i < nworkers; ++i) {
+		if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i])) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
 		}
 	}
-	fprintf(stderr, "exit due to %d sockets left to serve\n", total_sockets);
+	w0.run();
+	for (int i = 1; i < nworkers; ++i) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	capture_close();
 	exit(0);
 }
@@ -0,0 +1,377 @@
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include <vector>
+#include <string>
+#include <algorithm>
+
+// plays a capture log of proxyserver -C (or the Qt server's -capture)
+// back against either server. every uid of the log gets a connection of
+// its own, each frame is sent from the connection of its sender at the
+// time it was captured, divided by the speed factor.
+
+struct proxy_msg_header {
+	uint32_t size;
+	uint16_t port;
+	uint16_t destuid;
+} __attribute__ ((packed));
+
+struct proxy_msg_header_set_uid {
+	uint32_t size;
+	uint16_t uid;
+} __attribute__ ((packed));
+
+// see proxyserver -C
+#define CAPTURE_MAGIC    "nofatcap"
+#define CAPTURE_VERSION  1
+#define CAPTURE_PAYLOADS 1
+#define CAPTURE_BLOCK    (1 << 20)
+#define CTRL_UID 0
+#define MULTICAST_UID 0xffff
+
+struct capture_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint64_t start_ns;
+	uint64_t reserved;
+};
+
+struct capture_record {
+	uint32_t reclen;
+	uint32_t size;
+	uint64_t ts_ns;
+	uint16_t srcuid;
+	uint16_t destuid;
+	uint16_t port;
+	uint16_t reserved;
+	uint32_t caplen;
+	uint32_t reserved2;
+};
+
+struct replay_client {
+	int fd;
+	uint16_t uid;
+	// bytes the socket did not take yet
+	std::string out;
+	std::string in;
+};
+
+uint64_t now_ns() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void set_nonblocking(int fd) {
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// false if the connection is broken
+bool replay_write(int epoll, replay_client & c, const char * p, int len) {
+	if (c.out.empty()) {
+		int n = write(c.fd, p, len);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EINTR) return false;
+			n = 0;
+		}
+		if (n == len) return true;
+		p += n;
+		len -= n;
+		epoll_event ev;
+		ev.events  = EPOLLIN | EPOLLOUT;
+		ev.data.ptr = &c;
+		epoll_ctl(epoll, EPOLL_CTL_MOD, c.fd, &ev);
+	}
+	c.out.append(p, len);
+	return true;
+}
+
+// the records in the order they were captured. workers fill blocks of
+// their own, so the file is only ordered within a block
+bool load_records(const char * base, size_t len, std::vector<const capture_record *> & records) {
+	const uint64_t first = sizeof(capture_header);
+	uint64_t off = first;
+	while (off + sizeof(capture_record) <= len) {
+		const capture_record * r = (const capture_record *) (base + off);
+		if (r->reclen == 0) {
+			// the unused end of a block, or the end of the log
+			if ((off - first) % CAPTURE_BLOCK == 0) break;
+			off = first + ((off - first) / CAPTURE_BLOCK + 1) * CAPTURE_BLOCK;
+			continue;
+		}
+		if (r->reclen < sizeof(*r) || r->caplen > r->size || sizeof(*r) + r->caplen > r->reclen || off + r->reclen > len) {
+			fprintf(stderr, "broken record at %llu\n", (unsigned long long) off);
+			return false;
+		}
+		records.push_back(r);
+		off += r->reclen;
+	}
+	return true;
+}
+
+bool by_time(const capture_record * a, const capture_record * b) {
+	return a->ts_ns < b->ts_ns;
+}
+
+void usage(const char * argv0) {
+	fprintf(stderr,
+			"%s [-p port] [-a address] [-s speed] [-l loops] capture-file\n"
+			"default: -p 9134 -a 127.0.0.1 -s 1 -l 1, -s 0 sends as fast as the server takes it\n"
+			"use -p 9124 to run against the Qt server\n", argv0);
+}
+
+int main(int argc, char ** argv) {
+	int port = 9134;
+	const char * address = "127.0.0.1";
+	double speed = 1;
+	int loops = 1;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "p:a:s:l:h")) != EOF) {
+		switch (opt) {
+		case 'p' : port = atoi(optarg); break;
+		case 'a' : address = optarg; break;
+		case 's' : speed = atof(optarg); break;
+		case 'l' : loops = atoi(optarg); break;
+		default :
+			usage(argv[0]);
+			exit(opt == 'h' ? 0 : 1);
+		}
+	}
+	if (optind + 1 != argc || speed < 0 || loops < 1) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	const char * path = argv[optind];
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		exit(1);
+	}
+	if (st.st_size < (off_t) sizeof(capture_header)) {
+		fprintf(stderr, "%s: not a capture log\n", path);
+		exit(1);
+	}
+	const char * base = (const char *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	const capture_header * ch = (const capture_header *) base;
+	if (memcmp(ch->magic, CAPTURE_MAGIC, sizeof(ch->magic)) != 0 || ch->version != CAPTURE_VERSION) {
+		fprintf(stderr, "%s: not a capture log of version %d\n", path, CAPTURE_VERSION);
+		exit(1);
+	}
+
+	std::vector<const capture_record *> records;
+	if (! load_records(base, st.st_size, records)) {
+		exit(1);
+	}
+	if (records.empty()) {
+		fprintf(stderr, "%s: no frames\n", path);
+		exit(1);
+	}
+	std::stable_sort(records.begin(), records.end(), by_time);
+
+	// every uid that sent or was sent to, the members of a multicast too
+	std::vector<int> slot(65536, -1);
+	std::vector<uint16_t> uids;
+	for (size_t i = 0; i < records.size(); ++i) {
+		const capture_record * r = records[i];
+		const uint8_t * p = (const uint8_t *) (r + 1);
+		std::vector<uint16_t> seen;
+		seen.push_back(r->srcuid);
+		if (r->destuid == MULTICAST_UID) {
+			for (int j = 0; r->caplen > 0 && j < p[0] && 1 + 2 * j + 2 <= (int) r->caplen; ++j) {
+				uint16_t u;
+				memcpy(&u, p + 1 + 2 * j, 2);
+				seen.push_back(ntohs(u));
+			}
+		} else {
+			seen.push_back(r->destuid);
+		}
+		for (size_t j = 0; j < seen.size(); ++j) {
+			if (seen[j] != CTRL_UID && seen[j] != MULTICAST_UID && slot[seen[j]] < 0) {
+				slot[seen[j]] = uids.size();
+				uids.push_back(seen[j]);
+			}
+		}
+	}
+
+	rlimit rl;
+	const rlim_t nfiles = (rlim_t) uids.size() + 16;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < nfiles) {
+		rl.rlim_cur = std::min(rl.rlim_max, nfiles);
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	int epoll = epoll_create(1024);
+	std::vector<replay_client> clients(uids.size());
+	sockaddr_in sin;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = inet_addr(address);
+	sin.sin_port = htons(port);
+
+	for (size_t i = 0; i < clients.size(); ++i) {
+		replay_client & c = clients[i];
+		c.uid = uids[i];
+		c.fd = socket(PF_INET, SOCK_STREAM, 0);
+		if (c.fd < 0) {
+			perror("socket");
+			exit(1);
+		}
+		if (connect(c.fd, (sockaddr *) &sin, sizeof(sin))) {
+			perror("connect");
+			exit(1);
+		}
+		int on = 1;
+		setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		proxy_msg_header_set_uid su;
+		su.size = htonl(2);
+		su.uid  = htons(c.uid);
+		if (write(c.fd, &su, sizeof(su)) != sizeof(su)) {
+			perror("write");
+			exit(1);
+		}
+		set_nonblocking(c.fd);
+		epoll_event ev;
+		ev.events   = EPOLLIN;
+		ev.data.ptr = &c;
+		epoll_ctl(epoll, EPOLL_CTL_ADD, c.fd, &ev);
+	}
+	// give the server a moment to register every uid
+	usleep(500000);
+
+	const uint64_t span = records.back()->ts_ns - records.front()->ts_ns;
+	uint64_t sent = 0, bytes_sent = 0, received = 0, bytes_received = 0, broken = 0;
+	uint64_t lag_sum = 0, lag_max = 0;
+	std::vector<char> frame;
+	char buf[65536];
+	epoll_event events[256];
+
+	const uint64_t start = now_ns();
+	size_t next = 0;
+	int loop = 0;
+	uint64_t deadline = 0, send_end = 0;
+	while (true) {
+		const uint64_t now = now_ns();
+		const bool sending = loop < loops;
+		if (! sending && now >= deadline) break;
+
+		// frames that are due, later ones wait for their time. at full
+		// speed a sender with a backlog holds up the frames behind it, and
+		// every so many frames the sockets are read
+		for (int batch = 0; sending && next < records.size() && batch < 1024; ++batch) {
+			const capture_record * r = records[next];
+			const uint64_t offset = r->ts_ns - records.front()->ts_ns + (uint64_t) loop * (span + 1000000);
+			const uint64_t due = speed > 0 ? start + (uint64_t) (offset / speed) : now;
+			replay_client & c = clients[slot[r->srcuid]];
+			if (due > now || (speed == 0 && ! c.out.empty())) break;
+			++next;
+			lag_sum += now - due;
+			lag_max = std::max(lag_max, now - due);
+
+			if (c.fd < 0) continue;
+			// what was not captured is sent as zeros
+			frame.assign(sizeof(proxy_msg_header) + r->size, 0);
+			proxy_msg_header * h = (proxy_msg_header *) &frame[0];
+			h->size    = htonl(sizeof(*h) - 4 + r->size);
+			h->port    = htons(r->port);
+			h->destuid = htons(r->destuid);
+			memcpy(&frame[sizeof(*h)], r + 1, r->caplen);
+			if (! replay_write(epoll, c, &frame[0], frame.size())) {
+				close(c.fd);
+				c.fd = -1;
+				++broken;
+				continue;
+			}
+			++sent;
+			bytes_sent += frame.size();
+		}
+		if (sending && next == records.size()) {
+			next = 0;
+			if (++loop == loops) {
+				// only what is still in flight from here on
+				send_end = now;
+				deadline = now + 2000000000ull;
+			}
+		}
+
+		int timeout = 0;
+		if (sending && next < records.size() && speed > 0) {
+			const uint64_t offset = records[next]->ts_ns - records.front()->ts_ns + (uint64_t) loop * (span + 1000000);
+			const uint64_t due = start + (uint64_t) (offset / speed);
+			timeout = due > now ? (int) std::min<uint64_t>((due - now) / 1000000, 100) : 0;
+		} else if (! sending) {
+			timeout = 100;
+		}
+		int n = epoll_wait(epoll, events, 256, timeout);
+		for (int e = 0; e < n; ++e) {
+			replay_client & c = * (replay_client *) events[e].data.ptr;
+			if (c.fd < 0) continue;
+			if (events[e].events & EPOLLOUT) {
+				int w = write(c.fd, c.out.data(), c.out.size());
+				if (w > 0) c.out.erase(0, w);
+				if (c.out.empty()) {
+					epoll_event ev;
+					ev.events   = EPOLLIN;
+					ev.data.ptr = &c;
+					epoll_ctl(epoll, EPOLL_CTL_MOD, c.fd, &ev);
+				}
+			}
+			if (! (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) continue;
+			int r = read(c.fd, buf, sizeof(buf));
+			if (r <= 0) {
+				if (r < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+				close(c.fd);
+				c.fd = -1;
+				++broken;
+				continue;
+			}
+			c.in.append(buf, r);
+			size_t off = 0;
+			while (c.in.size() - off >= 4) {
+				uint32_t sz;
+				memcpy(&sz, c.in.data() + off, 4);
+				sz = ntohl(sz);
+				if (c.in.size() - off < 4 + sz) break;
+				bytes_received += 4 + sz;
+				++received;
+				off += 4 + sz;
+			}
+			c.in.erase(0, off);
+		}
+	}
+	const double secs = std::max(send_end - start, (uint64_t) 1) / 1e9;
+
+	char pace[32];
+	if (speed > 0) {
+		snprintf(pace, sizeof(pace), "%gx", speed);
+	} else {
+		snprintf(pace, sizeof(pace), "full speed");
+	}
+	printf("%llu frames from %zu uids over %.3f s, played %d times at %s against %s:%d\n",
+		   (unsigned long long) records.size(), uids.size(), span / 1e9, loops, pace, address, port);
+	printf("sent %llu frames %llu bytes, received %llu frames %llu bytes, broken connections %llu\n",
+		   (unsigned long long) sent, (unsigned long long) bytes_sent,
+		   (unsigned long long) received, (unsigned long long) bytes_received, (unsigned long long) broken);
+	printf("throughput %.0f frames/s %.2f MB/s sent, behind schedule avg %.0f us max %.0f us\n",
+		   sent / secs, bytes_sent / secs / 1e6, sent ? lag_sum / 1e3 / sent : 0.0, lag_max / 1e3);
+	return broken ? 2 : 0;
+}
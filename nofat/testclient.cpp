@@ -7,6 +7,15 @@
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <math.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+
+#include <vector>
+#include <string>
 
 struct proxy_msg_header {
 	uint32_t size;
@@ -24,8 +33,472 @@ struct proxy_msg_header_to_peer {
 	uint16_t port;
 } __attribute__ ((packed));
 
+// see proxyserver -U
+#define CTRL_UID 0
+#define CTRL_UDP_REGISTER 1
+
+struct udp_msg_header {
+	uint32_t token;
+	uint16_t srcuid;
+	uint16_t port;
+	uint16_t destuid;
+} __attribute__ ((packed));
+
+
+// benchmark mode, everything below up to main()
+//
+// one process, one epoll loop, any number of clients. clients are
+// grouped into games and every message goes to a random other player
+// of the same game. the payload is a QByteArray QVariant, so the Qt
+// server can parse and forward it as well, and carries the time it was
+// sent. latencies are measured from that in the same process.
+
+#define QVARIANT_BYTEARRAY 12
+// QVariant type, null flag and QByteArray length in front of our data
+#define QVARIANT_HEADER 9
+
+struct bench_payload {
+	uint64_t sent_ns;
+	uint32_t seq;
+	uint16_t srcuid;
+} __attribute__ ((packed));
+
+uint64_t now_ns() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// microsecond latencies, exact below 32us, 16 buckets per power of two
+// above, up to 2^36us
+#define HIST_LINEAR  32
+#define HIST_BUCKETS (HIST_LINEAR + 32 * 16)
+
+struct histogram {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t total;
+	uint64_t max;
+
+	static int bucket(uint64_t us) {
+		if (us < HIST_LINEAR) return us;
+		int e = 63 - __builtin_clzll(us);
+		return HIST_LINEAR + (e - 5) * 16 + ((us >> (e - 4)) & 15);
+	}
+	static uint64_t lower(int b) {
+		if (b < HIST_LINEAR) return b;
+		int e = (b - HIST_LINEAR) / 16 + 5;
+		return (uint64_t) (16 + (b - HIST_LINEAR) % 16) << (e - 4);
+	}
+	void add(uint64_t us) {
+		++counts[std::min(bucket(us), HIST_BUCKETS - 1)];
+		++total;
+		if (us > max) max = us;
+	}
+	// upper edge of the bucket holding the q quantile
+	uint64_t quantile(double q) const {
+		uint64_t want = (uint64_t) ceil(q * total), cum = 0;
+		for (int b = 0; b < HIST_BUCKETS; ++b) {
+			cum += counts[b];
+			if (cum >= want && cum) return std::min(lower(b + 1) - 1, max);
+		}
+		return max;
+	}
+	histogram() : total(0), max(0) { memset(counts, 0, sizeof(counts)); }
+};
+
+struct bench_client {
+	int fd;
+	uint16_t uid;
+	int game_first;
+	int game_size;
+	uint64_t next_send;
+	uint32_t seq;
+	// bytes the socket did not take yet
+	std::string out;
+	std::string in;
+	// -U: connected udp socket and the token registered for it
+	int udp_fd;
+	uint32_t token;
+};
+
+struct size_dist {
+	// fixed, uniform between min and max, or exponential around mean
+	enum { FIXED, UNIFORM, EXP } kind;
+	int min, max, mean;
+
+	bool parse(const char * s) {
+		if (strncmp(s, "exp:", 4) == 0) {
+			kind = EXP;
+			mean = atoi(s + 4);
+			min  = 0;
+			max  = mean * 8;
+		} else if (strchr(s, '-')) {
+			kind = UNIFORM;
+			if (sscanf(s, "%d-%d", &min, &max) != 2) return false;
+		} else {
+			kind = FIXED;
+			min = max = atoi(s);
+		}
+		return min >= 0 && max >= min && max <= 60000;
+	}
+	int pick() const {
+		switch (kind) {
+		case UNIFORM:
+			return min + rand() % (max - min + 1);
+		case EXP: {
+			int n = (int) (-log((rand() + 1.0) / (RAND_MAX + 2.0)) * mean);
+			return std::min(n, max);
+		}
+		default:
+			return min;
+		}
+	}
+};
+
+void set_nonblocking(int fd) {
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// false if the connection is broken
+bool bench_write(int epoll, bench_client & c, const char * p, int len) {
+	if (c.out.empty()) {
+		int n = write(c.fd, p, len);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EINTR) return false;
+			n = 0;
+		}
+		if (n == len) return true;
+		p += n;
+		len -= n;
+		epoll_event ev;
+		ev.events  = EPOLLIN | EPOLLOUT;
+		ev.data.ptr = &c;
+		epoll_ctl(epoll, EPOLL_CTL_MOD, c.fd, &ev);
+	}
+	c.out.append(p, len);
+	return true;
+}
+
+void bench_usage(const char * argv0) {
+	fprintf(stderr,
+			"%s -b [-p port] [-a address] [-c clients] [-g players per game] [-r msgs/s per client]\n"
+			"      [-s size|min-max|exp:mean] [-d seconds] [-u first uid] [-U udp port]\n"
+			"default: -p 9134 -a 127.0.0.1 -c 1000 -g 8 -r 10 -s 16-256 -d 10 -u 1000\n"
+			"use -p 9124 to run against the Qt server\n", argv0);
+}
+
+int bench_main(int argc, char ** argv) {
+	int port = 9134;
+	const char * address = "127.0.0.1";
+	int nclients = 1000;
+	int game_size = 8;
+	double rate = 10;
+	size_dist sizes;
+	sizes.parse("16-256");
+	int duration = 10;
+	int first_uid = 1000;
+	int udp_port = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "bp:a:c:g:r:s:d:u:U:h")) != EOF) {
+		switch (opt) {
+		case 'b' : break;
+		case 'p' : port = atoi(optarg); break;
+		case 'a' : address = optarg; break;
+		case 'c' : nclients = atoi(optarg); break;
+		case 'g' : game_size = atoi(optarg); break;
+		case 'r' : rate = atof(optarg); break;
+		case 's' :
+			if (! sizes.parse(optarg)) {
+				fprintf(stderr, "bad size distribution %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'd' : duration = atoi(optarg); break;
+		case 'u' : first_uid = atoi(optarg); break;
+		case 'U' : udp_port = atoi(optarg); break;
+		default :
+			bench_usage(argv[0]);
+			exit(opt == 'h' ? 0 : 1);
+		}
+	}
+	// uid 1 is the echo test mode of the Qt server
+	if (nclients < 1 || game_size < 1 || rate <= 0 || first_uid < 2 || first_uid + nclients > 65536) {
+		bench_usage(argv[0]);
+		exit(1);
+	}
+
+	rlimit rl;
+	const rlim_t nfiles = (rlim_t) nclients * (udp_port ? 2 : 1) + 16;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < nfiles) {
+		rl.rlim_cur = std::min(rl.rlim_max, nfiles);
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	int epoll = epoll_create(1024);
+	std::vector<bench_client> clients(nclients);
+	sockaddr_in sin;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = inet_addr(address);
+	sin.sin_port = htons(port);
+	sockaddr_in usin = sin;
+	usin.sin_port = htons(udp_port);
+
+	// the udp sockets are polled through an epoll of their own that sits
+	// in the main one with a NULL ptr
+	int udp_epoll = -1;
+	if (udp_port) {
+		udp_epoll = epoll_create(1024);
+		epoll_event ev;
+		ev.events   = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(epoll, EPOLL_CTL_ADD, udp_epoll, &ev);
+	}
+
+	for (int i = 0; i < nclients; ++i) {
+		bench_client & c = clients[i];
+		c.fd = socket(PF_INET, SOCK_STREAM, 0);
+		if (c.fd < 0) {
+			perror("socket");
+			exit(1);
+		}
+		if (connect(c.fd, (sockaddr *) &sin, sizeof(sin))) {
+			perror("connect");
+			exit(1);
+		}
+		int on = 1;
+		setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		set_nonblocking(c.fd);
+		c.uid = first_uid + i;
+		c.game_first = i - i % game_size;
+		c.game_size = std::min(game_size, nclients - c.game_first);
+		c.seq = 0;
+
+		proxy_msg_header_set_uid su;
+		su.size = htonl(2);
+		su.uid  = htons(c.uid);
+		if (write(c.fd, &su, sizeof(su)) != sizeof(su)) {
+			perror("write");
+			exit(1);
+		}
+		epoll_event ev;
+		ev.events   = EPOLLIN;
+		ev.data.ptr = &c;
+		epoll_ctl(epoll, EPOLL_CTL_ADD, c.fd, &ev);
+
+		c.udp_fd = -1;
+		if (udp_port) {
+			c.udp_fd = socket(PF_INET, SOCK_DGRAM, 0);
+			if (c.udp_fd < 0 || connect(c.udp_fd, (sockaddr *) &usin, sizeof(usin))) {
+				perror("udp socket");
+				exit(1);
+			}
+			set_nonblocking(c.udp_fd);
+			epoll_ctl(udp_epoll, EPOLL_CTL_ADD, c.udp_fd, &ev);
+
+			c.token = (uint32_t) rand() | 1;
+			struct {
+				proxy_msg_header h;
+				uint32_t token;
+			} __attribute__ ((packed)) reg;
+			reg.h.size    = htonl(sizeof(reg) - 4);
+			reg.h.port    = htons(CTRL_UDP_REGISTER);
+			reg.h.destuid = htons(CTRL_UID);
+			reg.token     = c.token;
+			if (write(c.fd, &reg, sizeof(reg)) != sizeof(reg)) {
+				perror("write");
+				exit(1);
+			}
+		}
+	}
+	// give the server a moment to register every uid
+	usleep(500000);
+	// tell the proxy where our datagrams come from before anyone sends to us
+	if (udp_port) {
+		for (int i = 0; i < nclients; ++i) {
+			udp_msg_header uh;
+			uh.token   = clients[i].token;
+			uh.srcuid  = htons(clients[i].uid);
+			uh.port    = 0;
+			uh.destuid = htons(CTRL_UID);
+			if (send(clients[i].udp_fd, &uh, sizeof(uh), 0) < 0) {
+				perror("send");
+			}
+		}
+		usleep(100000);
+	}
+
+	const uint64_t interval = (uint64_t) (1e9 / rate);
+	const uint64_t start = now_ns();
+	const uint64_t stop  = start + (uint64_t) duration * 1000000000ull;
+	for (int i = 0; i < nclients; ++i) {
+		clients[i].next_send = start + (uint64_t) rand() % interval;
+	}
+
+	histogram hist;
+	uint64_t sent = 0, received = 0, bytes_received = 0, broken = 0;
+	char buf[65536 + 64];
+	char dgram[sizeof(udp_msg_header) + sizeof(buf)];
+	epoll_event events[256];
+
+	// after stop we only wait for what is still in flight
+	uint64_t deadline = stop + 2000000000ull;
+	while (true) {
+		uint64_t now = now_ns();
+		if (now >= deadline || (now >= stop && received == sent)) break;
+
+		if (now < stop) {
+			for (int i = 0; i < nclients; ++i) {
+				bench_client & c = clients[i];
+				while (c.fd >= 0 && c.next_send <= now) {
+					c.next_send += interval;
+					const int dest = c.game_size > 1 ?
+						c.game_first + (i - c.game_first + 1 + rand() % (c.game_size - 1)) % c.game_size : i;
+					const int len = std::max((int) sizeof(bench_payload), sizes.pick());
+
+					proxy_msg_header * h = (proxy_msg_header *) buf;
+					char * q = buf + sizeof(*h);
+					uint32_t v = htonl(QVARIANT_BYTEARRAY);
+					memcpy(q, &v, 4);
+					q[4] = 0;
+					v = htonl(len);
+					memcpy(q + 5, &v, 4);
+					bench_payload bp;
+					bp.seq     = c.seq++;
+					bp.srcuid  = c.uid;
+					bp.sent_ns = now_ns();
+					memcpy(q + QVARIANT_HEADER, &bp, sizeof(bp));
+					memset(q + QVARIANT_HEADER + sizeof(bp), 0x5a, len - sizeof(bp));
+					if (udp_port) {
+						// the same payload behind the datagram header
+						udp_msg_header * uh = (udp_msg_header *) dgram;
+						uh->token   = c.token;
+						uh->srcuid  = htons(c.uid);
+						uh->port    = htons(0);
+						uh->destuid = htons(clients[dest].uid);
+						memcpy(dgram + sizeof(*uh), q, QVARIANT_HEADER + len);
+						if (send(c.udp_fd, dgram, sizeof(*uh) + QVARIANT_HEADER + len, 0) < 0 && errno != EAGAIN) {
+							perror("send");
+						}
+						++sent;
+						continue;
+					}
+					h->size    = htonl(sizeof(*h) - 4 + QVARIANT_HEADER + len);
+					h->port    = htons(0);
+					h->destuid = htons(clients[dest].uid);
+					if (! bench_write(epoll, c, buf, sizeof(*h) + QVARIANT_HEADER + len)) {
+						close(c.fd);
+						c.fd = -1;
+						++broken;
+						break;
+					}
+					++sent;
+				}
+			}
+		}
+
+		uint64_t next = now >= stop ? now + 1000000 : stop;
+		for (int i = 0; i < nclients && now < stop; ++i) {
+			if (clients[i].fd >= 0 && clients[i].next_send < next) next = clients[i].next_send;
+		}
+		int timeout = next > now ? (int) ((next - now) / 1000000) : 0;
+		int n = epoll_wait(epoll, events, 256, timeout);
+		for (int e = 0; e < n; ++e) {
+			if (! events[e].data.ptr) {
+				const uint64_t t = now_ns();
+				epoll_event uevents[256];
+				int un = epoll_wait(udp_epoll, uevents, 256, 0);
+				for (int u = 0; u < un; ++u) {
+					bench_client & c = * (bench_client *) uevents[u].data.ptr;
+					int r;
+					// [port] + payload
+					while ((r = recv(c.udp_fd, buf, sizeof(buf), 0)) > 0) {
+						if (r >= (int) (sizeof(uint16_t) + QVARIANT_HEADER + sizeof(bench_payload))) {
+							bench_payload bp;
+							memcpy(&bp, buf + sizeof(uint16_t) + QVARIANT_HEADER, sizeof(bp));
+							hist.add((t - bp.sent_ns) / 1000);
+							bytes_received += r;
+							++received;
+						}
+					}
+				}
+				continue;
+			}
+			bench_client & c = * (bench_client *) events[e].data.ptr;
+			if (c.fd < 0) continue;
+			if (events[e].events & EPOLLOUT) {
+				int w = write(c.fd, c.out.data(), c.out.size());
+				if (w > 0) c.out.erase(0, w);
+				if (c.out.empty()) {
+					epoll_event ev;
+					ev.events   = EPOLLIN;
+					ev.data.ptr = &c;
+					epoll_ctl(epoll, EPOLL_CTL_MOD, c.fd, &ev);
+				}
+			}
+			if (! (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) continue;
+			int r = read(c.fd, buf, sizeof(buf));
+			if (r <= 0) {
+				if (r < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+				close(c.fd);
+				c.fd = -1;
+				++broken;
+				continue;
+			}
+			const uint64_t t = now_ns();
+			c.in.append(buf, r);
+			size_t off = 0;
+			while (c.in.size() - off >= sizeof(proxy_msg_header_to_peer)) {
+				uint32_t sz;
+				memcpy(&sz, c.in.data() + off, 4);
+				sz = ntohl(sz);
+				if (c.in.size() - off < 4 + sz) break;
+				if (sz >= 2 + QVARIANT_HEADER + sizeof(bench_payload)) {
+					bench_payload bp;
+					memcpy(&bp, c.in.data() + off + sizeof(proxy_msg_header_to_peer) + QVARIANT_HEADER, sizeof(bp));
+					hist.add((t - bp.sent_ns) / 1000);
+					bytes_received += 4 + sz;
+					++received;
+				}
+				off += 4 + sz;
+			}
+			c.in.erase(0, off);
+		}
+	}
+	const double secs = (std::min(now_ns(), stop) - start) / 1e9;
+
+	printf("clients %d, games of %d, %.1f msgs/s each, size %s, %d s against %s:%d\n",
+		   nclients, game_size, rate,
+		   sizes.kind == size_dist::FIXED ? "fixed" : sizes.kind == size_dist::UNIFORM ? "uniform" : "exp",
+		   duration, address, port);
+	printf("sent %llu received %llu lost %llu broken connections %llu\n",
+		   (unsigned long long) sent, (unsigned long long) received,
+		   (unsigned long long) (sent - std::min(sent, received)), (unsigned long long) broken);
+	printf("throughput %.0f msgs/s %.2f MB/s\n", received / secs, bytes_received / secs / 1e6);
+	printf("latency us p50 %llu p99 %llu p999 %llu max %llu\n",
+		   (unsigned long long) hist.quantile(0.5), (unsigned long long) hist.quantile(0.99),
+		   (unsigned long long) hist.quantile(0.999), (unsigned long long) hist.max);
+
+	// one line per power of two
+	uint64_t cum = 0;
+	for (int b = 0; b < HIST_BUCKETS; ) {
+		const uint64_t lo = histogram::lower(b);
+		const uint64_t hi = lo < 1 ? 1 : lo * 2;
+		uint64_t count = hist.counts[b++];
+		for (; b < HIST_BUCKETS && histogram::lower(b) < hi; ++b) count += hist.counts[b];
+		if (! count) continue;
+		cum += count;
+		printf("  %8llu - %8llu us %10llu %6.2f%% %7.3f%%\n", (unsigned long long) lo, (unsigned long long) hi - 1,
+			   (unsigned long long) count, 100.0 * count / hist.total, 100.0 * cum / hist.total);
+	}
+	return sent == received ? 0 : 2;
+}
 
 int main(int argc, char ** argv) {
+	if (argc > 1 && argv[1][0] == '-') {
+		return bench_main(argc, argv);
+	}
 	int uid = 3;
 
 	for (int i = 0; i < atoi(argv[1]); ++i) {
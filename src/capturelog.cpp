@@ -0,0 +1,129 @@
+#include "capturelog.h"
+
+#include <QDateTime>
+#include <QThreadStorage>
+#include <QDebug>
+
+#include <string.h>
+
+#include "metrics.h"
+
+namespace
+{
+    // nofat/proxyserver.cpp, capture_header and capture_record. host byte
+    // order, the proxy headers of a packet are left out
+    struct FileHeader
+    {
+        char magic[8];
+        quint32 version;
+        quint32 flags;
+        // wall clock when the capture started, record times count from there
+        quint64 startNs;
+        quint64 reserved;
+    };
+
+    struct Record
+    {
+        // 8 byte aligned, header and captured bytes
+        quint32 reclen;
+        // bytes of the packet behind {size, port, destuid}
+        quint32 size;
+        quint64 tsNs;
+        quint16 srcUid;
+        quint16 destUid;
+        quint16 port;
+        quint16 reserved;
+        quint32 caplen;
+        quint32 reserved2;
+    };
+
+    QThreadStorage<CaptureLog::Writer*> writers;
+}
+
+CaptureLog *CaptureLog::log = 0;
+
+CaptureLog::CaptureLog() :
+    base(0), size(0), blocks(0), payloads(false), startUs(0)
+{
+}
+
+bool CaptureLog::open(const QString &path, int megabytes, bool payloads)
+{
+    CaptureLog *c = new CaptureLog;
+    c->file.setFileName(path);
+    c->size = (qint64)megabytes << 20;
+    if (megabytes < 1 || !c->file.open(QIODevice::ReadWrite | QIODevice::Truncate) ||
+        !c->file.resize(c->size) || !(c->base = c->file.map(0, c->size)))
+    {
+        qDebug() << "capture" << path << "failed:" << c->file.errorString();
+        delete c;
+        return false;
+    }
+
+    FileHeader *h = (FileHeader *)c->base;
+    memcpy(h->magic, "nofatcap", sizeof(h->magic));
+    h->version = Version;
+    h->flags = payloads ? Payloads : 0;
+    h->startNs = (quint64)QDateTime::currentMSecsSinceEpoch() * 1000000;
+    c->payloads = payloads;
+    c->startUs = Metrics::nowUs();
+    log = c;
+    return true;
+}
+
+CaptureLog::Writer *CaptureLog::writer()
+{
+    if (!log)
+        return 0;
+    if (!writers.hasLocalData())
+        writers.setLocalData(new Writer);
+    return writers.localData();
+}
+
+CaptureLog::Writer::Writer() :
+    pos(0), end(0)
+{
+}
+
+bool CaptureLog::Writer::append(quint16 srcUid, quint16 destUid, quint16 port, const PacketSlice &packet)
+{
+    int caplen = 0;
+    if (log->payloads)
+        caplen = packet.size;
+    else if (destUid == MULTICAST_UID && packet.size > 0)
+        caplen = qMin(packet.size, 1 + 2 * (uchar)packet.data()[0]);
+    const quint32 reclen = (sizeof(Record) + caplen + 7) & ~7;
+
+    if (pos + reclen > end)
+    {
+        // the rest of this block stays zero, readers skip it
+        const int count = (reclen + BlockSize - 1) / BlockSize;
+        // a full log is only read from then on, the count never wraps
+        qint64 first = (int)log->blocks;
+        if ((qint64)sizeof(FileHeader) + (first + count) * BlockSize <= log->size)
+            first = log->blocks.fetchAndAddRelaxed(count);
+        const qint64 offset = (qint64)sizeof(FileHeader) + first * BlockSize;
+        if (offset + (qint64)count * BlockSize > log->size)
+        {
+            pos = end = 0;
+            return false;
+        }
+        pos = log->base + offset;
+        end = pos + count * BlockSize;
+    }
+
+    Record *r = (Record *)pos;
+    r->size = packet.size;
+    r->tsNs = (Metrics::nowUs() - log->startUs) * 1000;
+    r->srcUid = srcUid;
+    r->destUid = destUid;
+    r->port = port;
+    r->reserved = 0;
+    r->caplen = caplen;
+    r->reserved2 = 0;
+    memcpy(r + 1, packet.data(), caplen);
+    // a reader of a running capture may still miss the newest records
+    r->reclen = reclen;
+    pos += reclen;
+    return true;
+}
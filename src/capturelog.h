@@ -0,0 +1,55 @@
+#ifndef CAPTURELOG_H
+#define CAPTURELOG_H
+
+#include <QFile>
+#include <QAtomicInt>
+
+#include "packetslice.h"
+
+// -capture: the packets clients send, appended to a memory mapped file in
+// the format of nofat's proxyserver -C, so that nofat/replay plays them
+// back against either server. every thread fills 1MB blocks of its own,
+// taking a block is the only atomic operation, a packet is a memcpy into
+// the mapping. the length of a record is written last, one of length 0
+// means the rest of the block is unused, a block starting with one the end
+// of the log. the file keeps its full size, it is sparse.
+class CaptureLog
+{
+public:
+    enum { Version = 1, BlockSize = 1 << 20, Payloads = 1 };
+
+    // before the workers start. with payloads the packets themselves go
+    // into the log, otherwise only the uid list of a multicast
+    static bool open(const QString &path, int megabytes, bool payloads);
+
+    // what the connections of one thread write through
+    class Writer
+    {
+    public:
+        Writer();
+        // false if the log is full
+        bool append(quint16 srcUid, quint16 destUid, quint16 port, const PacketSlice &packet);
+
+    private:
+        uchar *pos;
+        uchar *end;
+    };
+
+    // the writer of the calling thread, 0 without -capture
+    static Writer *writer();
+
+private:
+    CaptureLog();
+
+    QFile file;
+    uchar *base;
+    qint64 size;
+    // blocks taken so far
+    QAtomicInt blocks;
+    bool payloads;
+    qint64 startUs;
+
+    static CaptureLog *log;
+};
+
+#endif // CAPTURELOG_H
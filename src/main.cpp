@@ -1,7 +1,14 @@
 #include <QtCore/QCoreApplication>
 #include <QStringList>
+#include <QThread>
 
 #include "proxyserver.h"
+#include "proxyconnection.h"
+#include "metricsserver.h"
+#include "metrics.h"
+#include "capturelog.h"
+#include "peerconnection.h"
+#include "masterserver.h"
 
 
 int main(int argc, char *argv[])
@@ -10,6 +17,12 @@ int main(int argc, char *argv[])
 
     Server server;
 
+    int threads = QThread::idealThreadCount();
+    int metricsPort = 0;
+    QString capturePath;
+    int captureSize = 1024;
+    bool capturePayloads = false;
+
     QStringList args = a.arguments();
     for (int i = 0; i < args.size(); ++i)
         if (QString(args.at(i)) == QString("-slave"))
@@ -20,6 +33,88 @@ int main(int argc, char *argv[])
                 qDebug("start as slave");
 
         }
+        else if (QString(args.at(i)) == QString("-threads"))
+        {
+            i++;
+            threads = QString(args.at(i)).toInt();
+        }
+        else if (QString(args.at(i)) == QString("-relaystreams"))
+        {
+            i++;
+            server.setRelayStreams(QString(args.at(i)).toInt());
+        }
+        else if (QString(args.at(i)) == QString("-metrics"))
+        {
+            i++;
+            metricsPort = QString(args.at(i)).toInt();
+        }
+        else if (QString(args.at(i)) == QString("-idle"))
+        {
+            i++;
+            ProxyConnection::idleTimeout = QString(args.at(i)).toInt() * 1000;
+        }
+        else if (QString(args.at(i)) == QString("-ratelimit"))
+        {
+            // packets per second, then optionally bytes per second
+            i++;
+            ProxyConnection::rateFrames = QString(args.at(i)).toInt();
+            if (i + 1 < args.size() && !args.at(i + 1).startsWith("-"))
+            {
+                i++;
+                ProxyConnection::rateBytes = QString(args.at(i)).toInt();
+            }
+        }
+        else if (QString(args.at(i)) == QString("-quantum"))
+        {
+            i++;
+            ProxyConnection::quantum = QString(args.at(i)).toInt();
+        }
+        else if (QString(args.at(i)) == QString("-capture"))
+        {
+            // path, then optionally megabytes
+            i++;
+            capturePath = args.at(i);
+            if (i + 1 < args.size() && !args.at(i + 1).startsWith("-"))
+            {
+                i++;
+                captureSize = QString(args.at(i)).toInt();
+            }
+        }
+        else if (QString(args.at(i)) == QString("-coalesce"))
+        {
+            i++;
+            PeerConnection::coalesceUs = QString(args.at(i)).toInt();
+        }
+        else if (QString(args.at(i)) == QString("-compress"))
+        {
+#ifdef HAVE_LZ4
+            PeerConnection::compress = true;
+#else
+            qDebug("-compress needs a build with CONFIG+=lz4, ignored");
+#endif
+        }
+        else if (QString(args.at(i)) == QString("-peerbook"))
+        {
+            // the master keeps its peer book there over restarts
+            i++;
+            masterserver::peerBookPath = args.at(i);
+        }
+        else if (QString(args.at(i)) == QString("-payloads"))
+            capturePayloads = true;
+        else if (QString(args.at(i)) == QString("-stats"))
+        {
+            i++;
+            server.setStatsInterval(QString(args.at(i)).toInt());
+        }
+        else if (QString(args.at(i)) == QString("-verbose"))
+            verboseLogging = true;
+
+    if (!capturePath.isEmpty() && !CaptureLog::open(capturePath, captureSize, capturePayloads))
+        return 1;
+
+    server.startWorkers(qMax(1, threads));
+    if (metricsPort > 0)
+        new MetricsServer(metricsPort, &server);
 
     if(!server.isSlave())
         server.setMaster();
@@ -1,10 +1,12 @@
 #include "masterconnection.h"
+#include "metrics.h"
 
 MasterConnection::MasterConnection(int socketDescriptor, QObject *parent) :
-    QTcpSocket(parent)
+    QTcpSocket(parent), pingTimer(this, "ping")
 {
 
     blocksize = 0;
+    synced = false;
 
     if (this->setSocketDescriptor(socketDescriptor))
         qDebug("socket set");
@@ -23,21 +25,31 @@ MasterConnection::MasterConnection(int socketDescriptor, QObject *parent) :
 
     connect(this, SIGNAL(addPeer(quint16,QHostAddress,bool)), this->parent(), SLOT(addPeer(quint16,QHostAddress,bool)));
     connect(this, SIGNAL(removePeer(quint16,QHostAddress,bool)), this->parent(), SLOT(removePeer(quint16,QHostAddress,bool)));
+    connect(this, SIGNAL(syncRequested(MasterConnection*,quint32,quint32)), this->parent(), SLOT(syncSlave(MasterConnection*,quint32,quint32)));
+    connect(this, SIGNAL(loadReported(QHostAddress,quint32)), this->parent(), SLOT(setLoad(QHostAddress,quint32)));
+    connect(this, SIGNAL(placementRequested(MasterConnection*,quint32,QVector<quint16>)), this->parent(), SLOT(placeForSlave(MasterConnection*,quint32,QVector<quint16>)));
 
 
 
     emit addSlave(this);
 
-    pingTimer = new QTimer(this);
-
-    connect(pingTimer, SIGNAL(timeout()), this, SLOT(ping()));
-    pingTimer->start(60000);
+    lastActive = TimerWheel::current()->now();
+    TimerWheel::current()->start(&pingTimer, PING_INTERVAL);
 
 }
 
 
 void MasterConnection::ping()
 {
+    TimerWheel *wheel = TimerWheel::current();
+    if (wheel->now() - lastActive >= TimerWheel::ticksFor(PING_TIMEOUT))
+    {
+        qDebug() << "Slave" << peerAddress().toString() << "stopped answering";
+        abort();
+        return;
+    }
+    wheel->start(&pingTimer, PING_INTERVAL);
+
     QList<QVariant> data;
     data << QString("PING");
     send(data);
@@ -46,10 +58,12 @@ void MasterConnection::ping()
 
 void MasterConnection::readData()
 {
-    QDataStream ins(this);
-    ins.setVersion(QDataStream::Qt_4_2);
+    lastActive = TimerWheel::current()->now();
+
+    QDataStream in(this);
+    in.setVersion(QDataStream::Qt_4_2);
 
-    while (ins.atEnd() == false)
+    while (in.atEnd() == false)
     {
         if (blocksize == 0)
         {
@@ -57,18 +71,30 @@ void MasterConnection::readData()
                 return;
 
 
-            ins >> (quint32&) blocksize;
+            in >> (quint32&) blocksize;
 
         }
         if (this->bytesAvailable() < blocksize)
             return;
 
-        // readData
+        // every command is parsed from its own frame, one the master does
+        // not know or reads short can not shift the rest of the stream
+        const QByteArray body = read(blocksize);
+        blocksize = 0;
+        QDataStream ins(body);
+        ins.setVersion(QDataStream::Qt_4_2);
+
         QVariant command;
         ins >> command;
 
         if(command == "PONG")
-            qDebug() << "pong!";
+        {
+            // number of client connections on the slave
+            QVariant load;
+            ins >> load;
+            qVerbose() << "pong!" << load;
+            emit loadReported(this->peerAddress(), load.toUInt());
+        }
         else if(command == "ADD_PEER")
         {
             // We should send to all slaves the info...
@@ -83,8 +109,27 @@ void MasterConnection::readData()
             ins >> uid;
             emit removePeer(uid.toInt(), this->peerAddress(), false);
         }
-
-        blocksize = 0;
+        else if (command == "SYNC")
+        {
+            // epoch and sequence of the last peer book state the slave has
+            QVariant epoch;
+            QVariant sequence;
+            ins >> epoch;
+            ins >> sequence;
+            emit syncRequested(this, epoch.toUInt(), sequence.toUInt());
+        }
+        else if (command == "REQUEST_SERVER")
+        {
+            // request id and the uids of the game, answered with SERVER_PLACED
+            QVariant request;
+            QVariant list;
+            ins >> request;
+            ins >> list;
+            QVector<quint16> uids;
+            foreach (const QVariant &uid, list.toList())
+                uids.append(uid.toUInt());
+            emit placementRequested(this, request.toUInt(), uids);
+        }
     }
 
 }
@@ -103,14 +148,18 @@ void MasterConnection::send(QList<QVariant> packet)
     stream.device()->seek(0);
     stream <<(quint32)(reply.size() - sizeof(quint32));
 
-    if (this->write(reply) == -1)
+    sendFrame(reply);
+}
+
+void MasterConnection::sendFrame(const QByteArray &frame)
+{
+    if (this->write(frame) == -1)
         this->abort();
 }
 
 void MasterConnection::disconnection()
 {
     emit removeSlave(this->peerAddress());
-    pingTimer->stop();
-    pingTimer->deleteLater();
+    TimerWheel::stop(&pingTimer);
     deleteLater();
 }
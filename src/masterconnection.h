@@ -2,9 +2,16 @@
 #define MASTERCONNECTION_H
 
 #include <QObject>
-#include <QTimer>
 #include <QtNetwork/QTcpSocket>
 #include <QtNetwork/QHostAddress>
+#include <QVector>
+
+#include "timerwheel.h"
+
+// the slaves answer every PING with their load, one that stayed silent
+// for PING_TIMEOUT is gone
+#define PING_INTERVAL 10000
+#define PING_TIMEOUT (3 * PING_INTERVAL)
 
 class MasterConnection : public QTcpSocket
 {
@@ -12,10 +19,19 @@ class MasterConnection : public QTcpSocket
 public:
     explicit MasterConnection(int socketDescriptor, QObject *parent = 0);
     void send(QList<QVariant>);
+    // an already serialized frame, size prefix included
+    void sendFrame(const QByteArray &frame);
+
+    // peer book deltas go out only once the slave asked for its sync
+    bool isSynced() const { return synced; }
+    void setSynced(bool value) { synced = value; }
 
 private:
     quint32 blocksize;
-    QTimer* pingTimer;
+    TimerWheel::Timer pingTimer;
+    // TimerWheel ticks of the last frame from the slave
+    quint64 lastActive;
+    bool synced;
 
 
 signals:
@@ -23,6 +39,9 @@ signals:
     void removeSlave(QHostAddress address);
     void addPeer(quint16 uid, QHostAddress address, bool local);
     void removePeer(quint16 uid, QHostAddress address, bool local);
+    void syncRequested(MasterConnection *socket, quint32 epoch, quint32 sequence);
+    void loadReported(QHostAddress address, quint32 load);
+    void placementRequested(MasterConnection *socket, quint32 request, const QVector<quint16> &uids);
 
 public slots:
     void ping();
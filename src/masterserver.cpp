@@ -1,5 +1,28 @@
 #include "masterserver.h"
+#include "metrics.h"
 
+#include <QDateTime>
+#include <QTime>
+
+// adds grouped by server: quint16 groups, each a QString address ("" for
+// the master) followed by quint16 count and the uids
+static void writeGroups(QDataStream &stream, const QHash<quint16, QHostAddress> &peers)
+{
+    QHash<QHostAddress, QList<quint16> > groups;
+    for (QHash<quint16, QHostAddress>::const_iterator it = peers.constBegin(); it != peers.constEnd(); ++it)
+        groups[it.value()].append(it.key());
+
+    stream << (quint16)groups.size();
+    for (QHash<QHostAddress, QList<quint16> >::const_iterator it = groups.constBegin(); it != groups.constEnd(); ++it)
+    {
+        stream << (it.key().isNull() ? QString() : it.key().toString());
+        stream << (quint16)it.value().size();
+        foreach (quint16 uid, it.value())
+            stream << uid;
+    }
+}
+
+QString masterserver::peerBookPath;
 
 masterserver::masterserver(QObject* parent): QTcpServer(parent)
 {
@@ -8,8 +31,67 @@ masterserver::masterserver(QObject* parent): QTcpServer(parent)
     else
         qDebug() << "Master Server listening to" << this->serverAddress().toString() << "on port" << this->serverPort();
 
+    sequence = 0;
+    epoch = QDateTime::currentDateTime().toTime_t();
+    localLoad = 0;
+
+    deltaTimer = new QTimer(this);
+    deltaTimer->setSingleShot(true);
+    deltaTimer->setInterval(DELTA_INTERVAL);
+    connect(deltaTimer, SIGNAL(timeout()), this, SLOT(flushDelta()));
+
     connect(this, SIGNAL(addPeerBook(quint16,QHostAddress)), this->parent(), SLOT(addPeerBook(quint16,QHostAddress)));
     connect(this, SIGNAL(removePeerBook(quint16)), this->parent(), SLOT(removePeerBook(quint16)));
+
+    if (!peerBookPath.isEmpty() && bookFile.open(peerBookPath))
+        loadBook();
+}
+
+// the book of the master that ran before us with the same file, along
+// with its epoch and sequence, so that slaves still synced to it only need
+// what changed since. without one the file starts over at our epoch.
+void masterserver::loadBook()
+{
+    if (!bookFile.loaded())
+    {
+        bookFile.setEpoch(epoch);
+        bookFile.setSequence(sequence);
+        return;
+    }
+
+    QTime elapsed;
+    elapsed.start();
+    epoch = bookFile.epoch();
+    sequence = bookFile.sequence();
+    // it stopped before the last changes went out as a delta, a slave
+    // at sequence gets the snapshot instead
+    if (bookFile.dirty())
+        bookFile.setSequence(++sequence);
+    bookFile.read(book);
+
+    int dropped = 0;
+    QHash<quint16, QHostAddress>::iterator it = book.begin();
+    while (it != book.end())
+    {
+        if (it.value().isNull())
+        {
+            // our own clients went away with the old process
+            bookFile.remove(it.key());
+            pendingRemoves.insert(it.key());
+            it = book.erase(it);
+            ++dropped;
+        }
+        else
+        {
+            emit addPeerBook(it.key(), it.value());
+            ++it;
+        }
+    }
+    if (!pendingRemoves.isEmpty())
+        queueDelta();
+
+    qDebug() << "Peer book of" << book.size() << "peers at" << sequence << "of epoch" << epoch << "loaded from"
+             << peerBookPath << "in" << elapsed.elapsed() << "ms," << dropped << "of our own dropped";
 }
 
 void masterserver::incomingConnection( int socketDescriptor )
@@ -28,28 +110,23 @@ void masterserver::removeSlave(QHostAddress address)
 {
     qDebug() << "Removing slave" << address.toString();
     slaves.remove(address);
+    load.remove(address);
 }
 
+// a local peer is connected to our own proxy, its address is left null
 void masterserver::addPeer(quint16 uid, QHostAddress address, bool local = false)
 {
     // Another server has a new peer connected, we make every slave aware of it.
 
-    qDebug() << "Adding peer" << uid << "on server" << address.toString();
+    qVerbose() << "Adding peer" << uid << "on server" << address.toString();
 
-    //form the packet
-    QList<QVariant> data;
-    data << QString("ADD_TO_PEERBOOK");
-    data << uid;
-    data << address.toString();
+    book.insert(uid, address);
+    bookFile.insert(uid, address);
+
+    pendingRemoves.remove(uid);
+    pendingAdds.insert(uid, address);
+    queueDelta();
 
-    foreach (MasterConnection* conn, slaves)
-    {
-        if (conn->peerAddress() != address)
-        {
-            qDebug() << "Sending add peer to" << conn->peerAddress() << "on port" << conn->peerPort();
-            conn->send(data);
-        }
-    }
     // And of course to our own proxy
     if(!local)
         emit addPeerBook(uid, address);
@@ -57,24 +134,166 @@ void masterserver::addPeer(quint16 uid, QHostAddress address, bool local = false
 
 void masterserver::removePeer(quint16 uid, QHostAddress address, bool local = false)
 {
+    // the uid already connected again somewhere else, that server's add
+    // came in before this remove and wins
+    if (!book.contains(uid) || book.value(uid) != address)
+    {
+        qVerbose() << "Ignoring stale remove of peer" << uid << "from" << address.toString();
+        return;
+    }
+
     // Another server has a peer disconnection, we make every slave aware of it.
-    qDebug() << "Removing peer" << uid << "for slaves";
+    qVerbose() << "Removing peer" << uid << "for slaves";
 
-    //form the packet
-    QList<QVariant> data;
-    data << QString("REMOVE_FROM_PEERBOOK");
-    data << uid;
+    book.remove(uid);
+    bookFile.remove(uid);
 
-    foreach (MasterConnection* conn, slaves)
+    pendingAdds.remove(uid);
+    pendingRemoves.insert(uid);
+    queueDelta();
+
+    // And of course to our own proxy
+    if(!local)
+        emit removePeerBook(uid);
+}
+
+void masterserver::setLoad(QHostAddress address, quint32 clients)
+{
+    load.insert(address, clients);
+}
+
+// the server with most of the game's peers already, on a tie or for a
+// new game the one with the fewest clients. the client is counted there
+// right away so that a burst of requests does not pile up on one server
+// until the next PONG.
+QHostAddress masterserver::place(const QVector<quint16> &uids)
+{
+    QHash<QHostAddress, int> peers;
+    for (int i = 0; i < uids.size(); ++i)
+        if (book.contains(uids.at(i)))
+            peers[book.value(uids.at(i))]++;
+
+    QHostAddress best;
+    int bestPeers = peers.value(QHostAddress());
+    quint32 bestLoad = localLoad ? (int)*localLoad : 0;
+    for (QHash<QHostAddress, MasterConnection*>::const_iterator it = slaves.constBegin(); it != slaves.constEnd(); ++it)
     {
-        if (conn->peerAddress() != address)
+        const int n = peers.value(it.key());
+        const quint32 l = load.value(it.key());
+        if (n > bestPeers || (n == bestPeers && l < bestLoad))
         {
-            qDebug() << "Sending remove peer to" << conn->peerAddress() << "on port" << conn->peerPort();
-            conn->send(data);
+            best = it.key();
+            bestPeers = n;
+            bestLoad = l;
         }
+    }
+
+    if (!best.isNull())
+        load[best]++;
+    qVerbose() << "Placing game of" << uids.size() << "uids on" << (best.isNull() ? QString("master") : best.toString())
+               << "with" << bestPeers << "of them";
+    return best;
+}
+
+void masterserver::placeForSlave(MasterConnection *socket, quint32 request, const QVector<quint16> &uids)
+{
+    QHostAddress where = place(uids);
+
+    QList<QVariant> data;
+    data << QString("SERVER_PLACED");
+    data << request;
+    data << (where.isNull() ? QString() : where.toString());
+    socket->send(data);
+}
+
+void masterserver::queueDelta()
+{
+    if (pendingAdds.size() + pendingRemoves.size() >= DELTA_MAX_ENTRIES)
+        flushDelta();
+    else if (!deltaTimer->isActive())
+        deltaTimer->start();
+}
+
+// PEERBOOK_DELTA, quint32 sequence, the adds grouped by server, then
+// quint16 count and the removed uids.
+void masterserver::flushDelta()
+{
+    deltaTimer->stop();
+
+    if (pendingAdds.isEmpty() && pendingRemoves.isEmpty())
+        return;
+
+    QByteArray frame;
+    QDataStream stream(&frame, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_4_2);
+
+    stream << (quint32)0;
+    stream << QVariant(QString("PEERBOOK_DELTA"));
+    stream << (quint32)++sequence;
+
+    writeGroups(stream, pendingAdds);
+
+    stream << (quint16)pendingRemoves.size();
+    foreach (quint16 uid, pendingRemoves)
+        stream << uid;
 
+    stream.device()->seek(0);
+    stream <<(quint32)(frame.size() - sizeof(quint32));
+
+    bookFile.setSequence(sequence);
+
+    qVerbose() << "Sending peer book delta" << sequence << "with" << pendingAdds.size() << "adds and"
+             << pendingRemoves.size() << "removes to" << slaves.size() << "slaves";
+
+    // slaves still waiting for their sync get this one replayed
+    foreach (MasterConnection* conn, slaves)
+        if (conn->isSynced())
+            conn->sendFrame(frame);
+
+    history.append(frame);
+    if (history.size() > DELTA_HISTORY)
+        history.removeFirst();
+
+    pendingAdds.clear();
+    pendingRemoves.clear();
+}
+
+// a slave (re)connected and applied everything up to slaveSequence of
+// slaveEpoch. it gets the deltas it missed if we still have them, the
+// whole book otherwise, and the live deltas from then on.
+void masterserver::syncSlave(MasterConnection *socket, quint32 slaveEpoch, quint32 slaveSequence)
+{
+    // the book has to match sequence, nothing may be left pending
+    flushDelta();
+
+    const quint32 first = sequence - history.size() + 1;
+    if (slaveEpoch == epoch && slaveSequence <= sequence && slaveSequence + 1 >= first)
+    {
+        qDebug() << "Resyncing slave" << socket->peerAddress().toString() << "with"
+                 << sequence - slaveSequence << "deltas from" << slaveSequence + 1;
+        for (int i = slaveSequence + 1 - first; i < history.size(); ++i)
+            socket->sendFrame(history.at(i));
     }
-    // And of course to our own proxy
-    if(!local)
-        emit removePeerBook(uid);
+    else
+    {
+        // PEERBOOK_SNAPSHOT, quint32 epoch, quint32 sequence, the whole book
+        // grouped by server
+        QByteArray frame;
+        QDataStream stream(&frame, QIODevice::WriteOnly);
+        stream.setVersion(QDataStream::Qt_4_2);
+
+        stream << (quint32)0;
+        stream << QVariant(QString("PEERBOOK_SNAPSHOT"));
+        stream << epoch << sequence;
+        writeGroups(stream, book);
+
+        stream.device()->seek(0);
+        stream <<(quint32)(frame.size() - sizeof(quint32));
+
+        qDebug() << "Sending peer book snapshot of" << book.size() << "peers at" << sequence
+                 << "to slave" << socket->peerAddress().toString();
+        socket->sendFrame(frame);
+    }
+
+    socket->setSynced(true);
 }
@@ -3,7 +3,20 @@
 
 
 #include <QtNetwork/QTcpServer>
+#include <QTimer>
+#include <QSet>
+#include <QAtomicInt>
 #include "masterconnection.h"
+#include "peerbookfile.h"
+
+// peer book updates going out to the slaves are coalesced per uid and
+// sent as one PEERBOOK_DELTA frame every DELTA_INTERVAL ms or every
+// DELTA_MAX_ENTRIES entries, serialized once for all slaves.
+#define DELTA_INTERVAL 10
+#define DELTA_MAX_ENTRIES 256
+// deltas kept for slaves that come back after a short disconnect, older
+// ones get a full PEERBOOK_SNAPSHOT instead
+#define DELTA_HISTORY 1024
 
 class masterserver : public QTcpServer
 {
@@ -11,9 +24,39 @@ class masterserver : public QTcpServer
 public:
     explicit masterserver(QObject *parent = 0);
 
+    // -peerbook, empty to keep the book in memory only
+    static QString peerBookPath;
+
 private:
     QHash<QHostAddress, MasterConnection*> slaves;
 
+    // where every known uid is connected, a null address is ourselves
+    QHash<quint16, QHostAddress> book;
+
+    QHash<quint16, QHostAddress> pendingAdds;
+    QSet<quint16> pendingRemoves;
+    quint32 sequence;
+    QTimer* deltaTimer;
+    // tells slaves a restarted master from the one they were synced with
+    quint32 epoch;
+    // the last frames sent, history.last() has sequence
+    QList<QByteArray> history;
+    // book, epoch and sequence as of the last delta, kept over restarts
+    PeerBookFile bookFile;
+
+    void queueDelta();
+    void loadBook();
+
+    // client connections per slave from their PONGs, plus what we placed
+    // there since
+    QHash<QHostAddress, quint32> load;
+    const QAtomicInt *localLoad;
+
+public:
+    void setLocalLoad(const QAtomicInt *clients) { localLoad = clients; }
+    // where a client for a game with uids should connect, null for us
+    QHostAddress place(const QVector<quint16> &uids);
+
 
 signals:
     void newConnection(MasterConnection *connection);
@@ -29,6 +72,10 @@ public slots:
     void removeSlave(QHostAddress address);
     void addPeer(quint16 uid, QHostAddress address, bool local);
     void removePeer(quint16 uid, QHostAddress address, bool local);
+    void flushDelta();
+    void syncSlave(MasterConnection* socket, quint32 slaveEpoch, quint32 slaveSequence);
+    void setLoad(QHostAddress address, quint32 clients);
+    void placeForSlave(MasterConnection* socket, quint32 request, const QVector<quint16> &uids);
 
 };
 
@@ -0,0 +1,40 @@
+#include "metrics.h"
+
+#include <QElapsedTimer>
+
+#include <string.h>
+
+bool verboseLogging = false;
+
+namespace
+{
+    // started before main, nsecsElapsed is fine from any thread after that
+    struct Uptime
+    {
+        QElapsedTimer timer;
+        Uptime() { timer.start(); }
+    };
+    Uptime uptime;
+}
+
+Metrics::Metrics()
+{
+    memset(this, 0, sizeof(*this));
+}
+
+// count packets that waited us microseconds, all of one batch wait as
+// long as the first of them
+void Metrics::observe(qint64 us, int count)
+{
+    int bucket = 0;
+    while (bucket < LatencyBuckets && us >= (Q_INT64_C(1) << bucket))
+        ++bucket;
+    latency[bucket] += count;
+    latencySum += us * count;
+    latencyCount += count;
+}
+
+qint64 Metrics::nowUs()
+{
+    return uptime.timer.nsecsElapsed() / 1000;
+}
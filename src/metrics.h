@@ -0,0 +1,49 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <QtGlobal>
+#include <QDebug>
+
+// set with -verbose. logging per packet or per peer goes through qVerbose
+// and costs a branch when it is off.
+extern bool verboseLogging;
+#define qVerbose if (!verboseLogging) {} else qDebug
+
+// counters of one thread. only that thread writes them, so they are plain
+// integers without atomics, the padding keeps them off the cache lines of
+// their neighbours. the metrics server reads them as they are.
+struct Metrics
+{
+    // log2 microsecond buckets, the last one is everything above
+    enum { LatencyBuckets = 16 };
+
+    Metrics();
+
+    void observe(qint64 us, int count);
+    // microseconds on a monotonic clock shared by all threads
+    static qint64 nowUs();
+
+    char before[64];
+    quint64 packetsForwarded;
+    quint64 bytesForwarded;
+    quint64 packetsRelayed;
+    quint64 bytesRelayed;
+    quint64 peerHits;
+    quint64 peerMisses;
+    quint64 unknownUid;
+    quint64 writeErrors;
+    quint64 crossThread;
+    quint64 handshakeTimeouts;
+    quint64 idleTimeouts;
+    quint64 rateLimited;
+    quint64 rateLimitedBytes;
+    quint64 quantumYields;
+    quint64 captured;
+    quint64 captureDrops;
+    quint64 latency[LatencyBuckets + 1];
+    quint64 latencySum;
+    quint64 latencyCount;
+    char after[64];
+};
+
+#endif // METRICS_H
@@ -0,0 +1,176 @@
+#include "metricsserver.h"
+
+#include "proxyserver.h"
+#include "proxyworker.h"
+#include "metrics.h"
+
+namespace
+{
+    struct Counter
+    {
+        const char *name;
+        const char *help;
+        quint64 Metrics::*field;
+    };
+
+    const Counter counters[] = {
+        { "proxy_packets_forwarded_total", "Packets written to client connections.", &Metrics::packetsForwarded },
+        { "proxy_bytes_forwarded_total", "Payload bytes written to client connections.", &Metrics::bytesForwarded },
+        { "proxy_packets_relayed_total", "Packets sent on to another relay server.", &Metrics::packetsRelayed },
+        { "proxy_bytes_relayed_total", "Payload bytes sent on to another relay server.", &Metrics::bytesRelayed },
+        { "proxy_peer_hits_total", "Destinations found among the connections of the same thread.", &Metrics::peerHits },
+        { "proxy_peer_misses_total", "Destinations not connected to the same thread.", &Metrics::peerMisses },
+        { "proxy_unknown_uid_total", "Packets dropped for a uid nobody knows.", &Metrics::unknownUid },
+        { "proxy_write_errors_total", "Client connections aborted on a failed write.", &Metrics::writeErrors },
+        { "proxy_cross_thread_total", "Packets taken from the queue of another thread.", &Metrics::crossThread },
+        { "proxy_handshake_timeouts_total", "Client connections closed for not sending SET_UID in time.", &Metrics::handshakeTimeouts },
+        { "proxy_idle_timeouts_total", "Client connections closed for being silent longer than -idle.", &Metrics::idleTimeouts },
+        { "proxy_rate_limited_total", "Packets dropped for being over the budget of their sender.", &Metrics::rateLimited },
+        { "proxy_rate_limited_bytes_total", "Bytes of the packets dropped for being over budget.", &Metrics::rateLimitedBytes },
+        { "proxy_quantum_yields_total", "Reads that left complete frames for a later turn of the event loop.", &Metrics::quantumYields },
+        { "proxy_captured_total", "Packets written to the -capture log.", &Metrics::captured },
+        { "proxy_capture_drops_total", "Packets that did not fit into the -capture log any more.", &Metrics::captureDrops },
+    };
+
+    struct LinkCounter
+    {
+        const char *name;
+        const char *help;
+        quint64 OutboundConnection::Stats::*field;
+    };
+
+    // per relay stream, batch size is packets / batches, the compression
+    // ratio raw / wire bytes
+    const LinkCounter linkCounters[] = {
+        { "proxy_relay_link_packets_total", "Packets sent on the relay stream.", &OutboundConnection::Stats::packets },
+        { "proxy_relay_link_batches_total", "Writes those packets went out in.", &OutboundConnection::Stats::batches },
+        { "proxy_relay_link_held_total", "Batches held back by -coalesce for more packets.", &OutboundConnection::Stats::held },
+        { "proxy_relay_link_raw_bytes_total", "Bytes of the batches before compression.", &OutboundConnection::Stats::rawBytes },
+        { "proxy_relay_link_wire_bytes_total", "Bytes of the batches as written.", &OutboundConnection::Stats::wireBytes },
+        { "proxy_relay_link_compressed_total", "Batches sent as one LZ4 block with -compress.", &OutboundConnection::Stats::packedBatches },
+    };
+
+    void head(QByteArray &out, const char *name, const char *type, const char *help)
+    {
+        out += "# HELP ";
+        out += name;
+        out += ' ';
+        out += help;
+        out += "\n# TYPE ";
+        out += name;
+        out += ' ';
+        out += type;
+        out += '\n';
+    }
+
+    void sample(QByteArray &out, const char *name, const QByteArray &labels, quint64 value)
+    {
+        out += name;
+        out += '{';
+        out += labels;
+        out += "} ";
+        out += QByteArray::number(value);
+        out += '\n';
+    }
+}
+
+MetricsServer::MetricsServer(quint16 port, Server *server) :
+    QTcpServer(server), server(server)
+{
+    if (!listen(QHostAddress::Any, port))
+        qDebug("Unable to start the metrics server");
+    else
+        qDebug() << "Metrics served on port" << serverPort();
+
+    connect(this, SIGNAL(newConnection()), this, SLOT(accept()));
+}
+
+void MetricsServer::accept()
+{
+    while (hasPendingConnections())
+    {
+        QTcpSocket *socket = nextPendingConnection();
+        connect(socket, SIGNAL(readyRead()), this, SLOT(readRequest()));
+        connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+    }
+}
+
+void MetricsServer::readRequest()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket*>(sender());
+    if (!socket)
+        return;
+
+    // whatever is asked for, the answer is the same once the headers are in
+    QByteArray request = socket->peek(socket->bytesAvailable());
+    if (!request.contains("\r\n\r\n") && !request.contains("\n\n"))
+    {
+        if (request.size() > 8192)
+            socket->abort();
+        return;
+    }
+    socket->readAll();
+    disconnect(socket, SIGNAL(readyRead()), this, SLOT(readRequest()));
+
+    QByteArray body = render();
+    QByteArray response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: ";
+    response += QByteArray::number(body.size());
+    response += "\r\nConnection: close\r\n\r\n";
+    response += body;
+
+    socket->write(response);
+    socket->disconnectFromHost();
+}
+
+// the main thread is thread="main", the workers go by their index. the
+// workers keep counting while we read, a scrape may be off by the packets
+// of the moment.
+QByteArray MetricsServer::render()
+{
+    QList<const Metrics*> threads;
+    QList<QByteArray> labels;
+    threads << &server->metrics;
+    labels << "thread=\"main\"";
+    for (int i = 0; i < server->workers.size(); ++i)
+    {
+        threads << &server->workers.at(i)->metrics;
+        labels << "thread=\"" + QByteArray::number(i) + "\"";
+    }
+
+    QByteArray out;
+    for (unsigned c = 0; c < sizeof(counters) / sizeof(counters[0]); ++c)
+    {
+        head(out, counters[c].name, "counter", counters[c].help);
+        for (int t = 0; t < threads.size(); ++t)
+            sample(out, counters[c].name, labels.at(t), threads.at(t)->*counters[c].field);
+    }
+
+    head(out, "proxy_queue_latency_us", "histogram", "Microseconds packets waited in the queue to another thread.");
+    for (int t = 0; t < threads.size(); ++t)
+    {
+        const Metrics *m = threads.at(t);
+        quint64 cumulative = 0;
+        for (int b = 0; b <= Metrics::LatencyBuckets; ++b)
+        {
+            cumulative += m->latency[b];
+            QByteArray le = b < Metrics::LatencyBuckets ? QByteArray::number(Q_INT64_C(1) << b) : QByteArray("+Inf");
+            sample(out, "proxy_queue_latency_us_bucket", labels.at(t) + ",le=\"" + le + "\"", cumulative);
+        }
+        sample(out, "proxy_queue_latency_us_sum", labels.at(t), m->latencySum);
+        sample(out, "proxy_queue_latency_us_count", labels.at(t), m->latencyCount);
+    }
+
+    const QList<const PeerConnection*> links = server->relayLinks();
+    for (unsigned c = 0; c < sizeof(linkCounters) / sizeof(linkCounters[0]); ++c)
+    {
+        head(out, linkCounters[c].name, "counter", linkCounters[c].help);
+        foreach (const PeerConnection *link, links)
+        {
+            const QByteArray label = "link=\"" + link->target().toString().toLatin1() + "\",stream=\"" +
+                QByteArray::number(link->streamIndex()) + "\"";
+            sample(out, linkCounters[c].name, label, link->stats().*linkCounters[c].field);
+        }
+    }
+
+    return out;
+}
@@ -0,0 +1,26 @@
+#ifndef METRICSSERVER_H
+#define METRICSSERVER_H
+
+#include <QtNetwork/QTcpServer>
+#include <QtNetwork/QTcpSocket>
+
+class Server;
+
+// answers any http request with the counters of the proxy and of every
+// worker in the prometheus text format
+class MetricsServer : public QTcpServer
+{
+    Q_OBJECT
+public:
+    explicit MetricsServer(quint16 port, Server *server);
+
+private:
+    Server *server;
+    QByteArray render();
+
+private slots:
+    void accept();
+    void readRequest();
+};
+
+#endif // METRICSSERVER_H
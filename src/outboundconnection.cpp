@@ -0,0 +1,197 @@
+#include "outboundconnection.h"
+
+#include <QDebug>
+
+#include <string.h>
+
+#ifdef Q_OS_LINUX
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+#include "metrics.h"
+
+#define RETRY_MIN_MS 250
+#define RETRY_MAX_MS 30000
+#define QUEUE_MAX_BYTES (1 << 20)
+// written right away instead of at the end of the pass above this
+#define COALESCE_MAX_BYTES (64 << 10)
+
+OutboundConnection::OutboundConnection(const QHostAddress &host, quint16 port, bool persistent, QObject *parent) :
+    QTcpSocket(parent), host(host), port(port), persistent(persistent),
+    coalesceUs(0), batchStart(0), lastWrite(0)
+{
+    established = false;
+    retryDelay = RETRY_MIN_MS;
+    dropped = 0;
+    outgoingPackets = 0;
+    memset(&linkStats, 0, sizeof(linkStats));
+
+    this->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+
+    holdTimer.setSingleShot(true);
+    connect(&holdTimer, SIGNAL(timeout()), this, SLOT(flush()));
+
+    connect(this, SIGNAL(connected()), this, SLOT(onConnected()));
+    connect(this, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(onError(QAbstractSocket::SocketError)));
+    connect(this, SIGNAL(disconnected()), this, SLOT(onDisconnected()));
+
+    connectToHost(host, port);
+}
+
+void OutboundConnection::setCoalescing(int us)
+{
+    coalesceUs = qMax(0, us);
+}
+
+void OutboundConnection::send(const char *header, int headerSize, const char *body, int bodySize)
+{
+    if (established)
+    {
+        if (outgoing.isEmpty())
+        {
+            batchStart = Metrics::nowUs();
+            QMetaObject::invokeMethod(this, "flush", Qt::QueuedConnection);
+        }
+        outgoing.append(header, headerSize);
+        if (bodySize)
+            outgoing.append(body, bodySize);
+        linkStats.packets++;
+        outgoingPackets++;
+        if (outgoing.size() >= COALESCE_MAX_BYTES)
+            flush();
+        return;
+    }
+
+    if (queue.size() + headerSize + bodySize > QUEUE_MAX_BYTES)
+    {
+        if (dropped++ == 0)
+            qDebug() << "queue for" << host.toString() << port << "is full, dropping";
+        return;
+    }
+    queue.append(header, headerSize);
+    if (bodySize)
+        queue.append(body, bodySize);
+}
+
+void OutboundConnection::onConnected()
+{
+    qDebug() << "connected to" << host.toString() << port << "with" << queue.size() << "bytes queued," << dropped << "packets dropped";
+    established = true;
+    retryDelay = RETRY_MIN_MS;
+    dropped = 0;
+
+    if (!queue.isEmpty())
+    {
+        if (this->write(queue) == -1)
+            this->abort();
+        queue.clear();
+    }
+    emit connectionEstablished();
+}
+
+void OutboundConnection::onError(QAbstractSocket::SocketError socketError)
+{
+    // a connection that was up ends in disconnected()
+    if (established)
+        return;
+
+    qDebug() << "connecting to" << host.toString() << port << "failed:" << socketError << "retrying in" << retryDelay << "ms";
+    QTimer::singleShot(retryDelay, this, SLOT(reconnect()));
+    retryDelay = qMin(retryDelay * 2, RETRY_MAX_MS);
+}
+
+void OutboundConnection::onDisconnected()
+{
+    if (!established)
+        return;
+    established = false;
+    holdTimer.stop();
+
+    // the batch that was not flushed yet holds whole frames, a persistent
+    // connection sends them first once it is back. what Qt had taken
+    // already is gone with the socket
+    if (persistent)
+    {
+        qDebug() << "lost" << host.toString() << port << "reconnecting," << outgoingPackets << "unsent packets queued";
+        queue = outgoing;
+        QTimer::singleShot(0, this, SLOT(reconnect()));
+    }
+    else if (!outgoing.isEmpty())
+    {
+        dropped += outgoingPackets;
+        qDebug() << "lost" << host.toString() << port << "with" << outgoingPackets << "unsent packets, dropped";
+    }
+    outgoing.clear();
+    outgoingPackets = 0;
+}
+
+// the end of a pass, the hold timer or a full batch. the event loop only
+// has millisecond timers, a batch is held for the rest of the budget
+// rounded up to one
+void OutboundConnection::flush()
+{
+    if (outgoing.isEmpty())
+        return;
+
+    const qint64 now = Metrics::nowUs();
+    if (coalesceUs > 0 && outgoing.size() < COALESCE_MAX_BYTES &&
+        now - lastWrite < coalesceUs && now - batchStart < coalesceUs)
+    {
+        if (!holdTimer.isActive())
+        {
+            linkStats.held++;
+            holdTimer.start((coalesceUs - (now - batchStart) + 999) / 1000);
+        }
+        return;
+    }
+    holdTimer.stop();
+
+    const QByteArray wire = pack(outgoing);
+    linkStats.batches++;
+    linkStats.rawBytes += outgoing.size();
+    linkStats.wireBytes += wire.size();
+    outgoing.clear();
+    outgoingPackets = 0;
+    lastWrite = now;
+
+    // a batch that was coalesced leaves in full segments, what the
+    // socket does not take now is written by Qt later, uncorked
+    const bool cork = coalesceUs > 0 && wire.size() > 1460;
+    if (cork)
+        setCork(true);
+    if (this->write(wire) == -1)
+    {
+        this->abort();
+        return;
+    }
+    if (cork)
+    {
+        QAbstractSocket::flush();
+        setCork(false);
+    }
+}
+
+QByteArray OutboundConnection::pack(const QByteArray &batch)
+{
+    return batch;
+}
+
+void OutboundConnection::setCork(bool on)
+{
+#if defined(Q_OS_LINUX) && defined(TCP_CORK)
+    int value = on ? 1 : 0;
+    setsockopt(socketDescriptor(), IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+#else
+    Q_UNUSED(on);
+#endif
+}
+
+void OutboundConnection::reconnect()
+{
+    if (state() == QAbstractSocket::ConnectedState)
+        return;
+    abort();
+    connectToHost(host, port);
+}
@@ -0,0 +1,74 @@
+#ifndef OUTBOUNDCONNECTION_H
+#define OUTBOUNDCONNECTION_H
+
+#include <QtNetwork/QTcpSocket>
+#include <QtNetwork/QHostAddress>
+#include <QTimer>
+
+// a connection we open ourselves. connecting never blocks, what is sent
+// before it is up waits in a bounded queue, failed attempts are retried
+// with exponential backoff. a persistent connection also comes back after
+// an established connection went away.
+class OutboundConnection : public QTcpSocket
+{
+    Q_OBJECT
+public:
+    explicit OutboundConnection(const QHostAddress &host, quint16 port, bool persistent, QObject *parent = 0);
+
+    // header and body go out together or, if the queue is full, not at all.
+    // once connected, everything sent in one event loop pass is written at once.
+    void send(const char *header, int headerSize, const char *body = 0, int bodySize = 0);
+    QHostAddress target() const { return host; }
+
+    // a busy connection, one that wrote its last batch less than us
+    // microseconds ago, holds a batch until it is that old. an idle one
+    // writes at the end of the pass as before. 0 never holds
+    void setCoalescing(int us);
+
+    struct Stats
+    {
+        quint64 packets;
+        quint64 batches;
+        // batches that were held back for more
+        quint64 held;
+        // what was sent, and what of it went on the wire after pack()
+        quint64 rawBytes;
+        quint64 wireBytes;
+        quint64 packedBatches;
+    };
+    const Stats &stats() const { return linkStats; }
+
+protected:
+    // the bytes written for a batch, the batch itself unless overridden
+    virtual QByteArray pack(const QByteArray &batch);
+    Stats linkStats;
+
+private:
+    QHostAddress host;
+    quint16 port;
+    bool persistent;
+    bool established;
+    int retryDelay;
+    QByteArray queue;
+    int dropped;
+    QByteArray outgoing;
+    int outgoingPackets;
+    int coalesceUs;
+    qint64 batchStart;
+    qint64 lastWrite;
+    QTimer holdTimer;
+    void setCork(bool on);
+
+private slots:
+    void onConnected();
+    void onError(QAbstractSocket::SocketError socketError);
+    void onDisconnected();
+    void reconnect();
+    void flush();
+
+signals:
+    void connectionEstablished();
+
+};
+
+#endif // OUTBOUNDCONNECTION_H
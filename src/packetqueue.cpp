@@ -0,0 +1,54 @@
+#include "packetqueue.h"
+
+#include <QMetaObject>
+
+#include "metrics.h"
+
+PacketQueue::PacketQueue(QObject *receiver, const char *member) :
+    since(0), receiver(receiver), member(member)
+{
+}
+
+void PacketQueue::post(quint16 uid, quint16 port, const PacketSlice &packet)
+{
+    Entry e;
+    e.uid = uid;
+    e.port = port;
+    e.packet = packet;
+    const qint64 now = Metrics::nowUs();
+
+    lock.lock();
+    // only the first packet of a batch needs to wake the receiver, the
+    // others are picked up by the same take()
+    const bool wake = entries.isEmpty();
+    if (wake)
+        since = now;
+    entries.append(e);
+    lock.unlock();
+
+    if (wake)
+        QMetaObject::invokeMethod(receiver, member, Qt::QueuedConnection);
+}
+
+void PacketQueue::post(const QVector<Entry> &batch)
+{
+    const qint64 now = Metrics::nowUs();
+
+    lock.lock();
+    const bool wake = entries.isEmpty();
+    if (wake)
+        since = now;
+    entries += batch;
+    lock.unlock();
+
+    if (wake)
+        QMetaObject::invokeMethod(receiver, member, Qt::QueuedConnection);
+}
+
+qint64 PacketQueue::take(QVector<Entry> &out)
+{
+    QMutexLocker locker(&lock);
+    out = entries;
+    entries = QVector<Entry>();
+    return since;
+}
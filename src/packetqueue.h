@@ -0,0 +1,40 @@
+#ifndef PACKETQUEUE_H
+#define PACKETQUEUE_H
+
+#include <QObject>
+#include <QMutex>
+#include <QVector>
+
+#include "packetslice.h"
+
+// packets handed to an object on another thread. posting appends under a
+// mutex, the receiver gets one queued call per batch instead of a
+// marshalled signal per packet, the slices themselves are never copied.
+class PacketQueue
+{
+public:
+    struct Entry
+    {
+        quint16 uid;
+        quint16 port;
+        PacketSlice packet;
+    };
+
+    PacketQueue(QObject *receiver, const char *member);
+
+    // any thread
+    void post(quint16 uid, quint16 port, const PacketSlice &packet);
+    void post(const QVector<Entry> &batch);
+    // receiver thread, from the slot named member: everything posted so far.
+    // returns when the oldest of it was posted, in Metrics::nowUs
+    qint64 take(QVector<Entry> &out);
+
+private:
+    QMutex lock;
+    QVector<Entry> entries;
+    qint64 since;
+    QObject *receiver;
+    const char *member;
+};
+
+#endif // PACKETQUEUE_H
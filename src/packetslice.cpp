@@ -0,0 +1,75 @@
+#include "packetslice.h"
+
+#include <string.h>
+
+FrameReader::FrameReader()
+{
+    offset = 0;
+}
+
+void FrameReader::fill(QIODevice *device)
+{
+    const qint64 available = device->bytesAvailable();
+    if (available <= 0)
+        return;
+
+    // a new buffer every time instead of appending, slices handed out
+    // before still share the old one and appending would detach it anyway.
+    // only the start of an incomplete frame gets copied over.
+    const int left = buf.size() - offset;
+    QByteArray next;
+    next.resize(left + available);
+    memcpy(next.data(), buf.constData() + offset, left);
+
+    qint64 n = device->read(next.data() + left, available);
+    if (n < 0)
+        n = 0;
+    next.resize(left + n);
+
+    buf = next;
+    offset = 0;
+}
+
+bool splitMulticast(const PacketSlice &body, QVector<quint16> &uids, PacketSlice &packet)
+{
+    if (body.size < 1)
+        return false;
+    const int count = (uchar)body.data()[0];
+    if (body.size < 1 + count * (int)sizeof(quint16))
+        return false;
+
+    uids.resize(count);
+    for (int i = 0; i < count; ++i)
+        uids[i] = body.peek16(1 + i * sizeof(quint16));
+    packet = body.mid(1 + count * sizeof(quint16));
+    return true;
+}
+
+int FrameReader::pending() const
+{
+    const int left = buf.size() - offset;
+    if (left < (int)sizeof(quint32))
+        return 0;
+
+    const quint32 size = qFromBigEndian<quint32>((const uchar *)buf.constData() + offset);
+    if ((quint32)(left - sizeof(quint32)) < size)
+        return 0;
+    return sizeof(quint32) + size;
+}
+
+bool FrameReader::next(PacketSlice &frame)
+{
+    const int left = buf.size() - offset;
+    if (left < (int)sizeof(quint32))
+        return false;
+
+    const quint32 size = qFromBigEndian<quint32>((const uchar *)buf.constData() + offset);
+    if ((quint32)(left - sizeof(quint32)) < size)
+        return false;
+
+    frame.buf = buf;
+    frame.offset = offset + sizeof(quint32);
+    frame.size = size;
+    offset += sizeof(quint32) + size;
+    return true;
+}
@@ -0,0 +1,68 @@
+#ifndef PACKETSLICE_H
+#define PACKETSLICE_H
+
+#include <QByteArray>
+#include <QIODevice>
+#include <QVector>
+#include <QtEndian>
+
+// part of a receive buffer. buf is implicitly shared, so forwarding a
+// packet never copies or deserializes it, the buffer just lives as long
+// as a slice of it does.
+struct PacketSlice
+{
+    QByteArray buf;
+    int offset;
+    int size;
+
+    PacketSlice() : offset(0), size(0) {}
+
+    const char *data() const { return buf.constData() + offset; }
+    quint16 peek16(int pos) const { return qFromBigEndian<quint16>((const uchar *)data() + pos); }
+
+    // everything after the first n bytes, sharing the same buffer
+    PacketSlice mid(int n) const
+    {
+        PacketSlice s = *this;
+        s.offset += n;
+        s.size -= n;
+        return s;
+    }
+};
+
+// the destination uid of a packet for several uids at once, the packet
+// then starts with [quint8 count][count quint16 uids]. never a real uid.
+const quint16 MULTICAST_UID = 0xFFFF;
+
+// a connection that starts with this uid instead of SET_UID asks where to
+// connect to: [quint8 count][count quint16 uids] of the game it is about
+// to join. the answer is a frame to PLACEMENT_UID with the address as a
+// QVariant string, empty for the server asked. SET_UID may follow.
+const quint16 PLACEMENT_UID = 0xFFFE;
+
+// relay links only: a frame to this uid is [quint32 raw size] + an LZ4
+// block of frames as they would have been sent one by one. never a real uid.
+const quint16 COMPRESSED_UID = 0xFFFD;
+
+// the uids and the packet behind them, false if the list does not fit
+bool splitMulticast(const PacketSlice &body, QVector<quint16> &uids, PacketSlice &packet);
+
+// splits what arrives on a socket into [quint32 size][size bytes] frames
+class FrameReader
+{
+public:
+    FrameReader();
+
+    // take everything the device has buffered
+    void fill(QIODevice *device);
+    // the next complete frame without its size, false until there is one
+    bool next(PacketSlice &frame);
+    // the bytes next() would take, size included, 0 until there is a frame
+    int pending() const;
+
+private:
+    QByteArray buf;
+    int offset;
+};
+
+#endif // PACKETSLICE_H
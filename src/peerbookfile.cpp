@@ -0,0 +1,166 @@
+#include "peerbookfile.h"
+
+#include <QDebug>
+#include <QVector>
+
+#include <string.h>
+
+namespace
+{
+    // host byte order, only ever read back by the master that wrote it
+    struct FileHeader
+    {
+        char magic[8];
+        quint32 version;
+        quint32 epoch;
+        quint32 sequence;
+        quint32 dirty;
+        quint32 reserved[2];
+    };
+
+    // the text form of an address, empty for an unused slot
+    enum { AddressSize = 48 };
+
+    // after the header: a slot per server, then a byte per uid. 0 is no
+    // server, 1 the master, k the server in slot k - 2
+    const qint64 SlotsOffset = sizeof(FileHeader);
+    const qint64 EntriesOffset = SlotsOffset + PeerBookFile::MaxServers * AddressSize;
+    const qint64 FileSize = EntriesOffset + 65536;
+
+    enum { NoServer = 0, Master = 1, FirstSlot = 2 };
+}
+
+PeerBookFile::PeerBookFile() :
+    base(0), found(false)
+{
+}
+
+bool PeerBookFile::open(const QString &path)
+{
+    file.setFileName(path);
+    if (!file.open(QIODevice::ReadWrite))
+    {
+        qDebug() << "peer book" << path << "failed:" << file.errorString();
+        return false;
+    }
+    const bool sized = file.size() == FileSize;
+    if ((!sized && !file.resize(FileSize)) || !(base = file.map(0, FileSize)))
+    {
+        qDebug() << "peer book" << path << "failed:" << file.errorString();
+        file.close();
+        base = 0;
+        return false;
+    }
+
+    FileHeader *h = (FileHeader *)base;
+    found = sized && !memcmp(h->magic, "peerbook", sizeof(h->magic)) && h->version == Version;
+    if (!found)
+    {
+        memset(base, 0, FileSize);
+        memcpy(h->magic, "peerbook", sizeof(h->magic));
+        h->version = Version;
+        return true;
+    }
+
+    for (int i = 0; i < MaxServers; ++i)
+    {
+        const char *slot = (const char *)base + SlotsOffset + i * AddressSize;
+        if (slot[0])
+            servers.insert(QHostAddress(QString::fromLatin1(slot, qstrnlen(slot, AddressSize))), i);
+    }
+    return true;
+}
+
+quint32 PeerBookFile::epoch() const
+{
+    return ((const FileHeader *)base)->epoch;
+}
+
+quint32 PeerBookFile::sequence() const
+{
+    return ((const FileHeader *)base)->sequence;
+}
+
+bool PeerBookFile::dirty() const
+{
+    return ((const FileHeader *)base)->dirty;
+}
+
+void PeerBookFile::setEpoch(quint32 epoch)
+{
+    ((FileHeader *)base)->epoch = epoch;
+}
+
+void PeerBookFile::setSequence(quint32 sequence)
+{
+    if (!base)
+        return;
+    ((FileHeader *)base)->sequence = sequence;
+    ((FileHeader *)base)->dirty = 0;
+}
+
+// -1 once every slot is taken
+int PeerBookFile::serverSlot(const QHostAddress &address)
+{
+    QHash<QHostAddress, int>::const_iterator it = servers.constFind(address);
+    if (it != servers.constEnd())
+        return it.value();
+    if (servers.size() == MaxServers)
+        return -1;
+
+    const int slot = servers.size();
+    const QByteArray text = address.toString().toLatin1();
+    memcpy(base + SlotsOffset + slot * AddressSize, text.constData(), qMin(text.size(), (int)AddressSize - 1));
+    servers.insert(address, slot);
+    return slot;
+}
+
+void PeerBookFile::insert(quint16 uid, const QHostAddress &address)
+{
+    if (!base)
+        return;
+    int entry = Master;
+    if (!address.isNull())
+    {
+        const int slot = serverSlot(address);
+        if (slot < 0)
+        {
+            // the uid is left out, a restart finds it missing until its
+            // server says it again
+            qDebug() << "peer book has no room for server" << address.toString();
+            remove(uid);
+            return;
+        }
+        entry = FirstSlot + slot;
+    }
+    // dirty first, a master stopped right after this knows its sequence
+    // no longer matches
+    ((FileHeader *)base)->dirty = 1;
+    base[EntriesOffset + uid] = entry;
+}
+
+void PeerBookFile::remove(quint16 uid)
+{
+    if (!base)
+        return;
+    ((FileHeader *)base)->dirty = 1;
+    base[EntriesOffset + uid] = NoServer;
+}
+
+void PeerBookFile::read(QHash<quint16, QHostAddress> &book) const
+{
+    QVector<QHostAddress> addresses(MaxServers);
+    for (QHash<QHostAddress, int>::const_iterator it = servers.constBegin(); it != servers.constEnd(); ++it)
+        addresses[it.value()] = it.key();
+
+    const uchar *entries = base + EntriesOffset;
+    for (int uid = 0; uid < 65536; ++uid)
+    {
+        if (entries[uid] == NoServer)
+            continue;
+        if (entries[uid] == Master)
+            book.insert(uid, QHostAddress());
+        else if (!addresses.at(entries[uid] - FirstSlot).isNull())
+            book.insert(uid, addresses.at(entries[uid] - FirstSlot));
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef PEERBOOKFILE_H
+#define PEERBOOKFILE_H
+
+#include <QFile>
+#include <QHash>
+#include <QtNetwork/QHostAddress>
+
+// -peerbook: the book of the master in a memory mapped file of fixed
+// layout, a byte per uid naming one of up to MaxServers servers, plus the
+// epoch and sequence the slaves are synced to. a restarted master has
+// the book back from there, keeps its epoch, and a slave that SYNCs gets
+// only the deltas it missed, none if it saw them all. the file is written
+// through the mapping as the book changes, a master that dies in between
+// loses nothing the kernel has.
+class PeerBookFile
+{
+public:
+    enum { Version = 1, MaxServers = 254 };
+
+    PeerBookFile();
+
+    // false if the file can not be mapped. one of another layout, or none
+    // at all, starts out as an empty book
+    bool open(const QString &path);
+    bool isOpen() const { return base != 0; }
+    // whether open found a book
+    bool loaded() const { return found; }
+
+    quint32 epoch() const;
+    quint32 sequence() const;
+    // the book changed after the last setSequence, the master stopped with
+    // a delta still pending
+    bool dirty() const;
+    void setEpoch(quint32 epoch);
+    // everything up to sequence went out
+    void setSequence(quint32 sequence);
+
+    // a null address is the master itself. nothing happens without open
+    void insert(quint16 uid, const QHostAddress &address);
+    void remove(quint16 uid);
+    void read(QHash<quint16, QHostAddress> &book) const;
+
+private:
+    QFile file;
+    uchar *base;
+    bool found;
+    // the server slots in use, the master itself is not one of them
+    QHash<QHostAddress, int> servers;
+
+    int serverSlot(const QHostAddress &address);
+};
+
+#endif // PEERBOOKFILE_H
@@ -1,19 +1,26 @@
 #include "peerconnection.h"
 
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
 
+// smaller batches are not worth compressing
+#define COMPRESS_MIN_BYTES 256
 
-PeerConnection::PeerConnection(QObject *parent) :
-    QTcpSocket(parent)
+int PeerConnection::coalesceUs = 0;
+bool PeerConnection::compress = false;
+
+PeerConnection::PeerConnection(const QHostAddress &address, int stream, QObject *parent) :
+    OutboundConnection(address, 9126, false, parent), stream(stream)
 {
 
     blocksize = 0;
-
-    this->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+    setCoalescing(coalesceUs);
 
     connect(this, SIGNAL(readyRead()),this,SLOT(readData()));
     connect(this, SIGNAL(disconnected()), this, SLOT(disconnection()));
 
-    connect(this, SIGNAL(removeRelay(QHostAddress)), this->parent(), SLOT(removePeerConnection(QHostAddress)));
+    connect(this, SIGNAL(removeRelay(QHostAddress,int)), this->parent(), SLOT(removePeerConnection(QHostAddress,int)));
 
 
 }
@@ -40,27 +47,66 @@ void PeerConnection::readData()
 
 }
 
-void PeerConnection::send(quint16 uid, quint16 port, QVariant packet)
+void PeerConnection::send(quint16 uid, quint16 port, const PacketSlice &packet)
 {
-    QByteArray reply;
-    QDataStream stream(&reply, QIODevice::WriteOnly);
-    stream.setVersion(QDataStream::Qt_4_2);
+    // [quint32 size][quint16 uid][quint16 port][packet]
+    uchar header[sizeof(quint32) + 2 * sizeof(quint16)];
+    qToBigEndian<quint32>(2 * sizeof(quint16) + packet.size, header);
+    qToBigEndian<quint16>(uid, header + sizeof(quint32));
+    qToBigEndian<quint16>(port, header + sizeof(quint32) + sizeof(quint16));
 
-    stream << (quint32)0;
-    stream << uid;
-    stream << port;
-    stream << packet;
+    OutboundConnection::send((const char *)header, sizeof(header), packet.data(), packet.size);
+}
 
-    stream.device()->seek(0);
-    stream <<(quint32)(reply.size() - sizeof(quint32));
+void PeerConnection::sendMulticast(const QVector<quint16> &uids, quint16 port, const PacketSlice &packet)
+{
+    // [quint32 size][quint16 MULTICAST_UID][quint16 port][quint8 count][count quint16 uids][packet]
+    const int list = 1 + uids.size() * sizeof(quint16);
+    QByteArray header(sizeof(quint32) + 2 * sizeof(quint16) + list, 0);
+    uchar *p = (uchar *)header.data();
+    qToBigEndian<quint32>(2 * sizeof(quint16) + list + packet.size, p);
+    qToBigEndian<quint16>(MULTICAST_UID, p + sizeof(quint32));
+    qToBigEndian<quint16>(port, p + sizeof(quint32) + sizeof(quint16));
+    p += sizeof(quint32) + 2 * sizeof(quint16);
+    *p++ = uids.size();
+    for (int i = 0; i < uids.size(); ++i)
+        qToBigEndian<quint16>(uids.at(i), p + i * sizeof(quint16));
+
+    OutboundConnection::send(header.constData(), header.size(), packet.data(), packet.size);
+}
 
-    if (this->write(reply) == -1)
-        this->abort();
+// [quint32 size][quint16 COMPRESSED_UID][quint16 0][quint32 raw size][LZ4 block]
+// once the socket did not take everything of the batches before, the link
+// is short of bandwidth rather than of packets. a block that would not be
+// smaller goes out as it is
+QByteArray PeerConnection::pack(const QByteArray &batch)
+{
+#ifdef HAVE_LZ4
+    if (!compress || bytesToWrite() == 0 || batch.size() < COMPRESS_MIN_BYTES)
+        return batch;
+
+    const int header = sizeof(quint32) + 2 * sizeof(quint16) + sizeof(quint32);
+    QByteArray block(header + LZ4_compressBound(batch.size()), 0);
+    const int packed = LZ4_compress_default(batch.constData(), block.data() + header, batch.size(), block.size() - header);
+    if (packed <= 0 || header + packed >= batch.size())
+        return batch;
+
+    block.resize(header + packed);
+    uchar *p = (uchar *)block.data();
+    qToBigEndian<quint32>(block.size() - sizeof(quint32), p);
+    qToBigEndian<quint16>(COMPRESSED_UID, p + sizeof(quint32));
+    qToBigEndian<quint16>(0, p + sizeof(quint32) + sizeof(quint16));
+    qToBigEndian<quint32>(batch.size(), p + sizeof(quint32) + 2 * sizeof(quint16));
+    linkStats.packedBatches++;
+    return block;
+#else
+    return batch;
+#endif
 }
 
 void PeerConnection::disconnection()
 {
-    emit removeRelay(this->peerAddress());
+    emit removeRelay(target(), stream);
     deleteLater();
 
 }
@@ -2,28 +2,43 @@
 #define PEERCONNECTION_H
 
 #include <QObject>
-#include <QtNetwork/QTcpSocket>
 #include <QtNetwork/QHostAddress>
 
+#include "outboundconnection.h"
+#include "packetslice.h"
 
-class PeerConnection : public QTcpSocket
+
+class PeerConnection : public OutboundConnection
 {
     Q_OBJECT
 public:
-    explicit PeerConnection(QObject *parent = 0);
+    explicit PeerConnection(const QHostAddress &address, int stream, QObject *parent = 0);
 
 public:
-    void send(quint16 uid, quint16 port, QVariant packet);
+    void send(quint16 uid, quint16 port, const PacketSlice &packet);
+    void sendMulticast(const QVector<quint16> &uids, quint16 port, const PacketSlice &packet);
+    int streamIndex() const { return stream; }
+
+    // -coalesce: microseconds a busy relay link holds a batch, see
+    // OutboundConnection::setCoalescing. -compress: batches for a link whose
+    // socket is backed up go out as one LZ4 block, only with HAVE_LZ4.
+    // set before the first link is opened
+    static int coalesceUs;
+    static bool compress;
+
+protected:
+    QByteArray pack(const QByteArray &batch);
 
 private:
     quint32 blocksize;
+    int stream;
 
 public slots:
     void readData();
     void disconnection();
 
 signals:
-    void removeRelay(QHostAddress address);
+    void removeRelay(QHostAddress address, int stream);
 
 };
 #endif // PEERCONNECTION_H
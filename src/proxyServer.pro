@@ -15,6 +15,12 @@ CONFIG   -= app_bundle
 
 TEMPLATE = app
 
+# qmake CONFIG+=lz4 for -compress on relay links
+lz4 {
+    DEFINES += HAVE_LZ4
+    LIBS += -llz4
+}
+
 
 SOURCES += main.cpp \
     proxyserver.cpp \
@@ -23,7 +29,16 @@ SOURCES += main.cpp \
     masterconnection.cpp \
     peerconnection.cpp \
     relayserver.cpp \
-    relayconnection.cpp
+    relayconnection.cpp \
+    packetslice.cpp \
+    outboundconnection.cpp \
+    packetqueue.cpp \
+    proxyworker.cpp \
+    metrics.cpp \
+    metricsserver.cpp \
+    timerwheel.cpp \
+    capturelog.cpp \
+    peerbookfile.cpp
 
 HEADERS += \
     proxyserver.h \
@@ -32,4 +47,13 @@ HEADERS += \
     masterconnection.h \
     peerconnection.h \
     relayserver.h \
-    relayconnection.h
+    relayconnection.h \
+    packetslice.h \
+    outboundconnection.h \
+    packetqueue.h \
+    proxyworker.h \
+    metrics.h \
+    metricsserver.h \
+    timerwheel.h \
+    capturelog.h \
+    peerbookfile.h
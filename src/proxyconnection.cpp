@@ -1,15 +1,30 @@
 
 #include "proxyconnection.h"
+#include "metrics.h"
 
-ProxyConnection::ProxyConnection(int socketDescriptor, QObject *parent) :
-    QTcpSocket(parent)
+#include <QDataStream>
+#include <QVariant>
+
+int ProxyConnection::idleTimeout = 0;
+int ProxyConnection::rateFrames = 0;
+int ProxyConnection::rateBytes = 0;
+int ProxyConnection::quantum = 0;
+
+namespace
+{
+    const qint64 TicksPerSecond = 1000 / TimerWheel::TickMs;
+}
+
+ProxyConnection::ProxyConnection(int socketDescriptor, Metrics *metrics, QObject *parent) :
+    QTcpSocket(parent), metrics(metrics), wheel(TimerWheel::current()), timeout(this, "timedOut"),
+    frameTokens(rateFrames * TicksPerSecond), byteTokens(rateBytes * TicksPerSecond), bucketTick(wheel->now()), deficit(0), readQueued(false),
+    capture(CaptureLog::writer())
 {
 
-    blocksize = 0;
     testing = false;
 
     if (this->setSocketDescriptor(socketDescriptor))
-        qDebug("socket set");
+        qVerbose("socket set");
     else
         qDebug("socket failed");
 
@@ -20,46 +35,113 @@ ProxyConnection::ProxyConnection(int socketDescriptor, QObject *parent) :
     connect(this, SIGNAL(readyRead()),this,SLOT(readData()));
     connect(this, SIGNAL(disconnected()), this, SLOT(disconnection()));
 
-    connect(this, SIGNAL(sendPacket(quint16,quint16,QVariant)), this->parent(), SLOT(sendPacket(quint16,quint16,QVariant)));
+    connect(this, SIGNAL(sendPacket(quint16,quint16,PacketSlice)), this->parent(), SLOT(sendPacket(quint16,quint16,PacketSlice)));
+    connect(this, SIGNAL(sendMulticast(QVector<quint16>,quint16,PacketSlice)), this->parent(), SLOT(sendMulticast(QVector<quint16>,quint16,PacketSlice)));
 
     connect(this, SIGNAL(addPeer(quint16,ProxyConnection*)), this->parent(), SLOT(addPeer(quint16,ProxyConnection*)));
     connect(this, SIGNAL(removePeer(quint16)), this->parent(), SLOT(removePeer(quint16)));
+    connect(this, SIGNAL(requestServer(QVector<quint16>)), this->parent(), SLOT(requestServer(QVector<quint16>)));
 
     uidSet = false;
 
+    lastActive = wheel->now();
+    wheel->start(&timeout, HANDSHAKE_TIMEOUT);
+
 }
 
-void ProxyConnection::readData()
+// true if the packet does not fit into the buckets any more. they hold one
+// second worth and fill up with every tick of the wheel, no clock is read
+bool ProxyConnection::overBudget(int size)
 {
-    QDataStream ins(this);
-    ins.setVersion(QDataStream::Qt_4_2);
+    if (rateFrames <= 0 && rateBytes <= 0)
+        return false;
 
-    while (ins.atEnd() == false)
+    if (bucketTick != wheel->now())
+    {
+        const qint64 ticks = qMin<quint64>(wheel->now() - bucketTick, TicksPerSecond);
+        bucketTick = wheel->now();
+        frameTokens = qMin<qint64>(rateFrames * TicksPerSecond, frameTokens + ticks * rateFrames);
+        byteTokens = qMin<qint64>(rateBytes * TicksPerSecond, byteTokens + ticks * rateBytes);
+    }
+    if ((rateFrames > 0 && frameTokens < TicksPerSecond) || (rateBytes > 0 && byteTokens < size * TicksPerSecond))
+    {
+        metrics->rateLimited++;
+        metrics->rateLimitedBytes += size;
+        return true;
+    }
+    frameTokens -= TicksPerSecond;
+    byteTokens -= size * TicksPerSecond;
+    return false;
+}
+
+// with -quantum a turn ends once the deficit is used up, the frames left
+// wait for a queued call behind everything else in the event loop. only
+// what is not worked through yet is copied by fill, so it waits for them.
+void ProxyConnection::readData()
+{
+    // a turn is queued already, sending more does not earn another quantum
+    if (readQueued)
+        return;
+    lastActive = wheel->now();
+    if (quantum > 0)
+        deficit += quantum;
+
+    bool filled = false;
+    PacketSlice frame;
+    for (;;)
     {
-        if (blocksize == 0)
+        const int size = reader.pending();
+        if (!size)
         {
-            if (this->bytesAvailable() < (int)sizeof(quint32))
+            if (filled)
+                break;
+            reader.fill(this);
+            filled = true;
+            continue;
+        }
+        if (quantum > 0)
+        {
+            if (deficit < size)
+            {
+                metrics->quantumYields++;
+                readQueued = true;
+                QMetaObject::invokeMethod(this, "queuedRead", Qt::QueuedConnection);
                 return;
-
-
-            ins >> (quint32&) blocksize;
-
+            }
+            deficit -= size;
         }
-        if (this->bytesAvailable() < blocksize)
-            return;
+        reader.next(frame);
 
         if (uidSet)
         {
-            
-            quint16 port;
-            quint16 uid;
-            QVariant packet;
-
-            ins >> port;
-            ins >> uid;
-            ins >> packet;
+            if (frame.size < 2 * (int)sizeof(quint16))
+                continue;
+            if (overBudget(frame.size))
+                continue;
+
+            quint16 port = frame.peek16(0);
+            quint16 uid = frame.peek16(2);
+            // the serialized QVariant is forwarded as it came in
+            PacketSlice packet = frame.mid(2 * sizeof(quint16));
+
+            if (capture && !testing)
+            {
+                if (capture->append(uidUser, uid, port, packet))
+                    metrics->captured++;
+                else
+                    metrics->captureDrops++;
+            }
+
             if (testing)
                 send(port, packet);
+            else if (uid == MULTICAST_UID)
+            {
+                // one upload for the whole game, the payload is shared by all of them
+                QVector<quint16> uids;
+                PacketSlice payload;
+                if (splitMulticast(packet, uids, payload))
+                    emit sendMulticast(uids, port, payload);
+            }
             else
                 emit sendPacket(uid, port, packet);
         }
@@ -68,55 +150,105 @@ void ProxyConnection::readData()
             //QString command;
             //if(command == "SET_UID")
             //{
-                quint16 uid;
-                ins >> uid;
+                if (frame.size < (int)sizeof(quint16))
+                    continue;
+
+                quint16 uid = frame.peek16(0);
+                if (uid == PLACEMENT_UID)
+                {
+                    QVector<quint16> uids;
+                    PacketSlice payload;
+                    if (splitMulticast(frame.mid(sizeof(quint16)), uids, payload))
+                        emit requestServer(uids);
+                    continue;
+                }
                 uidUser = uid;
                 if (uidUser == 1) 
                     testing = true;
-                else
+                else if (uidUser != MULTICAST_UID)
                     emit addPeer(uid, this);
 
                 uidSet = true;
-            //}
-            //else if (command == "REQUEST_SERVER")
-            {/*
-                if(this->parent()->isSlave())
-                {
-                    //return the master server
-
-                }
+                if (idleTimeout > 0)
+                    wheel->start(&timeout, idleTimeout);
                 else
-                {
-                   // return the list of slaves.
-
-                }
-*/
-            }
+                    TimerWheel::stop(&timeout);
+            //}
 
         }
-        blocksize = 0;
     }
+    // nothing left, an unused quantum is not saved up
+    deficit = 0;
 
 }
 
-void ProxyConnection::send(quint16 port, QVariant packet)
+void ProxyConnection::queuedRead()
 {
-    QByteArray reply;
-    QDataStream stream(&reply, QIODevice::WriteOnly);
-    stream.setVersion(QDataStream::Qt_4_2);
+    readQueued = false;
+    readData();
+}
 
-    stream << (quint32)0;
-    stream << port;
-    stream << packet;
+void ProxyConnection::send(quint16 port, const PacketSlice &packet)
+{
+    // [quint32 size][quint16 port][packet], the same bytes QDataStream wrote
+    uchar header[sizeof(quint32) + sizeof(quint16)];
+    qToBigEndian<quint32>(sizeof(quint16) + packet.size, header);
+    qToBigEndian<quint16>(port, header + sizeof(quint32));
 
+    if (this->write((const char *)header, sizeof(header)) == -1 ||
+        this->write(packet.data(), packet.size) == -1)
+    {
+        metrics->writeErrors++;
+        this->abort();
+        return;
+    }
+    metrics->packetsForwarded++;
+    metrics->bytesForwarded += packet.size;
+}
+
+void ProxyConnection::sendPlacement(const QString &address)
+{
+    // [quint32 size][quint16 PLACEMENT_UID][QVariant address]
+    QByteArray frame;
+    QDataStream stream(&frame, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_4_2);
+
+    stream << (quint32)0 << PLACEMENT_UID << QVariant(address);
     stream.device()->seek(0);
-    stream <<(quint32)(reply.size() - sizeof(quint32));
-    if (this->write(reply) == -1)
+    stream << (quint32)(frame.size() - sizeof(quint32));
+
+    if (this->write(frame) == -1)
         this->abort();
 }
 
+// no SET_UID in time, or nothing at all for idleTimeout. a frame of any
+// kind counts, a client with nothing to say can send one to itself
+void ProxyConnection::timedOut()
+{
+    if (!uidSet)
+    {
+        metrics->handshakeTimeouts++;
+        qVerbose() << "No SET_UID from" << peerAddress().toString();
+        abort();
+        return;
+    }
+    if (idleTimeout <= 0)
+        return;
+
+    const quint64 idle = TimerWheel::ticksFor(idleTimeout);
+    if (wheel->now() - lastActive < idle)
+    {
+        wheel->start(&timeout, (lastActive + idle - wheel->now()) * TimerWheel::TickMs);
+        return;
+    }
+    metrics->idleTimeouts++;
+    qVerbose() << "Idle peer:" << uidUser;
+    abort();
+}
+
 void ProxyConnection::disconnection()
 {
+    TimerWheel::stop(&timeout);
     emit removePeer(uidUser);
     deleteLater();
 }
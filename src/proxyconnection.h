@@ -5,30 +5,70 @@
 #include <QtNetwork/QTcpSocket>
 #include <QtNetwork/QHostAddress>
 
+#include "packetslice.h"
+#include "timerwheel.h"
+#include "capturelog.h"
 
+struct Metrics;
+
+// a connection that has not sent its SET_UID by then is closed
+#define HANDSHAKE_TIMEOUT 10000
 
 
 class ProxyConnection : public QTcpSocket
 {
     Q_OBJECT
 public:
-    explicit ProxyConnection(int socketDescriptor, QObject *parent = 0);
-    void send(quint16 port, QVariant packet);
+    // metrics are those of the thread the connection lives on
+    explicit ProxyConnection(int socketDescriptor, Metrics *metrics, QObject *parent = 0);
+    void send(quint16 port, const PacketSlice &packet);
+    void sendPlacement(const QString &address);
+
+    // ms a client may send nothing before it is closed, 0 for ever. set
+    // with -idle before the workers start
+    static int idleTimeout;
+    // -ratelimit: packets and bytes per second a client may send, 0 for
+    // no limit. -quantum: bytes of frames worked through per turn of the
+    // event loop, 0 for everything that came in
+    static int rateFrames;
+    static int rateBytes;
+    static int quantum;
 
 private:
-    quint32 blocksize;
+    FrameReader reader;
+    Metrics *metrics;
+    TimerWheel *wheel;
+    // first the handshake timeout, then the idle one
+    TimerWheel::Timer timeout;
+    quint64 lastActive;
+    // token buckets in parts of a packet or byte, one per tick of a second,
+    // as of wheel tick bucketTick
+    qint64 frameTokens;
+    qint64 byteTokens;
+    quint64 bucketTick;
+    int deficit;
+    // a turn cut short by the quantum is waiting in the event loop, at most
+    // one, readyRead leaves what comes in meanwhile to it
+    bool readQueued;
+    bool overBudget(int size);
+    // -capture, 0 without
+    CaptureLog::Writer *capture;
     quint16 uidUser;
     bool uidSet;
     bool testing;
 
 signals:
-    void sendPacket(quint16 uid, quint16 port, QVariant packet);
+    void sendPacket(quint16 uid, quint16 port, const PacketSlice &packet);
+    void sendMulticast(const QVector<quint16> &uids, quint16 port, const PacketSlice &packet);
     void addPeer(quint16 uid, ProxyConnection *socket);
     void removePeer(quint16 uid);
+    void requestServer(const QVector<quint16> &uids);
     
 public slots:
     void readData();
+    void queuedRead();
     void disconnection();
+    void timedOut();
     
 };
 
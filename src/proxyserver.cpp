@@ -1,8 +1,31 @@
 #include "proxyserver.h"
 
 #include "proxyconnection.h"
+#include "proxyworker.h"
 
-Server::Server(QObject* parent): QTcpServer(parent)
+#include <QThread>
+
+namespace
+{
+    // [quint32 size][the packet's QVariants], as the master reads them
+    QByteArray masterFrame(const QList<QVariant> &packet)
+    {
+        QByteArray frame;
+        QDataStream stream(&frame, QIODevice::WriteOnly);
+        stream.setVersion(QDataStream::Qt_4_2);
+
+        stream << (quint32)0;
+
+        for (int i = 0; i < packet.size(); ++i)
+            stream << packet.at(i);
+
+        stream.device()->seek(0);
+        stream <<(quint32)(frame.size() - sizeof(quint32));
+        return frame;
+    }
+}
+
+Server::Server(QObject* parent): QTcpServer(parent), relayQueue(this, "drainRelay"), statsTimer(this, "reportStats")
 {
     if (!listen(QHostAddress::Any, 9124))
         qDebug("Unable to start the server");
@@ -10,89 +33,278 @@ Server::Server(QObject* parent): QTcpServer(parent)
 
     enslaver = false;
     blocksize = 0;
+    masterEpoch = 0;
+    deltaSequence = 0;
+    resyncing = false;
+    nextWorker = 0;
+    relayStreams = 4;
+    nextPlacement = 0;
+    statsInterval = 0;
+
+    qRegisterMetaType<QVector<quint16> >("QVector<quint16>");
+
+    uidOwner = new QAtomicInt[65536];
+    for (int i = 0; i < 65536; ++i)
+        uidOwner[i] = -1;
 
     relayServer = new relayserver(this);
 }
 
 
-void Server::incomingConnection( int socketDescriptor )
+void Server::startWorkers(int count)
 {
-    ProxyConnection *connection    = new ProxyConnection(socketDescriptor, this );
+    for (int i = 0; i < count; ++i)
+    {
+        QThread *thread = new QThread(this);
+        ProxyWorker *worker = new ProxyWorker(i, this);
+        worker->moveToThread(thread);
+        workers.append(worker);
+        thread->start();
+    }
+    qDebug() << "Proxy connections spread over" << count << "threads";
+}
 
-    emit newConnection(connection);
+void Server::setRelayStreams(int count)
+{
+    relayStreams = qMax(1, count);
 }
 
+void Server::setStatsInterval(int seconds)
+{
+    statsInterval = qMax(0, seconds) * 1000;
+    if (statsInterval)
+        TimerWheel::current()->start(&statsTimer, statsInterval);
+    else
+        TimerWheel::stop(&statsTimer);
+}
 
-void Server::sendPacket(quint16 uid, quint16 port, QVariant packet)
+// read like the metrics server does, the workers keep counting meanwhile
+void Server::reportStats()
 {
-    if(peers.contains(uid))
-        peers.value(uid)->send(port, packet);
-    //if it's not a local connection, we are searching to whom we have to send the packet for relaying.
-    else if (peerBook.contains(uid))
+    Metrics total;
+    QList<const Metrics*> threads;
+    threads << &metrics;
+    for (int i = 0; i < workers.size(); ++i)
+        threads << &workers.at(i)->metrics;
+    foreach (const Metrics *m, threads)
     {
-        QHostAddress peerAddress = peerBook.value(uid);
+        total.packetsForwarded += m->packetsForwarded;
+        total.packetsRelayed += m->packetsRelayed;
+        total.unknownUid += m->unknownUid;
+        total.writeErrors += m->writeErrors;
+        total.handshakeTimeouts += m->handshakeTimeouts;
+        total.idleTimeouts += m->idleTimeouts;
+        total.rateLimited += m->rateLimited;
+    }
+    qDebug() << (int)clients << "clients," << total.packetsForwarded << "forwarded," << total.packetsRelayed << "relayed,"
+             << total.unknownUid << "for unknown uids," << total.writeErrors << "write errors,"
+             << total.handshakeTimeouts << "without SET_UID," << total.idleTimeouts << "idle,"
+             << total.rateLimited << "over budget";
 
-        if(peerConnections.contains(peerAddress))
-        {
-            peerConnections.value(peerAddress)->send(uid, port, packet);
+    // packets per batch and raw bytes per byte on the wire
+    foreach (const PeerConnection *link, relayLinks())
+    {
+        const OutboundConnection::Stats &s = link->stats();
+        if (!s.batches)
+            continue;
+        qDebug() << "relay" << link->target().toString() << link->streamIndex() << ":"
+                 << s.packets << "packets in" << s.batches << "batches," << (double)s.packets / s.batches << "per batch,"
+                 << s.held << "held," << s.packedBatches << "compressed, ratio" << (s.wireBytes ? (double)s.rawBytes / s.wireBytes : 1.0);
+    }
 
-        }
+    TimerWheel::current()->start(&statsTimer, statsInterval);
+}
+
+void Server::incomingConnection( int socketDescriptor )
+{
+    // round robin, the connection is set up on the thread of its worker.
+    // wrapped here, a counter that only ever grows overflows
+    ProxyWorker *worker = workers.at(nextWorker);
+    nextWorker = (nextWorker + 1) % workers.size();
+    QMetaObject::invokeMethod(worker, "addConnection", Qt::QueuedConnection, Q_ARG(int, socketDescriptor));
+}
+
+void Server::route(quint16 uid, quint16 port, const PacketSlice &packet)
+{
+    int owner = uidOwner[uid];
+    if (owner >= 0)
+        workers.at(owner)->post(uid, port, packet);
+    else
+        relayQueue.post(uid, port, packet);
+}
+
+void Server::relay(const QVector<quint16> &uids, quint16 port, const PacketSlice &packet)
+{
+    QVector<PacketQueue::Entry> batch(uids.size());
+    for (int i = 0; i < uids.size(); ++i)
+    {
+        batch[i].uid = uids.at(i);
+        batch[i].port = port;
+        batch[i].packet = packet;
+    }
+    relayQueue.post(batch);
+}
+
+static bool sameSlice(const PacketQueue::Entry &a, const PacketQueue::Entry &b)
+{
+    return a.port == b.port && a.packet.offset == b.packet.offset && a.packet.size == b.packet.size &&
+           a.packet.buf.constData() == b.packet.buf.constData();
+}
+
+void Server::drainRelay()
+{
+    QVector<PacketQueue::Entry> entries;
+    const qint64 since = relayQueue.take(entries);
+    metrics.observe(Metrics::nowUs() - since, entries.size());
+    metrics.crossThread += entries.size();
+
+    for (int i = 0; i < entries.size(); )
+    {
+        // a run sharing one slice was posted by relay()
+        int end = i + 1;
+        while (end < entries.size() && sameSlice(entries.at(i), entries.at(end)))
+            ++end;
+
+        if (end - i == 1)
+            sendPacket(entries.at(i).uid, entries.at(i).port, entries.at(i).packet);
         else
         {
-            // We open a new connection to a fellow relay server
-            PeerConnection* peerConnection = new PeerConnection(this);
-            peerConnections.insert(peerAddress, peerConnection);
+            QVector<quint16> uids(end - i);
+            for (int k = i; k < end; ++k)
+                uids[k - i] = entries.at(k).uid;
+            sendMulticast(uids, entries.at(i).port, entries.at(i).packet);
+        }
+        i = end;
+    }
+}
 
-            peerConnection->connectToHost(peerAddress, 9126);
-            while (peerConnection->state() != QAbstractSocket::ConnectedState)
-            {
-                if (peerConnection->state() != QAbstractSocket::ConnectingState)
-                {
-                    qDebug("connecting to master ...");
-                    peerConnection->connectToHost(peerAddress, 9126);
-                }
-                QCoreApplication::processEvents();
-            }
-            peerConnection->send(uid, port, packet);
+// one uid always takes the same stream so its packets stay in order,
+// a big packet for one game does not hold up the others
+PeerConnection *Server::relayStream(quint16 uid)
+{
+    QHostAddress peerAddress = peerBook.value(uid);
 
+    QVector<PeerConnection*> &streams = peerConnections[peerAddress];
+    if (streams.isEmpty())
+        streams.fill(0, relayStreams);
+    const int stream = uid % streams.size();
 
-        }
+    if (!streams.at(stream))
+    {
+        // We open a new connection to a fellow relay server, packets wait in its queue until it is up
+        streams[stream] = new PeerConnection(peerAddress, stream, this);
+    }
+    return streams.at(stream);
+}
+
+
+void Server::sendPacket(quint16 uid, quint16 port, const PacketSlice &packet)
+{
+    int owner = uidOwner[uid];
+    if (owner >= 0)
+        workers.at(owner)->post(uid, port, packet);
+    //if it's not a local connection, we are searching to whom we have to send the packet for relaying.
+    else if (peerBook.contains(uid))
+    {
+        relayStream(uid)->send(uid, port, packet);
+        metrics.packetsRelayed++;
+        metrics.bytesRelayed += packet.size;
     }
     else
     {
-        qDebug() << "No peer found" << uid;
+        metrics.unknownUid++;
+        qVerbose() << "No peer found" << uid;
     }
 }
 
-void Server::removePeerConnection(QHostAddress address)
+// one frame per relay stream with some of the uids. uids stay on their
+// own stream, so they still see their packets in order.
+void Server::sendMulticast(const QVector<quint16> &uids, quint16 port, const PacketSlice &packet)
 {
-    peerConnections.remove(address);
+    QHash<PeerConnection*, QVector<quint16> > perStream;
+    for (int i = 0; i < uids.size(); ++i)
+    {
+        const quint16 uid = uids.at(i);
+        int owner = uidOwner[uid];
+        if (owner >= 0)
+            workers.at(owner)->post(uid, port, packet);
+        else if (peerBook.contains(uid))
+            perStream[relayStream(uid)].append(uid);
+        else
+        {
+            metrics.unknownUid++;
+            qVerbose() << "No peer found" << uid;
+        }
+    }
 
+    for (QHash<PeerConnection*, QVector<quint16> >::const_iterator it = perStream.constBegin(); it != perStream.constEnd(); ++it)
+    {
+        if (it.value().size() == 1)
+            it.key()->send(it.value().first(), port, packet);
+        else
+            it.key()->sendMulticast(it.value(), port, packet);
+        metrics.packetsRelayed++;
+        metrics.bytesRelayed += packet.size;
+    }
 }
 
-void Server::addPeerBook(quint16 uid, QHostAddress address)
+QList<const PeerConnection*> Server::relayLinks() const
 {
-    qDebug() << "Adding peer in book:" << uid << "located on" << address.toString() ;
-    peerBook.insert(uid, address);
+    QList<const PeerConnection*> links;
+    foreach (const QVector<PeerConnection*> &streams, peerConnections)
+        for (int i = 0; i < streams.size(); ++i)
+            if (streams.at(i))
+                links << streams.at(i);
+    return links;
 }
 
-void Server::removePeerBook(quint16 uid)
+void Server::removePeerConnection(QHostAddress address, int stream)
 {
-    qDebug() << "Removing peer in book:" << uid;
-    peerBook.remove(uid);
+    if (!peerConnections.contains(address))
+        return;
+
+    QVector<PeerConnection*> &streams = peerConnections[address];
+    streams[stream] = 0;
+    if (streams.count(0) == streams.size())
+        peerConnections.remove(address);
 }
 
-void Server::addPeer(quint16 uid, ProxyConnection *socket)
+// what a relay connection read in one go, sorted out per worker so that
+// each of them is woken up and locked once
+void Server::relayBatch(const QVector<PacketQueue::Entry> &batch)
 {
+    QVector<QVector<PacketQueue::Entry> > perWorker(workers.size());
 
+    for (int i = 0; i < batch.size(); ++i)
+    {
+        const PacketQueue::Entry &e = batch.at(i);
+        int owner = uidOwner[e.uid];
+        if (owner >= 0)
+            perWorker[owner].append(e);
+        else
+            sendPacket(e.uid, e.port, e.packet);
+    }
 
-    //Closing all previous connections
-    if(peers.contains(uid))
-        peers.value(uid)->abort();
+    for (int i = 0; i < perWorker.size(); ++i)
+        if (!perWorker.at(i).isEmpty())
+            workers.at(i)->post(perWorker.at(i));
+}
 
-    qDebug() << "Adding peer:" << uid;
-    peers.insert(uid, socket);
+void Server::addPeerBook(quint16 uid, QHostAddress address)
+{
+    qVerbose() << "Adding peer in book:" << uid << "located on" << address.toString() ;
+    peerBook.insert(uid, address);
+}
 
+void Server::removePeerBook(quint16 uid)
+{
+    qVerbose() << "Removing peer in book:" << uid;
+    peerBook.remove(uid);
+}
+
+// a worker took a connection for uid, it already replaced any older one
+void Server::addPeer(quint16 uid)
+{
     // if we are slave, we should inform the master server of that new peer.
     if(isSlave())
     {
@@ -104,16 +316,14 @@ void Server::addPeer(quint16 uid, ProxyConnection *socket)
     else
     {
         // If we are not a slave we are a master (duh) and should still make all others slave aware of that peer.
-        masterServer->addPeer(uid, socket->peerAddress(), true);
+        // the slaves relay it to us, not to the address of the client
+        masterServer->addPeer(uid, QHostAddress(), true);
 
     }
 }
 
 void Server::removePeer(quint16 uid)
 {
-    qDebug() << "Removing peer :" << uid;
-    peers.remove(uid);
-
     // if we are slave, we should inform the master server of that new peer.
     if(isSlave())
     {
@@ -125,10 +335,41 @@ void Server::removePeer(quint16 uid)
     else
     {
         // If we are not a slave we are a master (duh) and should still make all others slave aware of that peer.
-        masterServer->removePeer(uid, this->serverAddress(), true);
+        masterServer->removePeer(uid, QHostAddress(), true);
     }
 }
 
+// a client asks where to connect to for a game with uids. the master
+// decides, a slave asks it.
+void Server::requestServer(int worker, quint32 request, const QVector<quint16> &uids)
+{
+    if (!isSlave())
+    {
+        QHostAddress where = masterServer->place(uids);
+        answerPlacement(worker, request, where.isNull() ? QString() : where.toString());
+        return;
+    }
+
+    QList<QVariant> list;
+    for (int i = 0; i < uids.size(); ++i)
+        list << uids.at(i);
+
+    const quint32 id = nextPlacement++;
+    placements.insert(id, qMakePair(worker, request));
+
+    QList<QVariant> data;
+    data << QString("REQUEST_SERVER");
+    data << id;
+    data << QVariant(list);
+    sendDataToMaster(data);
+}
+
+void Server::answerPlacement(int worker, quint32 request, const QString &address)
+{
+    QMetaObject::invokeMethod(workers.at(worker), "serverPlaced", Qt::QueuedConnection,
+                              Q_ARG(quint32, request), Q_ARG(QString, address));
+}
+
 bool Server::setSlave(QString masterAddress)
 {
 
@@ -136,20 +377,12 @@ bool Server::setSlave(QString masterAddress)
 
     if(!master.isNull())
         qDebug() << "master is :" << masterAddress;
-    masterConnection = new QTcpSocket(this);
-    masterConnection->connectToHost(master, 9125);
-    while (masterConnection->state() != QAbstractSocket::ConnectedState)
-    {
-        if (masterConnection->state() != QAbstractSocket::ConnectingState)
-        {
-            qDebug("connecting to master ...");
-            masterConnection->connectToHost(master, 9125);
-        }
-        QCoreApplication::processEvents();
-    }
+    // connects in the background and keeps reconnecting, what we send meanwhile is queued
+    masterConnection = new OutboundConnection(master, 9125, true, this);
 
     connect(masterConnection, SIGNAL(readyRead()),this,SLOT(readDataFromMaster()));
     connect(masterConnection, SIGNAL(disconnected()),this,SLOT(disconnectedFromMaster()));
+    connect(masterConnection, SIGNAL(connectionEstablished()),this,SLOT(syncWithMaster()));
 
 
     return !master.isNull();
@@ -164,37 +397,64 @@ bool Server::isSlave()
 bool Server::setMaster()
 {
     masterServer = new masterserver(this);
+    masterServer->setLocalLoad(&clients);
     enslaver = true;
     return enslaver;
 }
 
 void Server::readDataFromMaster()
 {
-    qDebug() << "Reading from master server";
-    QDataStream ins(masterConnection);
-    ins.setVersion(QDataStream::Qt_4_2);
+    qVerbose() << "Reading from master server";
+    QDataStream in(masterConnection);
+    in.setVersion(QDataStream::Qt_4_2);
 
-    while (ins.atEnd() == false)
+    while (in.atEnd() == false)
     {
         if (blocksize == 0)
         {
             if (masterConnection->bytesAvailable() < (int)sizeof(quint32))
                 return;
-            ins >> (quint32&) blocksize;
+            in >> (quint32&) blocksize;
         }
         if (masterConnection->bytesAvailable() < blocksize)
             return;
 
+        // every command is parsed from its own frame, what one leaves
+        // unread can not end up as the start of the next
+        const QByteArray body = masterConnection->read(blocksize);
+        blocksize = 0;
+        QDataStream ins(body);
+        ins.setVersion(QDataStream::Qt_4_2);
+
         QVariant command;
         ins >> command;
-        qDebug() << "command:" << command;
+        qVerbose() << "command:" << command;
         if(command == "PING")
         {
 
             QList<QVariant> data;
             data << QString("PONG");
+            data << (quint32)(int)clients;
             sendDataToMaster(data);
         }
+        else if (command == "SERVER_PLACED")
+        {
+            // an empty address is the master, ours means the client stays
+            QVariant id;
+            QVariant address;
+            ins >> id;
+            ins >> address;
+            if (placements.contains(id.toUInt()))
+            {
+                QPair<int, quint32> p = placements.take(id.toUInt());
+                QString where = address.toString();
+                if (where.isEmpty())
+                    where = master.toString();
+                else if (QHostAddress(where) == masterConnection->localAddress())
+                    where = QString();
+                answerPlacement(p.first, p.second, where);
+            }
+        }
         else if(command == "ADD_TO_PEERBOOK")
         {
             // We add it to the peer book.
@@ -212,44 +472,125 @@ void Server::readDataFromMaster()
             ins >> uid;
             removePeerBook(uid.toInt());
         }
-
-
-        blocksize = 0;
+        else if (command == "PEERBOOK_DELTA")
+            readPeerBookDelta(ins);
+        else if (command == "PEERBOOK_SNAPSHOT")
+            readPeerBookSnapshot(ins);
     }
 }
 
-void Server::sendDataToMaster(QList<QVariant> packet)
+void Server::readPeerBookDelta(QDataStream &ins)
 {
-    QByteArray reply;
-    QDataStream stream(&reply, QIODevice::WriteOnly);
-    stream.setVersion(QDataStream::Qt_4_2);
+    quint32 sequence;
+    ins >> sequence;
+
+    // already applied, replayed after a resync. the rest of the frame is
+    // dropped along with its buffer
+    if (sequence <= deltaSequence)
+        return;
+    if (sequence != deltaSequence + 1)
+    {
+        qDebug() << "Peer book deltas" << deltaSequence + 1 << "to" << sequence - 1 << "missed";
+        if (!resyncing)
+            syncWithMaster();
+        return;
+    }
+    deltaSequence = sequence;
+    resyncing = false;
 
-    stream << (quint32)0;
+    readPeerBookGroups(ins);
 
-    for (int i = 0; i < packet.size(); ++i)
-        stream << packet.at(i);
+    quint16 removes;
+    ins >> removes;
+    for (int i = 0; i < removes; ++i)
+    {
+        quint16 uid;
+        ins >> uid;
+        removePeerBook(uid);
+    }
+}
 
-    stream.device()->seek(0);
-    stream <<(quint32)(reply.size() - sizeof(quint32));
+void Server::readPeerBookSnapshot(QDataStream &ins)
+{
+    ins >> masterEpoch >> deltaSequence;
+    resyncing = false;
 
-    if (masterConnection->write(reply) == -1)
-        masterConnection->abort();
+    peerBook.clear();
+    readPeerBookGroups(ins);
 
+    qDebug() << "Peer book snapshot at" << deltaSequence << "with" << peerBook.size() << "peers";
 }
 
-void Server::disconnectedFromMaster()
+void Server::readPeerBookGroups(QDataStream &ins)
 {
-    // we should reconnect
-    masterConnection->connectToHost(master, 9125);
-    while (masterConnection->state() != QAbstractSocket::ConnectedState)
+    // the master sends us our own peers too, the same frame goes to every slave
+    QHostAddress self = masterConnection->localAddress();
+
+    quint16 groups;
+    ins >> groups;
+    for (int g = 0; g < groups; ++g)
     {
-        if (masterConnection->state() != QAbstractSocket::ConnectingState)
+        QString where;
+        quint16 count;
+        ins >> where >> count;
+        // no address means the peer is on the master itself
+        QHostAddress address = where.isEmpty() ? master : QHostAddress(where);
+
+        for (int i = 0; i < count; ++i)
         {
-            qDebug("Re-connecting to master ...");
-            masterConnection->connectToHost(master, 9125);
+            quint16 uid;
+            ins >> uid;
+            if (address != self)
+                addPeerBook(uid, address);
         }
-         QCoreApplication::processEvents();
+    }
+}
+
+void Server::sendDataToMaster(QList<QVariant> packet)
+{
+    const QByteArray reply = masterFrame(packet);
+    masterConnection->send(reply.constData(), reply.size());
+
+}
+
+void Server::disconnectedFromMaster()
+{
+    // the connection comes back by itself, a frame cut in half does not
+    blocksize = 0;
+    qDebug("disconnected from master");
 
+    // the answers are lost with it, the clients stay where they are
+    for (QHash<quint32, QPair<int, quint32> >::const_iterator it = placements.constBegin(); it != placements.constEnd(); ++it)
+        answerPlacement(it.value().first, it.value().second, QString());
+    placements.clear();
+}
+
+void Server::syncWithMaster()
+{
+    // a restarted master does not know our peers any more, so all of them
+    // are announced again, every ADD_PEER frame in a single write
+    QByteArray batch;
+    int announced = 0;
+    for (int uid = 0; uid < 65536; ++uid)
+    {
+        if ((int)uidOwner[uid] < 0)
+            continue;
+        QList<QVariant> add;
+        add << QString("ADD_PEER");
+        add << uid;
+        batch += masterFrame(add);
+        ++announced;
     }
-    qDebug("reconnected to master");
+    if (announced > 0)
+        masterConnection->send(batch.constData(), batch.size());
+
+    qDebug() << "Announced" << announced << "peers, syncing peer book from" << deltaSequence + 1;
+
+    QList<QVariant> data;
+    data << QString("SYNC");
+    data << masterEpoch;
+    data << deltaSequence;
+    sendDataToMaster(data);
+
+    resyncing = true;
 }
@@ -6,13 +6,21 @@
 #include <QtNetwork/QTcpServer>
 #include <QtNetwork/QTcpSocket>
 #include <QtCore/QCoreApplication>
+#include <QAtomicInt>
+#include <QDataStream>
 
 
 #include "masterserver.h"
 #include "relayserver.h"
 #include "peerconnection.h"
+#include "outboundconnection.h"
+#include "packetqueue.h"
+#include "packetslice.h"
+#include "metrics.h"
+#include "timerwheel.h"
 
 class ProxyConnection;
+class ProxyWorker;
 
 class Server : public QTcpServer
 {
@@ -24,36 +32,86 @@ public:
     bool isSlave();
     bool setMaster();
     void sendDataToMaster(QList<QVariant>);
+    void readPeerBookDelta(QDataStream &ins);
+    void readPeerBookSnapshot(QDataStream &ins);
+    void readPeerBookGroups(QDataStream &ins);
+
+    void startWorkers(int count);
+    // TCP streams opened to every other relay server, picked by uid
+    void setRelayStreams(int count);
+    // a line of totals every that many seconds, 0 for none
+    void setStatsInterval(int seconds);
+    // any thread: to the worker the uid is connected to, or to us for relaying
+    void route(quint16 uid, quint16 port, const PacketSlice &packet);
+    // any thread: uids on no worker, posted back to back so that drainRelay
+    // sends them on as one multicast per relay stream
+    void relay(const QVector<quint16> &uids, quint16 port, const PacketSlice &packet);
+    void sendMulticast(const QVector<quint16> &uids, quint16 port, const PacketSlice &packet);
+    // our thread: the open relay streams, for their stats
+    QList<const PeerConnection*> relayLinks() const;
+
+    // index into workers per uid, -1 if the uid is not connected here
+    QAtomicInt* uidOwner;
+    // fixed once the event loop runs, read from every thread
+    QList<ProxyWorker*> workers;
+    // written on our thread only
+    Metrics metrics;
+    // client connections on all workers, the load we report to the master
+    QAtomicInt clients;
 
 private:
-    QHash<quint16, ProxyConnection*> peers;
+    // peerBook and the relay connections are only touched on our thread
     QHash<quint16, QHostAddress> peerBook;
 
     // these are for replaying info
-    QHash<QHostAddress, PeerConnection*> peerConnections;
+    QHash<QHostAddress, QVector<PeerConnection*> > peerConnections;
+    int relayStreams;
+    PeerConnection *relayStream(quint16 uid);
 
     QHostAddress master;
     masterserver* masterServer;
     relayserver* relayServer;
     bool enslaver;
-    QTcpSocket* masterConnection;
+    OutboundConnection* masterConnection;
     quint32 blocksize;
+    // the peer book state we have from the master, kept over reconnects
+    // so that only the missed deltas have to be sent again
+    quint32 masterEpoch;
+    quint32 deltaSequence;
+    // a SYNC is on its way, deltas out of order are expected until it is answered
+    bool resyncing;
+
+    PacketQueue relayQueue;
+    int nextWorker;
+    TimerWheel::Timer statsTimer;
+    int statsInterval;
+
+    // REQUEST_SERVERs sent on to the master: worker and its request
+    QHash<quint32, QPair<int, quint32> > placements;
+    quint32 nextPlacement;
+    void answerPlacement(int worker, quint32 request, const QString &address);
 
 signals:
     void newConnection(ProxyConnection *connection);
 
 public slots:
-    void sendPacket(quint16 uid, quint16 port, QVariant packet);
-    void addPeer(quint16 uid, ProxyConnection* socket);
+    void sendPacket(quint16 uid, quint16 port, const PacketSlice &packet);
+    void drainRelay();
+    void addPeer(quint16 uid);
     void removePeer(quint16 uid);
 
-    void removePeerConnection(QHostAddress address);
+    void relayBatch(const QVector<PacketQueue::Entry> &batch);
+    void removePeerConnection(QHostAddress address, int stream);
 
     void addPeerBook(quint16 uid, QHostAddress address);
     void removePeerBook(quint16 uid);
 
+    void requestServer(int worker, quint32 request, const QVector<quint16> &uids);
+    void reportStats();
+
     void readDataFromMaster();
     void disconnectedFromMaster();
+    void syncWithMaster();
 
 protected:
     void incomingConnection(int socketDescriptor);
@@ -0,0 +1,163 @@
+#include "proxyworker.h"
+
+#include <QDebug>
+
+#include "proxyserver.h"
+#include "proxyconnection.h"
+#include "metrics.h"
+
+ProxyWorker::ProxyWorker(int id, Server *server) :
+    QObject(0), id(id), server(server), inbound(this, "drainInbound"), nextPlacement(0)
+{
+}
+
+void ProxyWorker::post(quint16 uid, quint16 port, const PacketSlice &packet)
+{
+    inbound.post(uid, port, packet);
+}
+
+void ProxyWorker::post(const QVector<PacketQueue::Entry> &batch)
+{
+    inbound.post(batch);
+}
+
+void ProxyWorker::addConnection(int socketDescriptor)
+{
+    ProxyConnection *connection = new ProxyConnection(socketDescriptor, &metrics, this);
+    server->clients.ref();
+    connect(connection, SIGNAL(destroyed()), this, SLOT(connectionClosed()));
+}
+
+void ProxyWorker::connectionClosed()
+{
+    server->clients.deref();
+}
+
+// the server decides on its own thread, or asks the master
+void ProxyWorker::requestServer(const QVector<quint16> &uids)
+{
+    ProxyConnection *socket = qobject_cast<ProxyConnection*>(sender());
+    const quint32 request = nextPlacement++;
+    placements.insert(request, socket);
+    QMetaObject::invokeMethod(server, "requestServer", Qt::QueuedConnection,
+                              Q_ARG(int, id), Q_ARG(quint32, request), Q_ARG(QVector<quint16>, uids));
+}
+
+void ProxyWorker::serverPlaced(quint32 request, const QString &address)
+{
+    QPointer<ProxyConnection> socket = placements.take(request);
+    if (socket)
+        socket->sendPlacement(address);
+}
+
+void ProxyWorker::sendPacket(quint16 uid, quint16 port, const PacketSlice &packet)
+{
+    ProxyConnection *peer = peers.value(uid);
+    if (peer)
+    {
+        metrics.peerHits++;
+        peer->send(port, packet);
+    }
+    else
+    {
+        metrics.peerMisses++;
+        server->route(uid, port, packet);
+    }
+}
+
+// the uids here get the slice right away, every other worker gets one
+// batch with its uids and the relay one for all the rest
+void ProxyWorker::sendMulticast(const QVector<quint16> &uids, quint16 port, const PacketSlice &packet)
+{
+    QVector<QVector<PacketQueue::Entry> > perWorker(server->workers.size());
+    QVector<quint16> remote;
+
+    PacketQueue::Entry e;
+    e.port = port;
+    e.packet = packet;
+    for (int i = 0; i < uids.size(); ++i)
+    {
+        ProxyConnection *peer = peers.value(uids.at(i));
+        if (peer)
+        {
+            metrics.peerHits++;
+            peer->send(port, packet);
+            continue;
+        }
+        metrics.peerMisses++;
+        int owner = server->uidOwner[uids.at(i)];
+        e.uid = uids.at(i);
+        if (owner >= 0)
+            perWorker[owner].append(e);
+        else
+            remote.append(e.uid);
+    }
+
+    for (int i = 0; i < perWorker.size(); ++i)
+        if (!perWorker.at(i).isEmpty())
+            server->workers.at(i)->post(perWorker.at(i));
+    if (!remote.isEmpty())
+        server->relay(remote, port, packet);
+}
+
+void ProxyWorker::addPeer(quint16 uid, ProxyConnection *socket)
+{
+    //Closing all previous connections
+    if (peers.contains(uid))
+        peers.value(uid)->abort();
+
+    qVerbose() << "Adding peer:" << uid;
+    peers.insert(uid, socket);
+
+    // an older connection for the uid on another worker goes away there
+    int previous = server->uidOwner[uid].fetchAndStoreOrdered(id);
+    if (previous >= 0 && previous != id)
+        QMetaObject::invokeMethod(server->workers.at(previous), "kick", Qt::QueuedConnection, Q_ARG(quint16, uid));
+
+    QMetaObject::invokeMethod(server, "addPeer", Qt::QueuedConnection, Q_ARG(quint16, uid));
+}
+
+void ProxyWorker::removePeer(quint16 uid)
+{
+    // replaced by a newer connection, here or on another worker
+    if (peers.value(uid) != sender())
+        return;
+
+    qVerbose() << "Removing peer :" << uid;
+    peers.remove(uid);
+    server->uidOwner[uid].testAndSetOrdered(id, -1);
+
+    QMetaObject::invokeMethod(server, "removePeer", Qt::QueuedConnection, Q_ARG(quint16, uid));
+}
+
+void ProxyWorker::kick(quint16 uid)
+{
+    ProxyConnection *socket = peers.value(uid);
+    // the uid came back to us again in the meantime
+    if (!socket || (int)server->uidOwner[uid] == id)
+        return;
+    // out of peers first, removePeer must not report the uid as gone
+    peers.remove(uid);
+    socket->abort();
+}
+
+void ProxyWorker::drainInbound()
+{
+    QVector<PacketQueue::Entry> entries;
+    const qint64 since = inbound.take(entries);
+    metrics.observe(Metrics::nowUs() - since, entries.size());
+    metrics.crossThread += entries.size();
+
+    for (int i = 0; i < entries.size(); ++i)
+    {
+        const PacketQueue::Entry &e = entries.at(i);
+        ProxyConnection *peer = peers.value(e.uid);
+        if (peer)
+            peer->send(e.port, e.packet);
+        else
+        {
+            metrics.unknownUid++;
+            qVerbose() << "No peer found" << e.uid;
+        }
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef PROXYWORKER_H
+#define PROXYWORKER_H
+
+#include <QObject>
+#include <QHash>
+#include <QPointer>
+
+#include "packetqueue.h"
+#include "metrics.h"
+
+class Server;
+class ProxyConnection;
+
+// owns the ProxyConnections placed on one thread. packets between two of
+// them never leave the thread, everything else goes through Server::route.
+class ProxyWorker : public QObject
+{
+    Q_OBJECT
+public:
+    explicit ProxyWorker(int id, Server *server);
+
+    // any thread: deliver to the connection of uid on this worker
+    void post(quint16 uid, quint16 port, const PacketSlice &packet);
+    void post(const QVector<PacketQueue::Entry> &batch);
+
+    // written on the thread of the worker only
+    Metrics metrics;
+
+private:
+    int id;
+    Server *server;
+    QHash<quint16, ProxyConnection*> peers;
+    PacketQueue inbound;
+    // connections waiting for the answer to their REQUEST_SERVER
+    QHash<quint32, QPointer<ProxyConnection> > placements;
+    quint32 nextPlacement;
+
+public slots:
+    void addConnection(int socketDescriptor);
+
+    void sendPacket(quint16 uid, quint16 port, const PacketSlice &packet);
+    void sendMulticast(const QVector<quint16> &uids, quint16 port, const PacketSlice &packet);
+    void addPeer(quint16 uid, ProxyConnection* socket);
+    void removePeer(quint16 uid);
+
+    void kick(quint16 uid);
+    void drainInbound();
+
+    void connectionClosed();
+    void requestServer(const QVector<quint16> &uids);
+    void serverPlaced(quint32 request, const QString &address);
+
+};
+
+#endif // PROXYWORKER_H
@@ -1,13 +1,19 @@
 #include "relayconnection.h"
+#include "metrics.h"
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+// a compressed block unpacks to no more than this
+#define INFLATE_MAX_BYTES (16 << 20)
 
 RelayConnection::RelayConnection(int socketDescriptor, QObject *parent) :
     QTcpSocket(parent)
 {
 
-    blocksize = 0;
-
     if (this->setSocketDescriptor(socketDescriptor))
-        qDebug("socket set");
+        qVerbose("socket set");
     else
         qDebug("socket failed");
 
@@ -16,42 +22,95 @@ RelayConnection::RelayConnection(int socketDescriptor, QObject *parent) :
     connect(this, SIGNAL(readyRead()),this,SLOT(readData()));
     connect(this, SIGNAL(disconnected()), this, SLOT(disconnection()));
 
-    connect(this, SIGNAL(sendPacket(quint16,quint16,QVariant)), this->parent(), SLOT(sendPacket(quint16,quint16,QVariant)));
-
 }
 
 void RelayConnection::readData()
 {
-    QDataStream ins(this);
-    ins.setVersion(QDataStream::Qt_4_2);
-
-    while (ins.atEnd() == false)
-    {
-        if (blocksize == 0)
-        {
-            if (this->bytesAvailable() < (int)sizeof(quint32))
-                return;
-
+    reader.fill(this);
 
-            ins >> (quint32&) blocksize;
+    QVector<PacketQueue::Entry> batch;
+    PacketSlice frame;
+    while (reader.next(frame))
+        unpack(frame, batch, false);
 
-        }
-        if (this->bytesAvailable() < blocksize)
-            return;
+    if (!batch.isEmpty())
+        emit packetBatch(batch);
 
-        quint16 uid;
-        quint16 port;
-        QVariant packet;
-        ins >> uid;
-        ins >> port;
-        ins >> packet;
+}
 
-        emit sendPacket(uid, port, packet);
+void RelayConnection::unpack(const PacketSlice &frame, QVector<PacketQueue::Entry> &batch, bool inner)
+{
+    if (frame.size < 2 * (int)sizeof(quint16))
+        return;
+
+    PacketQueue::Entry e;
+    e.uid = frame.peek16(0);
+    e.port = frame.peek16(2);
+    e.packet = frame.mid(2 * sizeof(quint16));
+    if (e.uid == COMPRESSED_UID)
+    {
+        // blocks are never nested
+        if (!inner)
+            inflate(e.packet, batch);
+        return;
+    }
+    if (e.uid != MULTICAST_UID)
+    {
+        batch.append(e);
+        return;
+    }
 
+    // every uid of the list gets the same slice
+    QVector<quint16> uids;
+    PacketSlice payload;
+    if (!splitMulticast(e.packet, uids, payload))
+        return;
+    e.packet = payload;
+    for (int i = 0; i < uids.size(); ++i)
+    {
+        e.uid = uids.at(i);
+        batch.append(e);
+    }
+}
 
-        blocksize = 0;
+// [quint32 raw size][LZ4 block], the packets are slices of the unpacked buffer
+void RelayConnection::inflate(const PacketSlice &block, QVector<PacketQueue::Entry> &batch)
+{
+#ifdef HAVE_LZ4
+    if (block.size < (int)sizeof(quint32))
+        return;
+    const quint32 rawSize = qFromBigEndian<quint32>((const uchar *)block.data());
+    if (rawSize > INFLATE_MAX_BYTES)
+        return;
+
+    QByteArray raw(rawSize, 0);
+    if (LZ4_decompress_safe(block.data() + sizeof(quint32), raw.data(), block.size - (int)sizeof(quint32), rawSize) != (int)rawSize)
+    {
+        qDebug() << "broken compressed block from" << peerAddress().toString();
+        return;
     }
 
+    int pos = 0;
+    while (raw.size() - pos >= (int)sizeof(quint32))
+    {
+        const quint32 size = qFromBigEndian<quint32>((const uchar *)raw.constData() + pos);
+        if ((quint32)(raw.size() - pos - sizeof(quint32)) < size)
+            break;
+        PacketSlice frame;
+        frame.buf = raw;
+        frame.offset = pos + sizeof(quint32);
+        frame.size = size;
+        pos += sizeof(quint32) + size;
+        unpack(frame, batch, true);
+    }
+#else
+    Q_UNUSED(block);
+    Q_UNUSED(batch);
+    static bool said = false;
+    if (!said)
+        qDebug() << "compressed blocks from" << peerAddress().toString() << "dropped, built without HAVE_LZ4";
+    said = true;
+#endif
 }
 
 void RelayConnection::disconnection()
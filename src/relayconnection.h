@@ -3,6 +3,9 @@
 
 #include <QtNetwork/QTcpSocket>
 
+#include "packetslice.h"
+#include "packetqueue.h"
+
 class RelayConnection : public QTcpSocket
 {
     Q_OBJECT
@@ -10,14 +13,18 @@ public:
     explicit RelayConnection(int socketDescriptor, QObject *parent = 0);
 
 private:
-    quint32 blocksize;
+    FrameReader reader;
+    // one frame of the link, or all frames of a compressed block, into batch
+    void unpack(const PacketSlice &frame, QVector<PacketQueue::Entry> &batch, bool inner);
+    void inflate(const PacketSlice &block, QVector<PacketQueue::Entry> &batch);
 
 public slots:
     void readData();
     void disconnection();
 
 signals:
-    void sendPacket(quint16 uid, quint16 port, QVariant packet);
+    // everything complete in one read, in the order it arrived
+    void packetBatch(const QVector<PacketQueue::Entry> &batch);
 
 };
 
@@ -12,5 +12,7 @@ relayserver::relayserver(QObject* parent): QTcpServer(parent)
 void relayserver::incomingConnection( int socketDescriptor )
 {
     RelayConnection *connection    = new RelayConnection(socketDescriptor, this );
+    // the packets go straight to our proxy
+    connect(connection, SIGNAL(packetBatch(QVector<PacketQueue::Entry>)), this->parent(), SLOT(relayBatch(QVector<PacketQueue::Entry>)));
     emit newConnection(connection);
 }
@@ -0,0 +1,136 @@
+#include "timerwheel.h"
+
+#include <QThreadStorage>
+
+#include <string.h>
+
+#include "metrics.h"
+
+namespace
+{
+    QThreadStorage<TimerWheel*> wheels;
+
+    quint64 elapsedTicks()
+    {
+        return Metrics::nowUs() / (TimerWheel::TickMs * 1000);
+    }
+}
+
+TimerWheel::Timer::Timer(QObject *receiver, const char *member) :
+    receiver(receiver), member(member), next(0), pprev(0), due(0)
+{
+}
+
+TimerWheel::Timer::~Timer()
+{
+    TimerWheel::stop(this);
+}
+
+TimerWheel *TimerWheel::current()
+{
+    if (!wheels.hasLocalData())
+        wheels.setLocalData(new TimerWheel);
+    return wheels.localData();
+}
+
+TimerWheel::TimerWheel() :
+    QObject(0), ticks(elapsedTicks())
+{
+    memset(wheel, 0, sizeof(wheel));
+    connect(&timer, SIGNAL(timeout()), this, SLOT(tick()));
+    timer.start(TickMs);
+}
+
+// the thread goes away, timers that outlive us are left unlinked
+TimerWheel::~TimerWheel()
+{
+    for (int level = 0; level < Levels; ++level)
+        for (int slot = 0; slot < Slots; ++slot)
+            for (Timer *t = take(level, slot); t; t = t->next)
+                t->pprev = 0;
+}
+
+void TimerWheel::start(Timer *timer, int ms)
+{
+    add(timer, ticks + ticksFor(ms));
+}
+
+void TimerWheel::stop(Timer *timer)
+{
+    if (!timer->pprev)
+        return;
+    *timer->pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+    timer->pprev = 0;
+}
+
+void TimerWheel::link(Timer **head, Timer *timer)
+{
+    timer->next = *head;
+    if (timer->next)
+        timer->next->pprev = &timer->next;
+    timer->pprev = head;
+    *head = timer;
+}
+
+// at tick due, or the next one if that has passed
+void TimerWheel::add(Timer *timer, quint64 due)
+{
+    stop(timer);
+    timer->due = due > ticks ? due : ticks + 1;
+    const quint64 delta = timer->due - ticks;
+    int level = 0;
+    while (level < Levels - 1 && delta >= Q_UINT64_C(1) << (Bits * (level + 1)))
+        ++level;
+    const quint64 range = Q_UINT64_C(1) << (Bits * Levels);
+    const quint64 at = delta < range ? timer->due : ticks + range - 1;
+    link(&wheel[level][(at >> (Bits * level)) & (Slots - 1)], timer);
+}
+
+TimerWheel::Timer *TimerWheel::take(int level, int slot)
+{
+    Timer *t = wheel[level][slot];
+    wheel[level][slot] = 0;
+    return t;
+}
+
+// one tick: the slots of the higher levels that just came up go down, then
+// everything in the slot of level 0 is due. a timer on the list can still
+// be stopped or started again by the ones called before it.
+void TimerWheel::advance()
+{
+    ++ticks;
+    for (int level = 1; level < Levels && !(ticks & ((Q_UINT64_C(1) << (Bits * level)) - 1)); ++level)
+    {
+        Timer *t = take(level, (ticks >> (Bits * level)) & (Slots - 1));
+        while (t)
+        {
+            Timer *next = t->next;
+            t->pprev = 0;
+            if (t->due <= ticks)
+                link(&wheel[0][ticks & (Slots - 1)], t);
+            else
+                add(t, t->due);
+            t = next;
+        }
+    }
+
+    Timer *expired = take(0, ticks & (Slots - 1));
+    if (expired)
+        expired->pprev = &expired;
+    while (expired)
+    {
+        Timer *t = expired;
+        stop(t);
+        QMetaObject::invokeMethod(t->receiver, t->member, Qt::DirectConnection);
+    }
+}
+
+// a busy event loop skips timeouts of the QTimer, the ticks catch up
+void TimerWheel::tick()
+{
+    const quint64 target = elapsedTicks();
+    while (ticks < target)
+        advance();
+}
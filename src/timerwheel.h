@@ -0,0 +1,65 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <QObject>
+#include <QTimer>
+
+// the timeouts of everything on one thread behind a single QTimer. a tick
+// is TickMs, the slots of level l are 256^l ticks wide, so three levels
+// cover 19 days and whatever is due later waits on the last one. starting,
+// stopping and every tick are O(1) however many timers there are, there
+// is no QTimer per connection.
+class TimerWheel : public QObject
+{
+    Q_OBJECT
+public:
+    enum { TickMs = 100, Bits = 8, Slots = 1 << Bits, Levels = 3 };
+
+    // usually a member of the object it calls. when due, member is called
+    // as a slot of receiver on the thread of the wheel
+    class Timer
+    {
+    public:
+        Timer(QObject *receiver, const char *member);
+        ~Timer();
+        bool isActive() const { return pprev != 0; }
+
+    private:
+        friend class TimerWheel;
+        QObject *receiver;
+        const char *member;
+        Timer *next;
+        Timer **pprev;
+        quint64 due;
+    };
+
+    // the wheel of the calling thread, made on first use
+    static TimerWheel *current();
+
+    // ms from now, rounded up to whole ticks. starting an active timer moves it
+    void start(Timer *timer, int ms);
+    static void stop(Timer *timer);
+    // ticks so far, cheap enough to take for every packet
+    quint64 now() const { return ticks; }
+    static quint64 ticksFor(int ms) { return (ms + TickMs - 1) / TickMs; }
+
+    ~TimerWheel();
+
+private:
+    TimerWheel();
+
+    QTimer timer;
+    quint64 ticks;
+    Timer *wheel[Levels][Slots];
+
+    void add(Timer *timer, quint64 due);
+    static void link(Timer **head, Timer *timer);
+    Timer *take(int level, int slot);
+    void advance();
+
+private slots:
+    void tick();
+
+};
+
+#endif // TIMERWHEEL_H